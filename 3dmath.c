@@ -25,54 +25,76 @@ static inline float sqr(float v)
 {
 	return v*v;
 }
-void vector_copy(float* a, float* b)
+void vector_copy(const float* a, float* b)
 {
 	b[0] = a[0];
 	b[1] = a[1];
 	b[2] = a[2];
 }
 
-void printv(char* str, float* v)
+void printv(char* str, const float* v)
 {
 	printf("%s <%f %f %f>\n", str, v[0], v[1], v[2]);
 }
 
-void add(float* a, float* b, float* out)
+void add(const float* a, const float* b, float* out)
 {
 	out[0] = a[0] + b[0];
 	out[1] = a[1] + b[1];
 	out[2] = a[2] + b[2];
 }
-void subtract(float* a, float* b, float* out)
+void subtract(const float* a, const float* b, float* out)
 {
 	out[0] = a[0] - b[0];
 	out[1] = a[1] - b[1];
 	out[2] = a[2] - b[2];
 }
-void multiply(float* a, float* b, float* out)
+void multiply(const float* a, const float* b, float* out)
 {
 	out[0] = a[0] * b[0];
 	out[1] = a[1] * b[1];
 	out[2] = a[2] * b[2];
 }
-void scale(float* a, float b, float* out)
+void scale(const float* a, float b, float* out)
 {
 	out[0] = a[0] * b;
 	out[1] = a[1] * b;
 	out[2] = a[2] * b;
 }
-float dot(float* a, float* b)
+float dot(const float* a, const float* b)
 {
 	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
-void cross(float* a, float*b, float* out)
+void cross(const float* a, const float* b, float* out)
 {
 	out[0] = a[1]*b[2] - a[2]*b[1];
 	out[1] = a[2]*b[0] - b[2]*a[0];
 	out[2] = a[0]*b[1] - a[1]*b[0];
 }
 
-float length(float* a)
+// out = m * a
+void matrix_multiply(const float m[3][3], const float* a, float* out)
+{
+	float x = m[0][0]*a[0] + m[0][1]*a[1] + m[0][2]*a[2];
+	float y = m[1][0]*a[0] + m[1][1]*a[1] + m[1][2]*a[2];
+	float z = m[2][0]*a[0] + m[2][1]*a[1] + m[2][2]*a[2];
+	out[0] = x;
+	out[1] = y;
+	out[2] = z;
+}
+
+// out = transpose(m) * a, the inverse for rotation matrices
+void matrix_multiply_transposed(const float m[3][3], const float* a, float* out)
+{
+	float x = m[0][0]*a[0] + m[1][0]*a[1] + m[2][0]*a[2];
+	float y = m[0][1]*a[0] + m[1][1]*a[1] + m[2][1]*a[2];
+	float z = m[0][2]*a[0] + m[1][2]*a[1] + m[2][2]*a[2];
+	out[0] = x;
+	out[1] = y;
+	out[2] = z;
+}
+
+float length(const float* a)
 {
 	return sqrt(sqr(a[0]) + sqr(a[1]) + sqr(a[2]));
 }
@@ -86,15 +108,14 @@ void normalize(float* a)
 }
 
 
-float* quadratic_formula(float a, float b, float c)
+// the zeroes of a*x^2 + b*x + c into results, or 0 if there are none
+int quadratic_zeroes(float a, float b, float c, float* results)
 {
-	float* results = malloc(sizeof(float) * 2);
-	
 	float det = sqr(b) - 4 * a * c;
 	
 	if(det < 0) {
 		results[0] = NAN;
-		return results;
+		return 0;
 	}
 	
 	det = sqrt(det);
@@ -102,10 +123,10 @@ float* quadratic_formula(float a, float b, float c)
 	results[0] = (-b - det) / (2 * a);
 	results[1] = (-b + det) / (2 * a);
 	
-	return results;
+	return 1;
 }
 
-void interpolate(float* a, float* b, float i, float* c)
+void interpolate(const float* a, const float* b, float i, float* c)
 {
 	c[0] = b[0] * i + a[0] * (1 - i);
 	c[1] = b[1] * i + a[1] * (1 - i);
@@ -127,7 +148,7 @@ float snells_law(float t1, float n1, float n2)
 }
 
 // do-it-all function for calculating
-void smellit(float* a, float* n, float n1, float n2, float* b)
+void smellit(float* a, const float* n, float n1, float n2, float* b)
 {
 	scale(a, -1, a);
 	normalize(a);
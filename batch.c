@@ -0,0 +1,231 @@
+// batch rendering
+// a manifest lists many renders, one per line as "width height scene.json output.ppm",
+// the same as the arguments of a single render. blank lines and lines starting with #
+// are skipped. all of them run in one process with the same options: each scene is read
+// and set up once, when its first render comes up, and let go of after its last one, the
+// render threads are started once and kept for every frame, and an image is written in
+// the background while the next one renders. a scene that can't be loaded only fails
+// the renders that use it.
+
+typedef struct {
+	int width;
+	int height;
+	char* scene;
+	char* output;
+	int line; // of the manifest
+	int last_use; // the last job with the same scene
+} BatchJob;
+
+typedef struct {
+	char* path;
+	CompiledScene* compiled; // NULL if it couldn't be loaded
+	double seconds; // reading and setting it up
+} BatchScene;
+
+typedef struct {
+	int failures;
+	int written;
+	double write_seconds;
+	pthread_mutex_t lock;
+} BatchTotals;
+
+// the jobs of the manifest at path, exits if it can't be read or a line isn't a job
+BatchJob* read_batch_manifest(char* path, int* num_jobs)
+{
+	FILE* file = fopen(path, "r");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Error: could not open batch manifest %s\n", path);
+		exit(1);
+	}
+
+	int capacity = 16;
+	BatchJob* jobs = malloc(sizeof(BatchJob) * capacity);
+	*num_jobs = 0;
+
+	char line[4096];
+	char scene[2048];
+	char output[2048];
+	int number = 0;
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		number ++;
+		char* start = line;
+		while(isspace(*start))
+			start ++;
+		if(*start == '\0' || *start == '#')
+			continue;
+
+		BatchJob job;
+		char extra;
+		if(sscanf(start, "%d %d %2047s %2047s %c", &job.width, &job.height, scene, output, &extra) != 4
+			|| job.width < 1 || job.height < 1)
+		{
+			fprintf(stderr, "Error: line %d of %s should be \"width height scene.json output.ppm\"\n", number, path);
+			exit(1);
+		}
+
+		job.scene = strdup(scene);
+		job.output = strdup(output);
+		job.line = number;
+		if(*num_jobs == capacity)
+		{
+			capacity *= 2;
+			jobs = realloc(jobs, sizeof(BatchJob) * capacity);
+		}
+		jobs[(*num_jobs) ++] = job;
+	}
+	fclose(file);
+
+	int k;
+	int j;
+	for(k = 0; k < *num_jobs; k ++)
+	{
+		jobs[k].last_use = k;
+		for(j = k + 1; j < *num_jobs; j ++)
+		{
+			if(strcmp(jobs[j].scene, jobs[k].scene) == 0)
+				jobs[k].last_use = j;
+		}
+	}
+	return jobs;
+}
+
+// the scene at path, or NULL with the error printed if it can't be loaded
+CompiledScene* load_batch_scene(char* path)
+{
+	FILE* json = fopen(path, "r");
+	if(json == NULL)
+	{
+		fprintf(stderr, "Error: could not open %s\n", path);
+		return NULL;
+	}
+
+	CompiledScene* compiled = load_scene_stream(json, path);
+	fclose(json);
+	if(compiled == NULL)
+		fprintf(stderr, "%s\n", scene_error_message);
+	return compiled;
+}
+
+void batch_written(void* arg, char* path, int failed, double seconds)
+{
+	BatchTotals* totals = arg;
+	pthread_mutex_lock(&totals->lock);
+	if(failed)
+	{
+		fprintf(stderr, "Error: could not write %s\n", path);
+		totals->failures ++;
+	}
+	else
+		totals->written ++;
+	totals->write_seconds += seconds;
+	pthread_mutex_unlock(&totals->lock);
+}
+
+// renders every job of the manifest with options, returns the number that failed
+int render_batch(char* manifest, RenderOptions* options)
+{
+	int num_jobs;
+	BatchJob* jobs = read_batch_manifest(manifest, &num_jobs);
+	double start = now_seconds();
+
+	BatchTotals totals;
+	memset(&totals, 0, sizeof(BatchTotals));
+	pthread_mutex_init(&totals.lock, NULL);
+
+	start_tile_pool(options->num_threads);
+	options->writer = start_image_writer(batch_written, &totals, options->num_threads);
+
+	// scenes that are loaded, kept until their last job is done
+	BatchScene* scenes = malloc(sizeof(BatchScene) * (num_jobs + 1));
+	int num_scenes = 0;
+	int parsed = 0;
+
+	int k;
+	for(k = 0; k < num_jobs; k ++)
+	{
+		BatchJob* job = &jobs[k];
+		BatchScene* scene = NULL;
+		int s;
+		for(s = 0; s < num_scenes; s ++)
+		{
+			if(strcmp(scenes[s].path, job->scene) == 0)
+				scene = &scenes[s];
+		}
+
+		int loaded = 0;
+		if(scene == NULL)
+		{
+			scene = &scenes[num_scenes ++];
+			scene->path = job->scene;
+			double load_start = now_seconds();
+			scene->compiled = load_batch_scene(job->scene);
+			scene->seconds = now_seconds() - load_start;
+			trace_span("read scene", load_start);
+			parsed ++;
+			loaded = 1;
+		}
+
+		if(scene->compiled == NULL)
+		{
+			fprintf(stderr, "[%d/%d] %s failed, line %d: scene %s could not be loaded\n", k + 1, num_jobs, job->output,
+				job->line, job->scene);
+			pthread_mutex_lock(&totals.lock);
+			totals.failures ++;
+			pthread_mutex_unlock(&totals.lock);
+		}
+		else
+		{
+			PPMmeta fileinfo;
+			fileinfo.width = job->width;
+			fileinfo.height = job->height;
+			fileinfo.max = 255;
+			fileinfo.type = 6;
+
+			long rays = render_stats.rays;
+			double render_start = now_seconds();
+			raycast(scene->compiled, job->output, fileinfo, options);
+			double seconds = now_seconds() - render_start;
+			rays = render_stats.rays - rays;
+			trace_span("render", render_start);
+
+			printf("[%d/%d] %s %dx%d: ", k + 1, num_jobs, job->output, job->width, job->height);
+			if(loaded)
+				printf("scene %.3fs, ", scene->seconds);
+			else
+				printf("scene reused, ");
+			printf("render %.3fs, %ld rays, %.0f rays/sec\n", seconds, rays, seconds > 0 ? rays / seconds : 0);
+		}
+
+		// the scene isn't needed anymore after its last job
+		if(job->last_use == k)
+		{
+			if(scene->compiled != NULL)
+				free_compiled_scene(scene->compiled);
+			scene->compiled = NULL;
+		}
+	}
+
+	// the last images are still being written
+	double wait_start = now_seconds();
+	close_image_writer(options->writer);
+	options->writer = NULL;
+	double wait = now_seconds() - wait_start;
+	stop_tile_pool();
+
+	double elapsed = now_seconds() - start;
+	printf("Batch: %d of %d images written in %.3fs, %.1f images/sec. %d scenes read, writing took %.3fs, "
+		"%.3fs of it after the last render\n", totals.written, num_jobs, elapsed, totals.written / elapsed, parsed,
+		totals.write_seconds, wait);
+
+	for(k = 0; k < num_jobs; k ++)
+	{
+		free(jobs[k].scene);
+		free(jobs[k].output);
+	}
+	free(jobs);
+	free(scenes);
+	pthread_mutex_destroy(&totals.lock);
+	return totals.failures;
+}
@@ -0,0 +1,386 @@
+#include "render.c"
+
+// microbenchmarks of the intersection, shading and vector primitives
+// every benchmark runs over the same seeded set of rays, so two builds can be compared
+// op for op. each one is timed over a number of samples, every sample long enough to
+// be well above the clock's resolution, and the spread of the samples is reported with
+// them so that a difference can be told apart from noise.
+
+#define BENCH_RAYS 1024
+#define BENCH_SEED 12345
+
+typedef struct {
+	float r0[3];
+	float rd[3];
+} BenchRay;
+
+BenchRay bench_rays[BENCH_RAYS];
+volatile float bench_sink; // results go here so that no work can be left out
+
+// rays from around the origin towards a box around (0, 0, 20), about half of them
+// hit the unit sized objects there
+void make_bench_rays()
+{
+	uint64_t state = BENCH_SEED;
+	int k;
+	int a;
+	for(k = 0; k < BENCH_RAYS; k ++)
+	{
+		float target[3];
+		for(a = 0; a < 3; a ++)
+		{
+			bench_rays[k].r0[a] = random_signed(&state) * 0.5;
+			target[a] = random_signed(&state) * 2;
+		}
+		target[2] += 20;
+		subtract(target, bench_rays[k].r0, bench_rays[k].rd);
+		normalize(bench_rays[k].rd);
+	}
+}
+
+typedef void (*BenchFunction)(int ops, void* data);
+
+typedef struct {
+	char* name;
+	BenchFunction function;
+	void* data;
+} Benchmark;
+
+int compare_doubles(const void* a, const void* b)
+{
+	double da = *(double*) a;
+	double db = *(double*) b;
+	return da < db ? -1 : da > db;
+}
+
+// ns per op over samples runs of ops each. outliers are samples outside 1.5 times the
+// interquartile range, they are left out of the mean and deviation but counted
+void run_benchmark(Benchmark* b, int samples, double sample_time)
+{
+	// find how many ops fill a sample
+	int ops = 16;
+	while(1)
+	{
+		double start = now_seconds();
+		b->function(ops, b->data);
+		double elapsed = now_seconds() - start;
+		if(elapsed > sample_time || ops > (1 << 28))
+			break;
+		ops *= elapsed > sample_time / 8 ? 2 : 8;
+	}
+
+	double times[samples];
+	int k;
+	for(k = 0; k < samples; k ++)
+	{
+		double start = now_seconds();
+		b->function(ops, b->data);
+		times[k] = (now_seconds() - start) * 1e9 / ops;
+	}
+	qsort(times, samples, sizeof(double), compare_doubles);
+
+	double q1 = times[samples / 4];
+	double q3 = times[samples * 3 / 4];
+	double lo = q1 - 1.5 * (q3 - q1);
+	double hi = q3 + 1.5 * (q3 - q1);
+
+	double sum = 0;
+	double sum_sq = 0;
+	int kept = 0;
+	for(k = 0; k < samples; k ++)
+	{
+		if(times[k] < lo || times[k] > hi)
+			continue;
+		sum += times[k];
+		sum_sq += times[k] * times[k];
+		kept ++;
+	}
+	double mean = sum / kept;
+	double deviation = sqrt(max(sum_sq / kept - mean * mean, 0));
+
+	// more spread than this and a difference of a few percent means nothing
+	double spread = mean > 0 ? 100 * deviation / mean : 0;
+	printf("%-28s %10.2f %10.2f %10.2f %7.1f%% %5d%s\n", b->name, times[samples / 2], mean, times[0],
+		spread, samples - kept, spread > 5 ? "  noisy" : "");
+}
+
+// the primitives
+
+void bench_intersect_sphere(int ops, void* data)
+{
+	(void) data;
+	float center[3] = { 0, 0, 20 };
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		sum += intersect_sphere(center, 1, ray->r0, ray->rd);
+	}
+	bench_sink = sum;
+}
+
+void bench_intersect_plane(int ops, void* data)
+{
+	(void) data;
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		sum += intersect_plane(0, 1, 0, 1, ray->r0, ray->rd);
+	}
+	bench_sink = sum;
+}
+
+void bench_intersect_cylinder(int ops, void* data)
+{
+	(void) data;
+	Geometry cylinder;
+	memset(&cylinder, 0, sizeof(Geometry));
+	cylinder.kind = T_CYLINDER;
+	cylinder.position[2] = 20;
+	cylinder.normal[0] = 1;
+	cylinder.basis2[2] = 1;
+	cylinder.radius = 1;
+
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		sum += intersect_cylinder(&cylinder, ray->r0, ray->rd);
+	}
+	bench_sink = sum;
+}
+
+// the primary ray versions, as if every ray started at the camera
+void bench_intersect_sphere_primary(int ops, void* data)
+{
+	(void) data;
+	Geometry sphere;
+	memset(&sphere, 0, sizeof(Geometry));
+	sphere.kind = T_SPHERE;
+	sphere.position[2] = 20;
+	sphere.radius = 1;
+	compile_eye_terms(&sphere);
+
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		sum += intersect_sphere_primary(&sphere, ray->rd, 1);
+	}
+	bench_sink = sum;
+}
+
+void bench_intersect_cylinder_primary(int ops, void* data)
+{
+	(void) data;
+	Geometry cylinder;
+	memset(&cylinder, 0, sizeof(Geometry));
+	cylinder.kind = T_CYLINDER;
+	cylinder.position[2] = 20;
+	cylinder.normal[0] = 1;
+	cylinder.basis2[2] = 1;
+	cylinder.radius = 1;
+	compile_eye_terms(&cylinder);
+
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		sum += intersect_cylinder_primary(&cylinder, ray->rd);
+	}
+	bench_sink = sum;
+}
+
+void bench_quadratic_zeroes(int ops, void* data)
+{
+	(void) data;
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		float zeroes[2];
+		quadratic_zeroes(1, ray->rd[0] * 4, ray->rd[1], zeroes);
+		sum += zeroes[0];
+	}
+	bench_sink = sum;
+}
+
+void bench_smellit(int ops, void* data)
+{
+	(void) data;
+	float normal[3] = { 0, 0, -1 };
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		float rd[3];
+		float out[3];
+		vector_copy(ray->rd, rd);
+		smellit(rd, normal, 1, 1.5, out);
+		sum += out[0];
+	}
+	bench_sink = sum;
+}
+
+// the vector operations, each run on pairs of ray directions
+#define VECTOR_BENCH(name, statement) \
+	void bench_##name(int ops, void* data) \
+	{ \
+		(void) data; \
+		float m[3][3] = { { 1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } }; \
+		float out[3] = { 0, 0, 0 }; \
+		float sum = 0; \
+		int k; \
+		for(k = 0; k < ops; k ++) \
+		{ \
+			float* a = bench_rays[k % BENCH_RAYS].rd; \
+			float* b = bench_rays[(k + 1) % BENCH_RAYS].r0; \
+			(void) a; \
+			(void) b; \
+			statement; \
+			sum += out[0]; \
+		} \
+		bench_sink = sum + m[0][0]; \
+	}
+
+VECTOR_BENCH(add, add(a, b, out))
+VECTOR_BENCH(subtract, subtract(a, b, out))
+VECTOR_BENCH(multiply, multiply(a, b, out))
+VECTOR_BENCH(scale, scale(a, 0.5, out))
+VECTOR_BENCH(dot, out[0] = dot(a, b))
+VECTOR_BENCH(cross, cross(a, b, out))
+VECTOR_BENCH(length, out[0] = length(a))
+VECTOR_BENCH(normalize, vector_copy(b, out); normalize(out))
+VECTOR_BENCH(matrix_multiply, matrix_multiply(m, a, out))
+
+// one get_color_ray call, from the camera into a scene of a single sphere in front of a
+// plane with two lights, with the sphere made of each kind of material in turn
+typedef struct {
+	char* material; // extra fields of the sphere
+	CompiledScene* scene;
+	ColorRayFunction color_ray;
+} ShadingBench;
+
+CompiledScene* shading_scene(char* material)
+{
+	char json[2048];
+	snprintf(json, sizeof(json),
+		"[ { \"type\":\"camera\", \"width\":1, \"height\":1 },"
+		"  { \"type\":\"light\", \"color\":[1,1,1], \"position\":[5,10,0] },"
+		"  { \"type\":\"light\", \"color\":[0.5,0.5,1], \"position\":[-5,5,10], \"direction\":[0.3,-0.3,1], \"theta\":40, \"angular-a0\":1 },"
+		"  { \"type\":\"sphere\", \"radius\":1.5, \"position\":[0,0,20], \"color\":[0.8,0.4,0.2]%s },"
+		"  { \"type\":\"plane\", \"normal\":[0,0,-1], \"position\":[0,0,30], \"color\":[0.5,0.5,0.5] } ]",
+		material);
+
+	FILE* stream = fmemopen(json, strlen(json), "r");
+	Scene scene;
+	read_scene_stream(stream, "bench.json", &scene);
+	fclose(stream);
+	CompiledScene* compiled = malloc(sizeof(CompiledScene));
+	setup_scene(&scene, compiled);
+	free_scene(&scene);
+	return compiled;
+}
+
+void bench_shading(int ops, void* data)
+{
+	ShadingBench* bench = data;
+	float sum = 0;
+	int k;
+	for(k = 0; k < ops; k ++)
+	{
+		BenchRay* ray = &bench_rays[k % BENCH_RAYS];
+		float r0[3];
+		float rd[3];
+		float color[3];
+		vector_copy(ray->r0, r0);
+		vector_copy(ray->rd, rd);
+		bench->color_ray(color, bench->scene, r0, rd, 7);
+		sum += color[0];
+	}
+	bench_sink = sum;
+}
+
+int main(int argc, char** argv)
+{
+	int samples = 21;
+	double sample_time = 0.005;
+	char* filter = NULL;
+
+	int a;
+	for(a = 1; a < argc; a ++)
+	{
+		if(strcmp(argv[a], "--samples") == 0 && a + 1 < argc)
+			samples = max(atoi(argv[++a]), 4);
+		else if(strcmp(argv[a], "--sample-time") == 0 && a + 1 < argc)
+			sample_time = atof(argv[++a]) / 1000.0;
+		else if(strcmp(argv[a], "--filter") == 0 && a + 1 < argc)
+			filter = argv[++a];
+		else
+		{
+			fprintf(stderr, "Usage: %s [--samples N] [--sample-time MS] [--filter TEXT]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	make_bench_rays();
+
+	ShadingBench shading[] = {
+		{ "", NULL, NULL },
+		{ ", \"reflectivity\":0.5", NULL, NULL },
+		{ ", \"refractivity\":0.8, \"ior\":1.5", NULL, NULL },
+		{ ", \"reflectivity\":0.2, \"refractivity\":0.8, \"ior\":1.5", NULL, NULL },
+	};
+	int num_shading = sizeof(shading) / sizeof(ShadingBench);
+
+	Benchmark benchmarks[] = {
+		{ "intersect_sphere", bench_intersect_sphere, NULL },
+		{ "intersect_plane", bench_intersect_plane, NULL },
+		{ "intersect_cylinder", bench_intersect_cylinder, NULL },
+		{ "intersect_sphere_primary", bench_intersect_sphere_primary, NULL },
+		{ "intersect_cylinder_primary", bench_intersect_cylinder_primary, NULL },
+		{ "quadratic_zeroes", bench_quadratic_zeroes, NULL },
+		{ "smellit", bench_smellit, NULL },
+		{ "add", bench_add, NULL },
+		{ "subtract", bench_subtract, NULL },
+		{ "multiply", bench_multiply, NULL },
+		{ "scale", bench_scale, NULL },
+		{ "dot", bench_dot, NULL },
+		{ "cross", bench_cross, NULL },
+		{ "length", bench_length, NULL },
+		{ "normalize", bench_normalize, NULL },
+		{ "matrix_multiply", bench_matrix_multiply, NULL },
+		{ "get_color_ray diffuse", bench_shading, &shading[0] },
+		{ "get_color_ray reflective", bench_shading, &shading[1] },
+		{ "get_color_ray refractive", bench_shading, &shading[2] },
+		{ "get_color_ray glass", bench_shading, &shading[3] },
+	};
+	int num_benchmarks = sizeof(benchmarks) / sizeof(Benchmark);
+
+	int k;
+	for(k = 0; k < num_shading; k ++)
+	{
+		shading[k].scene = shading_scene(shading[k].material);
+		shading[k].color_ray = color_ray_kernels[scene_features(shading[k].scene)];
+	}
+
+	printf("%d samples of at least %.1f ms each, ns per op\n", samples, sample_time * 1000);
+	printf("%-28s %10s %10s %10s %8s %5s\n", "", "median", "mean", "min", "stddev", "out");
+	for(k = 0; k < num_benchmarks; k ++)
+	{
+		if(filter == NULL || strstr(benchmarks[k].name, filter) != NULL)
+			run_benchmark(&benchmarks[k], samples, sample_time);
+	}
+
+	for(k = 0; k < num_shading; k ++)
+		free_compiled_scene(shading[k].scene);
+	return 0;
+}
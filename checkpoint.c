@@ -0,0 +1,173 @@
+// checkpoints
+// a long render keeps which of its tiles are finished, and their pixels, in a sidecar
+// file, saved every so often while it runs. after a crash or preemption, --resume loads
+// the file and renders only the tiles it doesn't have. the scheduler may cut a tile into
+// pieces, so the pixels rendered in each tile of the tile_size grid are counted and the
+// tile is finished once all of them are in.
+//
+// the file is "RTCKPT1\0", image_hash of the scene and settings, then int32 width, height
+// and tile size, a byte per tile that is 1 if it is finished, and the image's pixels.
+// it is written next to the real file and renamed over it, so there is always a whole one,
+// and it is removed once the output has been written.
+
+#define CHECKPOINT_MAGIC "RTCKPT1"
+
+typedef struct {
+	RenderJob* job;
+	char* path;
+	uint64_t hash;
+	int tile_size;
+	int columns;
+	int rows;
+	int* rendered; // pixels of each tile rendered so far
+	double interval; // seconds between saves
+	double next_save;
+	pthread_mutex_t save_lock;
+} Checkpoint;
+
+int checkpoint_tile_pixels(Checkpoint* c, int t)
+{
+	int x = t % c->columns;
+	int y = t / c->columns;
+	int w = min(c->tile_size, c->job->width - x * c->tile_size);
+	int h = min(c->tile_size, c->job->height - y * c->tile_size);
+	return w * h;
+}
+
+int checkpoint_tile_done(Checkpoint* c, int t)
+{
+	return __atomic_load_n(&c->rendered[t], __ATOMIC_ACQUIRE) == checkpoint_tile_pixels(c, t);
+}
+
+void save_checkpoint(Checkpoint* c)
+{
+	RenderJob* job = c->job;
+	int num_tiles = c->columns * c->rows;
+
+	// which tiles are done has to be known before their pixels are copied, a tile that
+	// finishes in between is simply left for the next save
+	unsigned char* done = malloc(num_tiles);
+	int t;
+	for(t = 0; t < num_tiles; t ++)
+		done[t] = checkpoint_tile_done(c, t);
+
+	char temp[strlen(c->path) + 8];
+	sprintf(temp, "%s.part", c->path);
+	FILE* file = fopen(temp, "wb");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Warning: can't write checkpoint %s\n", temp);
+		free(done);
+		return;
+	}
+
+	int32_t sizes[3] = { job->width, job->height, c->tile_size };
+	fwrite(CHECKPOINT_MAGIC, 1, 8, file);
+	fwrite(&c->hash, sizeof(uint64_t), 1, file);
+	fwrite(sizes, sizeof(int32_t), 3, file);
+	fwrite(done, 1, num_tiles, file);
+	fwrite(job->data, sizeof(Pixel), job->width * job->height, file);
+	if(fclose(file) == 0)
+		rename(temp, c->path);
+	free(done);
+}
+
+// returns the number of tiles the file had finished, they are marked and their pixels
+// are in the job's image. -1 if the file is missing or for another image
+int load_checkpoint(Checkpoint* c)
+{
+	FILE* file = fopen(c->path, "rb");
+	if(file == NULL)
+		return -1;
+
+	RenderJob* job = c->job;
+	int num_tiles = c->columns * c->rows;
+	char magic[8];
+	uint64_t hash;
+	int32_t sizes[3];
+	unsigned char* done = malloc(num_tiles);
+	int ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, CHECKPOINT_MAGIC, 8) == 0
+		&& fread(&hash, sizeof(uint64_t), 1, file) == 1 && hash == c->hash
+		&& fread(sizes, sizeof(int32_t), 3, file) == 3
+		&& sizes[0] == job->width && sizes[1] == job->height && sizes[2] == c->tile_size
+		&& fread(done, 1, num_tiles, file) == (size_t) num_tiles
+		&& fread(job->data, sizeof(Pixel), job->width * job->height, file) == (size_t) (job->width * job->height);
+	fclose(file);
+
+	int finished = -1;
+	if(ok)
+	{
+		finished = 0;
+		int t;
+		for(t = 0; t < num_tiles; t ++)
+		{
+			if(done[t])
+			{
+				c->rendered[t] = checkpoint_tile_pixels(c, t);
+				finished ++;
+			}
+		}
+	}
+	free(done);
+	return finished;
+}
+
+// render_tile for tiles that aren't finished yet, counting them in and saving now and then
+void checkpoint_render_tile(Tile tile, void* data)
+{
+	Checkpoint* c = data;
+	int t = tile.y0 / c->tile_size * c->columns + tile.x0 / c->tile_size;
+	if(checkpoint_tile_done(c, t))
+		return;
+
+	render_tile(tile, c->job);
+	__atomic_add_fetch(&c->rendered[t], (tile.x1 - tile.x0) * (tile.y1 - tile.y0), __ATOMIC_ACQ_REL);
+
+	// whoever notices first saves, the others carry on
+	if(now_seconds() > c->next_save && pthread_mutex_trylock(&c->save_lock) == 0)
+	{
+		if(now_seconds() > c->next_save)
+		{
+			save_checkpoint(c);
+			c->next_save = now_seconds() + c->interval;
+		}
+		pthread_mutex_unlock(&c->save_lock);
+	}
+}
+
+// run_tiles over the job, checkpointed to options->checkpoint and resumed from it if asked
+void render_checkpointed(RenderJob* job, const CompiledScene* scene, RenderOptions* options)
+{
+	Checkpoint c;
+	c.job = job;
+	c.path = options->checkpoint;
+	c.hash = image_hash(scene, job->width, job->height, options);
+	c.tile_size = max(options->tile_size, 1);
+	c.columns = (job->width + c.tile_size - 1) / c.tile_size;
+	c.rows = (job->height + c.tile_size - 1) / c.tile_size;
+	c.rendered = calloc(c.columns * c.rows, sizeof(int));
+	c.interval = options->checkpoint_interval;
+	c.next_save = now_seconds() + c.interval;
+	pthread_mutex_init(&c.save_lock, NULL);
+
+	if(options->resume)
+	{
+		int finished = load_checkpoint(&c);
+		if(finished < 0)
+			fprintf(stderr, "Warning: no checkpoint for this image in %s, starting from the beginning\n", c.path);
+		else
+			printf("Resuming with %d of %d tiles already rendered\n", finished, c.columns * c.rows);
+	}
+
+	run_tiles(job->width, job->height, c.tile_size, 1, options->tile_order, options->num_threads, checkpoint_render_tile, &c);
+
+	pthread_mutex_destroy(&c.save_lock);
+	free(c.rendered);
+}
+
+// the output is written, the checkpoint isn't needed anymore
+void remove_checkpoint(RenderOptions* options)
+{
+	if(options->checkpoint != NULL)
+		unlink(options->checkpoint);
+}
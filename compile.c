@@ -0,0 +1,279 @@
+// turns a scene as it was read from json into the layout the renderer uses.
+// Object packs its shape into a..e, which mean different things for every kind.
+// here each object is split into its geometry, which send_ray reads for every
+// object on every ray, and its material, which is only read once a hit is found.
+
+// the terms of intersect_sphere and intersect_cylinder that only depend on the object once
+// the ray starts at the camera, for the primary ray versions of them
+void compile_eye_terms(Geometry* g)
+{
+	g->radius2 = sqr(g->radius);
+	if(g->kind == T_SPHERE)
+	{
+		g->eye_c = sqr(g->position[0]) + sqr(g->position[1]) + sqr(g->position[2]) - g->radius2;
+	}
+	else if(g->kind == T_CYLINDER)
+	{
+		g->eye_dot[0] = dot(g->position, g->normal);
+		g->eye_dot[1] = dot(g->position, g->basis2);
+		g->eye_c = sqr(g->eye_dot[1]) + sqr(g->eye_dot[0]) - g->radius2;
+	}
+}
+
+// index of the texture loaded from path, loading it the first time it is used
+int find_texture(CompiledScene* compiled, char* path)
+{
+	if(path == NULL)
+		return -1;
+
+	int k;
+	for(k = 0; k < compiled->num_textures; k ++)
+	{
+		if(strcmp(compiled->textures[k].path, path) == 0)
+			return k;
+	}
+	compiled->textures[compiled->num_textures] = load_texture(path);
+	return compiled->num_textures ++;
+}
+
+void compile_object(CompiledScene* compiled, Object* o, Geometry* g, Material* m)
+{
+	memset(g, 0, sizeof(Geometry));
+	g->kind = o->kind;
+	vector_copy(o->position, g->position);
+
+	vector_copy(o->color, m->diffuse);
+	vector_copy(o->specular, m->specular);
+	m->shininess = o->material.shininess;
+	m->ior = o->material.ior;
+	m->reflectivity = o->material.reflectivity;
+	m->refractivity = o->material.refractivity;
+	m->diffuse_texture = find_texture(compiled, o->textures[0]);
+	m->specular_texture = find_texture(compiled, o->textures[1]);
+	m->texture_scale = o->material.texture_scale;
+
+	if(o->kind == T_SPHERE)
+	{
+		g->radius = o->d;
+	}
+	else if(o->kind == T_PLANE)
+	{
+		vector_copy(o->direction, g->normal);
+		g->offset = o->d;
+	}
+	else if(o->kind == T_CYLINDER)
+	{
+		vector_copy(o->direction, g->normal);
+		g->basis2[0] = o->a;
+		g->basis2[1] = o->b;
+		g->basis2[2] = o->c;
+		g->radius = o->e;
+	}
+	else if(o->kind == T_MESH)
+	{
+		g->mesh = compiled->num_meshes;
+		load_mesh(o->file, &compiled->meshes[compiled->num_meshes ++]);
+	}
+	compile_eye_terms(g);
+}
+
+// rotation about x, then y, then z, angles in degrees
+void rotation_matrix(float* degrees, float m[3][3])
+{
+	float cx = cos(deg2rad(degrees[0])), sx = sin(deg2rad(degrees[0]));
+	float cy = cos(deg2rad(degrees[1])), sy = sin(deg2rad(degrees[1]));
+	float cz = cos(deg2rad(degrees[2])), sz = sin(deg2rad(degrees[2]));
+
+	m[0][0] = cz * cy; m[0][1] = cz * sy * sx - sz * cx; m[0][2] = cz * sy * cx + sz * sx;
+	m[1][0] = sz * cy; m[1][1] = sz * sy * sx + cz * cx; m[1][2] = sz * sy * cx - cz * sx;
+	m[2][0] = -sy;     m[2][1] = cy * sx;                m[2][2] = cy * cx;
+}
+
+// a sphere around one object. spheres and meshes are bounded, planes and cylinders aren't
+float bound_object(CompiledScene* compiled, Geometry* g, float* center)
+{
+	if(g->kind == T_SPHERE)
+	{
+		vector_copy(g->position, center);
+		return g->radius;
+	}
+	if(g->kind == T_MESH)
+	{
+		BVHNode* root = &compiled->meshes[g->mesh].nodes[0];
+		float half[3];
+		add(root->lo, root->hi, center);
+		scale(center, 0.5, center);
+		subtract(root->hi, center, half);
+		return length(half);
+	}
+	return INFINITY;
+}
+
+void bound_group(CompiledScene* compiled, GeometryGroup* group)
+{
+	float lo[3] = { INFINITY, INFINITY, INFINITY };
+	float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+	int k;
+	for(k = group->first; k < group->first + group->count; k ++)
+	{
+		float center[3];
+		float radius = bound_object(compiled, &compiled->geometry[k], center);
+		if(isinf(radius))
+		{
+			group->bound_radius = INFINITY;
+			return;
+		}
+
+		int a;
+		for(a = 0; a < 3; a ++)
+		{
+			lo[a] = min(lo[a], center[a] - radius);
+			hi[a] = max(hi[a], center[a] + radius);
+		}
+	}
+
+	add(lo, hi, group->bound_center);
+	scale(group->bound_center, 0.5, group->bound_center);
+	group->bound_radius = 0;
+	for(k = group->first; k < group->first + group->count; k ++)
+	{
+		float center[3];
+		float radius = bound_object(compiled, &compiled->geometry[k], center);
+		float d[3];
+		subtract(center, group->bound_center, d);
+		group->bound_radius = max(group->bound_radius, length(d) + radius);
+	}
+}
+
+// perceived brightness of a light's color
+float light_brightness(const Light* light)
+{
+	return 0.2126 * light->color[0] + 0.7152 * light->color[1] + 0.0722 * light->color[2];
+}
+
+// builds compiled from scene. if it fails compiled keeps what was built so far,
+// which free_compiled_scene frees
+void compile_scene(Scene* scene, CompiledScene* compiled)
+{
+	memset(compiled, 0, sizeof(CompiledScene));
+	compiled->geometry = malloc(sizeof(Geometry) * (scene->num_objects + 1));
+	compiled->materials = malloc(sizeof(Material) * (scene->num_objects + 1));
+	compiled->num_lights = scene->num_lights;
+	compiled->lights = malloc(sizeof(Light) * (scene->num_lights + 1));
+
+	compiled->camera_width = scene->camera_width;
+	compiled->camera_height = scene->camera_height;
+	vector_copy(scene->ambient_color, compiled->ambient_color);
+	compiled->skip_refraction = 0;
+	compiled->max_shaded_lights = 0;
+	compiled->shadow_maps = NULL;
+	compiled->shadow_bias = 0;
+	compiled->light_samples = 0;
+	compiled->pixel_size = 0;
+
+	int k;
+	compiled->num_meshes = 0;
+	compiled->meshes = malloc(sizeof(Mesh) * (scene->num_objects + 1));
+	compiled->num_textures = 0;
+	compiled->textures = malloc(sizeof(Texture) * (2 * scene->num_objects + 1));
+
+	// objects in the scene itself go first, then each group's objects in a run
+	int n = 0;
+	int g;
+	for(g = 0; g <= scene->num_groups; g ++)
+	{
+		int first = n;
+		for(k = 0; k < scene->num_objects; k ++)
+		{
+			if(scene->objects[k].group != g)
+				continue;
+			compile_object(compiled, &scene->objects[k], &compiled->geometry[n], &compiled->materials[n]);
+			n ++;
+		}
+
+		if(g == 0)
+		{
+			compiled->num_objects = n;
+			compiled->num_groups = scene->num_groups;
+			compiled->groups = malloc(sizeof(GeometryGroup) * (scene->num_groups + 1));
+		}
+		else
+		{
+			GeometryGroup* group = &compiled->groups[g - 1];
+			group->first = first;
+			group->count = n - first;
+			bound_group(compiled, group);
+		}
+	}
+
+	compiled->num_placements = scene->num_instances;
+	compiled->placements = malloc(sizeof(Placement) * (scene->num_instances + 1));
+	for(k = 0; k < scene->num_instances; k ++)
+	{
+		Instance* instance = &scene->instances[k];
+		Placement* p = &compiled->placements[k];
+		GeometryGroup* group = &compiled->groups[instance->group - 1];
+
+		if(group->count == 0)
+		{
+			scene_error("Error: group \"%s\" has no objects in it\n", scene->group_names[instance->group - 1]);
+		}
+
+		p->group = instance->group - 1;
+		rotation_matrix(instance->rotation, p->rotation);
+		vector_copy(instance->position, p->position);
+		p->scale = instance->scale;
+		p->overrides = instance->overrides;
+		p->material = instance->material;
+
+		// move the group's bounding sphere into the world
+		float center[3];
+		scale(group->bound_center, p->scale, center);
+		matrix_multiply(p->rotation, center, p->bound_center);
+		add(p->bound_center, p->position, p->bound_center);
+		p->bound_radius = group->bound_radius * p->scale;
+	}
+
+	for(k = 0; k < scene->num_lights; k ++)
+	{
+		Object* o = &scene->lights[k];
+		Light* l = &compiled->lights[k];
+
+		vector_copy(o->color, l->color);
+		vector_copy(o->position, l->position);
+		vector_copy(o->direction, l->direction);
+		l->radial_a2 = o->a;
+		l->radial_a1 = o->b;
+		l->radial_a0 = o->c;
+		l->angular_a0 = o->d;
+		l->cos_theta = o->e;
+	}
+
+	// light sampling draws candidates by brightness, every light gets some chance
+	compiled->light_cdf = malloc(sizeof(float) * (scene->num_lights + 1));
+	float total = 0;
+	for(k = 0; k < scene->num_lights; k ++)
+	{
+		total += max(light_brightness(&compiled->lights[k]), 1e-4);
+		compiled->light_cdf[k] = total;
+	}
+}
+
+void free_compiled_scene(CompiledScene* compiled)
+{
+	free(compiled->geometry);
+	free(compiled->materials);
+	free(compiled->groups);
+	free(compiled->placements);
+	int k;
+	for(k = 0; k < compiled->num_meshes; k ++)
+		free_mesh(&compiled->meshes[k]);
+	free(compiled->meshes);
+	for(k = 0; k < compiled->num_textures; k ++)
+		free_texture(&compiled->textures[k]);
+	free(compiled->textures);
+	free(compiled->lights);
+	free(compiled->light_cdf);
+	free(compiled);
+}
@@ -0,0 +1,120 @@
+// render cost estimate
+// traces a small stratified sample of the frame's pixels, one at a random spot in each
+// cell of a grid laid over the image, through the same render_pixel a real render uses,
+// and counts what each of them cost. the means scaled up to every pixel give the rays
+// and the time of the whole frame, and their spread over the sample gives 95% confidence
+// intervals. the time assumes the threads keep every core busy, as the scheduler does
+// once tiles are small enough, and leaves out reading the scene and writing the output.
+
+#define ESTIMATE_Z 1.96 // standard errors either side of the mean for 95%
+
+typedef struct {
+	double sum;
+	double sum_sq;
+	double highest;
+	int count;
+} EstimateStat;
+
+void add_estimate(EstimateStat* stat, double value)
+{
+	stat->sum += value;
+	stat->sum_sq += value * value;
+	stat->highest = max(stat->highest, value);
+	stat->count ++;
+}
+
+double estimate_mean(EstimateStat* stat)
+{
+	return stat->sum / stat->count;
+}
+
+// half the width of the confidence interval of the mean
+double estimate_error(EstimateStat* stat)
+{
+	double mean = estimate_mean(stat);
+	double variance = max(stat->sum_sq / stat->count - mean * mean, 0);
+	return ESTIMATE_Z * sqrt(variance / stat->count);
+}
+
+void estimate_render(const CompiledScene* scene, PPMmeta fileinfo, RenderOptions* options, int samples)
+{
+	RenderJob job;
+	job.width = fileinfo.width;
+	job.height = fileinfo.height;
+	job.x0 = 0;
+	job.y0 = 0;
+	job.stride = 0; // every pixel goes into the same row, nothing is kept
+	job.data = malloc(sizeof(Pixel) * fileinfo.width);
+	job.pixel_width = scene->camera_width / job.width;
+	job.pixel_height = scene->camera_height / job.height;
+	job.max_depth = 7;
+	job.step = 1;
+	job.first_pass = 1;
+	job.deadline = 0;
+	job.expired = 0;
+	job.stats.rays = 0;
+
+	// what a frame does before its first pixel counts too
+	double start = now_seconds();
+	CompiledScene frame_scene;
+	ShadowMap* shadow_maps = setup_frame(&job, &frame_scene, scene, options);
+	frame_scene.pixel_size = job.pixel_width;
+	PrimaryBins* bins = build_primary_bins(&job);
+	job.bins = bins;
+	double setup_time = now_seconds() - start;
+
+	// a grid of about samples cells, as square as the image allows
+	int columns = clamp(round(sqrt((double) samples * job.width / job.height)), 1, job.width);
+	int rows = clamp(samples / columns, 1, job.height);
+
+	EstimateStat rays = { 0 };
+	EstimateStat shadow_rays = { 0 };
+	EstimateStat depth = { 0 };
+	EstimateStat time = { 0 };
+
+	uint64_t state = mix_bits(samples);
+	int x;
+	int y;
+	start = now_seconds();
+	for(y = 0; y < rows; y ++)
+	{
+		for(x = 0; x < columns; x ++)
+		{
+			int i0 = (long) job.height * y / rows;
+			int i1 = (long) job.height * (y + 1) / rows;
+			int j0 = (long) job.width * x / columns;
+			int j1 = (long) job.width * (x + 1) / columns;
+			state = mix_bits(state);
+			int i = i0 + (state >> 32) % (i1 - i0);
+			int j = j0 + (state & 0xffffffff) % (j1 - j0);
+
+			long pixel_rays = render_stats.rays;
+			long pixel_shadow_rays = render_stats.shadow_rays;
+			render_stats.min_recursion = INT_MAX;
+			double pixel_start = now_seconds();
+			render_pixel(&job, i, j);
+			add_estimate(&time, now_seconds() - pixel_start);
+			add_estimate(&rays, render_stats.rays - pixel_rays);
+			add_estimate(&shadow_rays, render_stats.shadow_rays - pixel_shadow_rays);
+			add_estimate(&depth, render_stats.min_recursion == INT_MAX ? 0 : job.max_depth - render_stats.min_recursion + 1);
+		}
+	}
+	double sample_time = now_seconds() - start;
+
+	double pixels = (double) job.width * job.height;
+	int threads = min(max(options->num_threads, 1), default_thread_count());
+
+	printf("Estimate for %dx%d on %d thread%s, from %d pixels traced in %.1f ms:\n", job.width, job.height, threads,
+		threads > 1 ? "s" : "", rays.count, sample_time * 1000);
+	printf("   rays per pixel    %.2f +- %.2f, of which shadow rays %.2f, most %.0f\n", estimate_mean(&rays),
+		estimate_error(&rays), estimate_mean(&shadow_rays), rays.highest);
+	printf("   surfaces deep     %.2f on average, most %.0f\n", estimate_mean(&depth), depth.highest);
+	printf("   rays              %.0f +- %.0f\n", estimate_mean(&rays) * pixels, estimate_error(&rays) * pixels);
+	printf("   time              %.2fs +- %.2fs, of which %.2fs setting up the frame\n",
+		setup_time + estimate_mean(&time) * pixels / threads, estimate_error(&time) * pixels / threads, setup_time);
+
+	free_primary_bins(bins);
+	if(shadow_maps != NULL)
+		free_shadow_maps(shadow_maps, scene->num_lights);
+	free(job.data);
+}
@@ -0,0 +1,47 @@
+// an image that one thread refines while others read it
+// the renderer only swaps in whole passes under the lock, so a reader that
+// takes a snapshot always gets a complete image
+
+struct Framebuffer {
+	Pixel* pixels;
+	int width;
+	int height;
+	int generation; // how many passes have been published, 0 means nothing yet
+	pthread_mutex_t lock;
+};
+
+Framebuffer* create_framebuffer(int width, int height)
+{
+	Framebuffer* fb = malloc(sizeof(Framebuffer));
+	fb->pixels = calloc(width * height, sizeof(Pixel));
+	fb->width = width;
+	fb->height = height;
+	fb->generation = 0;
+	pthread_mutex_init(&fb->lock, NULL);
+	return fb;
+}
+
+void free_framebuffer(Framebuffer* fb)
+{
+	pthread_mutex_destroy(&fb->lock);
+	free(fb->pixels);
+	free(fb);
+}
+
+// copies the latest published pass into out, returns its generation
+int framebuffer_snapshot(Framebuffer* fb, Pixel* out)
+{
+	pthread_mutex_lock(&fb->lock);
+	memcpy(out, fb->pixels, sizeof(Pixel) * fb->width * fb->height);
+	int generation = fb->generation;
+	pthread_mutex_unlock(&fb->lock);
+	return generation;
+}
+
+int framebuffer_generation(Framebuffer* fb)
+{
+	pthread_mutex_lock(&fb->lock);
+	int generation = fb->generation;
+	pthread_mutex_unlock(&fb->lock);
+	return generation;
+}
@@ -0,0 +1,745 @@
+
+// g-buffer relighting
+// a g-buffer keeps every surface the rays of a frame hit: the primary hit of each pixel and
+// the reflected and refracted hits under it, as a small tree per pixel. none of that
+// depends on the lights or on the colors of the materials, so when only those change the
+// frame is shaded again from the stored hits without finding any of them again.
+// shading runs one light at a time over all the hits of a tile. what the shadow rays
+// found is kept per light too, and reused for as long as the light stays where it is.
+//
+// the file is "RTGBUF1\0", a 64 bit hash of everything the hits depend on, then int32
+// width, height and node count, width * height + 1 int32 offsets of each pixel's first
+// node, and the nodes. then an int32 count of lights, and for each its position as three
+// floats and a SHADOW_* byte per node. a file whose hash doesn't match is traced again.
+
+#define GBUFFER_MAGIC "RTGBUF1"
+#define GBUFFER_NONE -1 // the surface has no such term
+#define GBUFFER_AMBIENT -2 // the ray missed or ran out of depth, it sees the ambient color
+
+typedef struct {
+	float point[3];
+	float normal[3];
+	float rd[3]; // the ray that hit, as get_color_ray shades with it
+	int object_id;
+	int instance;
+	int primitive;
+	int refract; // node of the refracted ray, counted from the pixel's first node
+	int reflect;
+} GBufferNode;
+
+// what the shadow rays towards a light at position found from every node
+typedef struct {
+	float position[3];
+	unsigned char* visible;
+} GBufferShadows;
+
+typedef struct {
+	uint64_t hash;
+	int width;
+	int height;
+	int num_nodes;
+	int* first; // the nodes of pixel p are first[p] to first[p + 1] - 1, its primary hit first
+	GBufferNode* nodes;
+	int num_shadows;
+	GBufferShadows* shadows;
+} GBuffer;
+
+uint64_t hash_int(uint64_t hash, int value)
+{
+	return hash_bytes(hash, &value, sizeof(int));
+}
+
+// the parts of a material that decide which rays are traced from a surface
+uint64_t hash_ray_material(uint64_t hash, const Material* m)
+{
+	hash = hash_int(hash, m->reflectivity > 0);
+	hash = hash_int(hash, m->refractivity > 0);
+	return hash_bytes(hash, &m->ior, sizeof(float));
+}
+
+// everything the hits of a frame depend on. lights, colors and how much a surface
+// reflects or refracts are left out, as long as it still does
+uint64_t gbuffer_hash(RenderJob* job)
+{
+	const CompiledScene* scene = job->scene;
+	uint64_t hash = HASH_START;
+	hash = hash_int(hash, job->width);
+	hash = hash_int(hash, job->height);
+	hash = hash_int(hash, job->max_depth);
+	hash = hash_int(hash, scene->skip_refraction);
+	hash = hash_bytes(hash, &scene->camera_width, sizeof(float));
+	hash = hash_bytes(hash, &scene->camera_height, sizeof(float));
+
+	int k;
+	hash = hash_int(hash, scene->num_objects);
+	for(k = 0; k < scene->num_objects; k ++)
+	{
+		hash = hash_bytes(hash, &scene->geometry[k], sizeof(Geometry));
+		hash = hash_ray_material(hash, &scene->materials[k]);
+	}
+	hash = hash_int(hash, scene->num_groups);
+	hash = hash_bytes(hash, scene->groups, sizeof(GeometryGroup) * scene->num_groups);
+	hash = hash_int(hash, scene->num_placements);
+	for(k = 0; k < scene->num_placements; k ++)
+	{
+		const Placement* p = &scene->placements[k];
+		hash = hash_int(hash, p->group);
+		hash = hash_bytes(hash, p->rotation, sizeof(p->rotation));
+		hash = hash_bytes(hash, p->position, sizeof(p->position));
+		hash = hash_bytes(hash, &p->scale, sizeof(float));
+		hash = hash_int(hash, p->overrides & (OVERRIDE_REFLECTIVITY | OVERRIDE_REFRACTIVITY | OVERRIDE_IOR));
+		hash = hash_ray_material(hash, &p->material);
+	}
+	hash = hash_int(hash, scene->num_meshes);
+	for(k = 0; k < scene->num_meshes; k ++)
+	{
+		const Mesh* mesh = &scene->meshes[k];
+		hash = hash_bytes(hash, mesh->vertices, sizeof(float) * 3 * mesh->num_vertices);
+		hash = hash_bytes(hash, mesh->triangles, sizeof(uint32_t) * 3 * mesh->num_triangles);
+	}
+	return hash;
+}
+
+// everything the pixels of a width by height image depend on, the g-buffer's hash with
+// the lights, colors and quality settings on top
+uint64_t image_hash(const CompiledScene* scene, int width, int height, RenderOptions* options)
+{
+	RenderJob job;
+	job.scene = scene;
+	job.width = width;
+	job.height = height;
+	job.max_depth = options->preview ? options->preview_depth : 7;
+	uint64_t hash = gbuffer_hash(&job);
+
+	// the objects of the groups come after the scene's own, up to the end of the last group
+	int num_geometry = scene->num_objects;
+	if(scene->num_groups > 0)
+		num_geometry = scene->groups[scene->num_groups - 1].first + scene->groups[scene->num_groups - 1].count;
+
+	int k;
+	for(k = scene->num_objects; k < num_geometry; k ++)
+		hash = hash_bytes(hash, &scene->geometry[k], sizeof(Geometry));
+	for(k = 0; k < num_geometry; k ++)
+	{
+		const Material* m = &scene->materials[k];
+		hash = hash_bytes(hash, m->diffuse, sizeof(m->diffuse));
+		hash = hash_bytes(hash, m->specular, sizeof(m->specular));
+		hash = hash_bytes(hash, &m->shininess, sizeof(float) * 4);
+		hash = hash_int(hash, m->diffuse_texture);
+		hash = hash_int(hash, m->specular_texture);
+		hash = hash_bytes(hash, &m->texture_scale, sizeof(float));
+	}
+	hash = hash_int(hash, scene->num_textures);
+	for(k = 0; k < scene->num_textures; k ++)
+		hash = hash_bytes(hash, &scene->textures[k].hash, sizeof(uint64_t));
+	for(k = 0; k < scene->num_placements; k ++)
+	{
+		const Material* m = &scene->placements[k].material;
+		hash = hash_int(hash, scene->placements[k].overrides);
+		hash = hash_bytes(hash, m->diffuse, sizeof(m->diffuse));
+		hash = hash_bytes(hash, m->specular, sizeof(m->specular));
+		hash = hash_bytes(hash, &m->shininess, sizeof(float) * 4);
+	}
+	hash = hash_int(hash, scene->num_lights);
+	hash = hash_bytes(hash, scene->lights, sizeof(Light) * scene->num_lights);
+	hash = hash_bytes(hash, scene->ambient_color, sizeof(scene->ambient_color));
+
+	hash = hash_int(hash, options->preview);
+	hash = hash_int(hash, options->preview ? options->preview_lights : 0);
+	hash = hash_int(hash, options->shadow_map_size);
+	hash = hash_bytes(hash, &options->shadow_bias, sizeof(float));
+	hash = hash_int(hash, options->light_samples);
+	hash = hash_int(hash, options->light_samples > 0 ? options->spp : 1);
+	return hash;
+}
+
+void free_gbuffer(GBuffer* g)
+{
+	int k;
+	for(k = 0; k < g->num_shadows; k ++)
+		free(g->shadows[k].visible);
+	free(g->shadows);
+	free(g->first);
+	free(g->nodes);
+	free(g);
+}
+
+// whether a node points at geometry the scene has, the way the hit it was made from would
+int gbuffer_node_valid(const CompiledScene* scene, const GBufferNode* node)
+{
+	int first = 0;
+	int count = scene->num_objects;
+	if(node->instance != -1)
+	{
+		if(node->instance < 0 || node->instance >= scene->num_placements)
+			return 0;
+		const GeometryGroup* group = &scene->groups[scene->placements[node->instance].group];
+		first = group->first;
+		count = group->count;
+	}
+	if(node->object_id < first || node->object_id >= first + count)
+		return 0;
+
+	const Geometry* shape = &scene->geometry[node->object_id];
+	if(shape->kind != T_MESH)
+		return node->primitive == -1;
+	return node->primitive >= 0 && node->primitive < scene->meshes[shape->mesh].num_triangles;
+}
+
+// children are counted from the pixel's first node and come after their parent
+int gbuffer_child_valid(int child, int parent, int size)
+{
+	return child == GBUFFER_NONE || child == GBUFFER_AMBIENT || (child > parent && child < size);
+}
+
+// everything relight_tile indexes with, checked against the job so a broken file is
+// traced again rather than read out of bounds
+int gbuffer_valid(const GBuffer* g, RenderJob* job)
+{
+	int num_pixels = g->width * g->height;
+	if(g->first[0] != 0 || g->first[num_pixels] != g->num_nodes)
+		return 0;
+
+	int p;
+	for(p = 0; p < num_pixels; p ++)
+	{
+		if(g->first[p + 1] < g->first[p] || g->first[p + 1] > g->num_nodes)
+			return 0;
+
+		int size = g->first[p + 1] - g->first[p];
+		int k;
+		for(k = 0; k < size; k ++)
+		{
+			const GBufferNode* node = &g->nodes[g->first[p] + k];
+			if(!gbuffer_node_valid(job->scene, node)
+				|| !gbuffer_child_valid(node->refract, k, size) || !gbuffer_child_valid(node->reflect, k, size))
+				return 0;
+		}
+	}
+
+	int k;
+	for(k = 0; k < g->num_shadows; k ++)
+	{
+		int n;
+		for(n = 0; n < g->num_nodes; n ++)
+		{
+			if(g->shadows[k].visible[n] > SHADOW_UNKNOWN)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// returns NULL if the file is missing, broken or for a different hash
+GBuffer* read_gbuffer(RenderJob* job, char* path, uint64_t hash)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+
+	char magic[8];
+	uint64_t file_hash;
+	int32_t sizes[3];
+	if(fread(magic, 1, 8, file) != 8 || memcmp(magic, GBUFFER_MAGIC, 8) != 0
+		|| fread(&file_hash, sizeof(uint64_t), 1, file) != 1 || file_hash != hash
+		|| fread(sizes, sizeof(int32_t), 3, file) != 3
+		|| sizes[0] != job->width || sizes[1] != job->height || sizes[2] < 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	// the sizes have to fit in what is left of the file before anything is allocated for them
+	long start = ftell(file);
+	fseek(file, 0, SEEK_END);
+	long left = ftell(file) - start;
+	fseek(file, start, SEEK_SET);
+	long num_pixels = (long) sizes[0] * sizes[1];
+	if(start < 0 || left < (long) sizeof(int32_t) * (num_pixels + 2) + (long) sizeof(GBufferNode) * sizes[2])
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	GBuffer* g = malloc(sizeof(GBuffer));
+	g->hash = hash;
+	g->width = sizes[0];
+	g->height = sizes[1];
+	g->num_nodes = sizes[2];
+	g->first = malloc(sizeof(int) * (num_pixels + 1));
+	g->nodes = malloc(sizeof(GBufferNode) * (g->num_nodes + 1));
+	g->num_shadows = 0;
+	g->shadows = NULL;
+
+	int32_t num_shadows = 0;
+	int ok = fread(g->first, sizeof(int32_t), num_pixels + 1, file) == (size_t) num_pixels + 1
+		&& fread(g->nodes, sizeof(GBufferNode), g->num_nodes, file) == (size_t) g->num_nodes
+		&& fread(&num_shadows, sizeof(int32_t), 1, file) == 1 && num_shadows >= 0
+		&& num_shadows <= (left - (long) sizeof(int32_t) * (num_pixels + 2) - (long) sizeof(GBufferNode) * g->num_nodes)
+			/ ((long) sizeof(float) * 3 + g->num_nodes);
+
+	if(ok)
+		g->shadows = malloc(sizeof(GBufferShadows) * (num_shadows + 1));
+	while(ok && g->num_shadows < num_shadows)
+	{
+		GBufferShadows* shadows = &g->shadows[g->num_shadows];
+		shadows->visible = malloc(g->num_nodes + 1);
+		g->num_shadows ++;
+		ok = fread(shadows->position, sizeof(float), 3, file) == 3
+			&& fread(shadows->visible, 1, g->num_nodes, file) == (size_t) g->num_nodes;
+	}
+	fclose(file);
+
+	if(!ok || !gbuffer_valid(g, job))
+	{
+		free_gbuffer(g);
+		return NULL;
+	}
+	return g;
+}
+
+// written next to path and renamed over it, so a reader never sees half a file
+void write_gbuffer(const GBuffer* g, char* path)
+{
+	char temp[strlen(path) + 8];
+	sprintf(temp, "%s.part", path);
+	FILE* file = fopen(temp, "wb");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Warning: could not write the g-buffer %s\n", path);
+		return;
+	}
+
+	char magic[8] = GBUFFER_MAGIC;
+	int32_t sizes[3];
+	sizes[0] = g->width;
+	sizes[1] = g->height;
+	sizes[2] = g->num_nodes;
+
+	fwrite(magic, 1, 8, file);
+	fwrite(&g->hash, sizeof(uint64_t), 1, file);
+	fwrite(sizes, sizeof(int32_t), 3, file);
+	fwrite(g->first, sizeof(int32_t), g->width * g->height + 1, file);
+	fwrite(g->nodes, sizeof(GBufferNode), g->num_nodes, file);
+
+	int32_t num_shadows = g->num_shadows;
+	fwrite(&num_shadows, sizeof(int32_t), 1, file);
+	int k;
+	for(k = 0; k < g->num_shadows; k ++)
+	{
+		fwrite(g->shadows[k].position, sizeof(float), 3, file);
+		fwrite(g->shadows[k].visible, 1, g->num_nodes, file);
+	}
+	if(fclose(file) == 0)
+		rename(temp, path);
+}
+
+// the nodes one tile traced, before they are put in pixel order
+typedef struct {
+	GBufferNode* nodes;
+	int count;
+	int capacity;
+} NodeList;
+
+int push_node(NodeList* list)
+{
+	if(list->count == list->capacity)
+	{
+		list->capacity = list->capacity * 2 + 64;
+		list->nodes = realloc(list->nodes, sizeof(GBufferNode) * list->capacity);
+	}
+	return list->count ++;
+}
+
+// follows the rays get_color_ray would trace, in the same order, and keeps the hits.
+// returns the node of the hit counted from start, or GBUFFER_AMBIENT
+int trace_gbuffer_ray(NodeList* list, int start, const CompiledScene* scene, SendRayFunction send,
+	float* r0, float* rd, int recursion)
+{
+	if(recursion <= 0)
+		return GBUFFER_AMBIENT;
+
+	Intersection hit;
+	send(&hit, scene, r0, rd, NULL);
+	if(hit.object_id == -1)
+		return GBUFFER_AMBIENT;
+
+	Material instance_material;
+	const Material* material = hit_material(scene, &hit, &instance_material);
+
+	float normal[3];
+	surface_normal(scene, &hit, normal);
+
+	int n = push_node(list);
+	GBufferNode* node = &list->nodes[n];
+	vector_copy(hit.point, node->point);
+	vector_copy(normal, node->normal);
+	node->object_id = hit.object_id;
+	node->instance = hit.instance;
+	node->primitive = hit.primitive;
+	node->refract = GBUFFER_NONE;
+	node->reflect = GBUFFER_NONE;
+
+	if(material->refractivity > 0 && !scene->skip_refraction)
+	{
+		float refracted_ray[3];
+		float new_point[3];
+		float n1 = 1;
+		float n2 = 1;
+
+		if(dot(normal, rd) < 0) n2 = material->ior; else n1 = material->ior;
+		smellit(rd, normal, n1, n2, refracted_ray);
+
+		add(hit.point, refracted_ray, new_point);
+		int child = trace_gbuffer_ray(list, start, scene, send, new_point, refracted_ray, recursion - 1);
+		list->nodes[n].refract = child;
+	}
+
+	// refraction leaves rd normalized, and that is the rd the lights are shaded with
+	vector_copy(rd, list->nodes[n].rd);
+
+	if(material->reflectivity > 0)
+	{
+		float reflect_r[3];
+		vector_copy(rd, reflect_r);
+		scale(normal, dot(reflect_r, normal) * 2, reflect_r);
+		subtract(rd, reflect_r, reflect_r);
+
+		float reflect_new_point[3];
+		add(hit.point, reflect_r, reflect_new_point);
+		int child = trace_gbuffer_ray(list, start, scene, send, reflect_new_point, reflect_r, recursion - 1);
+		list->nodes[n].reflect = child;
+	}
+
+	return n - start;
+}
+
+typedef struct {
+	RenderJob* job;
+	SendRayFunction send_ray;
+	int* counts; // nodes of each pixel
+	int* offsets; // where they start in their tile's list
+	int* owner; // which list that is
+	GBufferNode** lists;
+	int num_lists;
+	int list_capacity;
+	pthread_mutex_t lock;
+} GBufferBuild;
+
+void trace_gbuffer_tile(Tile tile, void* data)
+{
+	GBufferBuild* build = data;
+	RenderJob* job = build->job;
+	long rays = render_stats.rays;
+
+	NodeList list;
+	list.nodes = NULL;
+	list.count = 0;
+	list.capacity = 0;
+
+	int i;
+	int j;
+	for(i = tile.y0; i < tile.y1; i ++)
+	{
+		for(j = tile.x0; j < tile.x1; j ++)
+		{
+			int p = i * job->width + j;
+			float r0[3];
+			float rd[3];
+			primary_ray(job, i, j, r0, rd);
+
+			build->offsets[p] = list.count;
+			trace_gbuffer_ray(&list, list.count, job->scene, build->send_ray, r0, rd, job->max_depth);
+			build->counts[p] = list.count - build->offsets[p];
+		}
+	}
+
+	pthread_mutex_lock(&build->lock);
+	if(build->num_lists == build->list_capacity)
+	{
+		build->list_capacity = build->list_capacity * 2 + 16;
+		build->lists = realloc(build->lists, sizeof(GBufferNode*) * build->list_capacity);
+	}
+	int id = build->num_lists ++;
+	build->lists[id] = list.nodes;
+	pthread_mutex_unlock(&build->lock);
+
+	for(i = tile.y0; i < tile.y1; i ++)
+	{
+		for(j = tile.x0; j < tile.x1; j ++)
+			build->owner[i * job->width + j] = id;
+	}
+
+	__atomic_add_fetch(&job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+// traces the hits of every pixel of the job
+GBuffer* build_gbuffer(RenderJob* job, uint64_t hash, RenderOptions* options)
+{
+	int num_pixels = job->width * job->height;
+
+	GBufferBuild build;
+	build.job = job;
+	build.send_ray = send_ray_kernels[scene_features(job->scene) & KERNEL_INSTANCES];
+	build.counts = malloc(sizeof(int) * num_pixels);
+	build.offsets = malloc(sizeof(int) * num_pixels);
+	build.owner = malloc(sizeof(int) * num_pixels);
+	build.lists = NULL;
+	build.num_lists = 0;
+	build.list_capacity = 0;
+	pthread_mutex_init(&build.lock, NULL);
+
+	run_tiles(job->width, job->height, options->tile_size, 1, options->tile_order, options->num_threads, trace_gbuffer_tile, &build);
+
+	GBuffer* g = malloc(sizeof(GBuffer));
+	g->hash = hash;
+	g->width = job->width;
+	g->height = job->height;
+	g->first = malloc(sizeof(int) * (num_pixels + 1));
+
+	int p;
+	g->first[0] = 0;
+	for(p = 0; p < num_pixels; p ++)
+		g->first[p + 1] = g->first[p] + build.counts[p];
+	g->num_nodes = g->first[num_pixels];
+
+	g->nodes = malloc(sizeof(GBufferNode) * (g->num_nodes + 1));
+	g->num_shadows = 0;
+	g->shadows = NULL;
+	for(p = 0; p < num_pixels; p ++)
+		memcpy(&g->nodes[g->first[p]], &build.lists[build.owner[p]][build.offsets[p]], sizeof(GBufferNode) * build.counts[p]);
+
+	int k;
+	for(k = 0; k < build.num_lists; k ++)
+		free(build.lists[k]);
+	free(build.lists);
+	free(build.counts);
+	free(build.offsets);
+	free(build.owner);
+	pthread_mutex_destroy(&build.lock);
+	return g;
+}
+
+typedef struct {
+	RenderJob* job;
+	const GBuffer* gbuffer;
+	LightFunction add_light;
+	unsigned char** shadows; // per light, a SHADOW_* byte per node, or NULL
+	int traced; // set if any shadow ray had to be traced
+} RelightJob;
+
+int light_is_picked(const CompiledScene* scene, float* point, int light)
+{
+	int picked[scene->num_lights + 1];
+	int count = pick_lights(scene, point, picked);
+	int k;
+	for(k = 0; k < count; k ++)
+	{
+		if(picked[k] == light)
+			return 1;
+	}
+	return 0;
+}
+
+// adds what the refracted and reflected rays of a surface brought back to its lighting,
+// the way get_color_ray does. either is NULL if the surface doesn't send that ray
+void combine_node(const Material* material, float* color, const float* refracted, const float* reflected)
+{
+	int number_contributors = 1;
+
+	float added_color[3] = { 0, 0, 0 };
+	if(refracted != NULL)
+	{
+		scale(refracted, material->refractivity, added_color);
+		added_color[0] = clamp(added_color[0], 0.0, 1.0);
+		added_color[1] = clamp(added_color[1], 0.0, 1.0);
+		added_color[2] = clamp(added_color[2], 0.0, 1.0);
+		number_contributors ++;
+	}
+
+	float reflect_color[3] = { 0, 0, 0 };
+	if(reflected != NULL)
+	{
+		scale(reflected, material->reflectivity, reflect_color);
+		reflect_color[0] = clamp(reflect_color[0], 0.0, 1.0);
+		reflect_color[1] = clamp(reflect_color[1], 0.0, 1.0);
+		reflect_color[2] = clamp(reflect_color[2], 0.0, 1.0);
+	}
+
+	add(added_color, color, color);
+	add(reflect_color, color, color);
+	scale(color, 1/number_contributors, color);
+}
+
+// shades the stored hits of a tile one light at a time, then adds up each pixel's tree
+// from the bottom, the same way get_color_ray does on the way back up
+void relight_tile(Tile tile, void* data)
+{
+	RelightJob* relight = data;
+	RenderJob* job = relight->job;
+	const GBuffer* g = relight->gbuffer;
+	const CompiledScene* scene = job->scene;
+	long rays = render_stats.rays;
+
+	int count = 0;
+	int i;
+	int j;
+	for(i = tile.y0; i < tile.y1; i ++)
+		count += g->first[i * g->width + tile.x1] - g->first[i * g->width + tile.x0];
+
+	// the hits of the tile, row after row, with what they have gathered so far
+	GBufferNode** nodes = malloc(sizeof(GBufferNode*) * (count + 1));
+	float (*lighting)[3] = malloc(sizeof(float) * 3 * (count + 1));
+	const Material** materials = malloc(sizeof(Material*) * (count + 1));
+	Material* scratch = malloc(sizeof(Material) * (count + 1));
+	Intersection* hits = malloc(sizeof(Intersection) * (count + 1));
+
+	int n = 0;
+	for(i = tile.y0; i < tile.y1; i ++)
+	{
+		int k;
+		for(k = g->first[i * g->width + tile.x0]; k < g->first[i * g->width + tile.x1]; k ++)
+		{
+			GBufferNode* node = &g->nodes[k];
+			nodes[n] = node;
+			vector_copy(node->point, hits[n].point);
+			hits[n].object_id = node->object_id;
+			hits[n].instance = node->instance;
+			hits[n].primitive = node->primitive;
+			materials[n] = hit_material(scene, &hits[n], &scratch[n]);
+			vector_copy(scene->ambient_color, lighting[n]);
+			n ++;
+		}
+	}
+
+	int limited = scene->max_shaded_lights > 0 && scene->max_shaded_lights < scene->num_lights;
+	int light;
+	for(light = 0; light < scene->num_lights; light ++)
+	{
+		for(n = 0; n < count; n ++)
+		{
+			if(limited && !light_is_picked(scene, hits[n].point, light))
+				continue;
+
+			unsigned char* shadow = NULL;
+			if(relight->shadows != NULL)
+			{
+				shadow = &relight->shadows[light][nodes[n] - g->nodes];
+				if(*shadow == SHADOW_UNKNOWN)
+					__atomic_store_n(&relight->traced, 1, __ATOMIC_RELAXED);
+			}
+			relight->add_light(lighting[n], scene, light, &hits[n], nodes[n]->normal, nodes[n]->rd, materials[n], shadow);
+		}
+	}
+
+	n = 0;
+	for(i = tile.y0; i < tile.y1; i ++)
+	{
+		for(j = tile.x0; j < tile.x1; j ++)
+		{
+			int p = i * g->width + j;
+			int size = g->first[p + 1] - g->first[p];
+
+			// children come after their parent, so going backwards they are always done first
+			int k;
+			for(k = size - 1; k >= 0; k --)
+			{
+				GBufferNode* node = nodes[n + k];
+				const float* refracted = NULL;
+				const float* reflected = NULL;
+				if(node->refract != GBUFFER_NONE)
+					refracted = node->refract == GBUFFER_AMBIENT ? scene->ambient_color : lighting[n + node->refract];
+				if(node->reflect != GBUFFER_NONE)
+					reflected = node->reflect == GBUFFER_AMBIENT ? scene->ambient_color : lighting[n + node->reflect];
+				combine_node(materials[n + k], lighting[n + k], refracted, reflected);
+			}
+
+			float colors[3];
+			if(size > 0)
+				vector_copy(lighting[n], colors);
+			else
+				vector_copy(scene->ambient_color, colors);
+			store_pixel(job, i, j, colors);
+			n += size;
+		}
+	}
+
+	free(nodes);
+	free(lighting);
+	free(materials);
+	free(scratch);
+	free(hits);
+	__atomic_add_fetch(&job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+// renders the job from the g-buffer in options->gbuffer, tracing the hits first if the
+// file is missing or belongs to other geometry
+void render_gbuffer(RenderJob* job, RenderOptions* options)
+{
+	uint64_t hash = gbuffer_hash(job);
+	GBuffer* g = read_gbuffer(job, options->gbuffer, hash);
+	int built = 0;
+	if(g == NULL)
+	{
+		g = build_gbuffer(job, hash, options);
+		built = 1;
+	}
+
+	RelightJob relight;
+	relight.job = job;
+	relight.gbuffer = g;
+	relight.add_light = add_light_kernels[scene_features(job->scene)];
+	relight.shadows = NULL;
+	relight.traced = 0;
+
+	// shadow maps are cheap to look up again, shadow rays are worth keeping
+	const CompiledScene* scene = job->scene;
+	if(scene->shadow_maps == NULL)
+	{
+		relight.shadows = malloc(sizeof(unsigned char*) * (scene->num_lights + 1));
+		int light;
+		for(light = 0; light < scene->num_lights; light ++)
+		{
+			relight.shadows[light] = NULL;
+			int k;
+			for(k = 0; k < g->num_shadows; k ++)
+			{
+				if(memcmp(g->shadows[k].position, scene->lights[light].position, sizeof(float) * 3) == 0)
+				{
+					relight.shadows[light] = g->shadows[k].visible;
+					g->shadows[k].visible = NULL;
+					break;
+				}
+			}
+			if(relight.shadows[light] == NULL)
+			{
+				relight.shadows[light] = malloc(g->num_nodes + 1);
+				memset(relight.shadows[light], SHADOW_UNKNOWN, g->num_nodes + 1);
+			}
+		}
+	}
+
+	run_tiles(job->width, job->height, options->tile_size, 1, options->tile_order, options->num_threads, relight_tile, &relight);
+
+	// keep the shadows of the lights as they are now
+	if(relight.shadows != NULL)
+	{
+		int k;
+		for(k = 0; k < g->num_shadows; k ++)
+			free(g->shadows[k].visible);
+		free(g->shadows);
+
+		g->num_shadows = scene->num_lights;
+		g->shadows = malloc(sizeof(GBufferShadows) * (scene->num_lights + 1));
+		for(k = 0; k < scene->num_lights; k ++)
+		{
+			vector_copy(scene->lights[k].position, g->shadows[k].position);
+			g->shadows[k].visible = relight.shadows[k];
+		}
+		free(relight.shadows);
+	}
+	if(built || relight.traced)
+		write_gbuffer(g, options->gbuffer);
+
+	free_gbuffer(g);
+}
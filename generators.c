@@ -0,0 +1,147 @@
+// procedural generators
+// a generator object in a scene stands for many instances of a group, laid out by a rule
+// instead of being written out one by one:
+//
+//   "grid"     counts[0] x counts[1] x counts[2] copies, spacing apart, starting at position
+//   "scatter"  count copies at random in a box of size centered on position, from seed
+//   "path"     count copies evenly spaced along the line through points, from position
+//
+// the copies become ordinary instances while the scene is read, so nothing after the
+// parser knows they were generated. copy k only depends on k, not on the copies before it.
+
+#define MAX_GENERATED 16777216
+
+typedef struct {
+	int kind; // T_GRID, T_SCATTER or T_PATH
+	Instance base; // group, transform and overrides every copy starts from
+	int count;
+	int counts[3]; // grid
+	float spacing[3];
+	float size[3]; // scatter
+	uint64_t seed;
+	float scale_jitter; // scatter scales vary by up to this fraction either way
+	float rotation_jitter[3]; // and rotations by up to this many degrees
+	int num_points; // path
+	float* points;
+	float* distances; // along the path to each point
+} Generator;
+
+// splitmix64
+uint64_t mix_bits(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// uniform in [-1, 1)
+float random_signed(uint64_t* state)
+{
+	*state = mix_bits(*state);
+	return (*state >> 40) / (float) (1 << 23) - 1;
+}
+
+// the copies a generator makes, after checking it has what it needs
+int generator_count(Generator* g)
+{
+	double total = 0;
+	if(g->kind == T_GRID)
+	{
+		if(g->counts[0] < 1 || g->counts[1] < 1 || g->counts[2] < 1)
+		{
+			scene_error("Error: grid counts must be at least 1! Line %d\n", line);
+		}
+		total = (double) g->counts[0] * g->counts[1] * g->counts[2];
+	}
+	else
+	{
+		if(g->count < 1)
+		{
+			scene_error("Error: generator must have a count of at least 1! Line %d\n", line);
+		}
+		total = g->count;
+	}
+	if(g->kind == T_SCATTER && (g->scale_jitter < 0 || g->scale_jitter >= 1))
+	{
+		scene_error("Error: scale-jitter must be at least 0 and less than 1! Line %d\n", line);
+	}
+	if(g->kind == T_PATH && g->num_points < 2)
+	{
+		scene_error("Error: path must have at least 2 points! Line %d\n", line);
+	}
+	if(total > MAX_GENERATED)
+	{
+		scene_error("Error: generator makes more than %d copies! Line %d\n", MAX_GENERATED, line);
+	}
+	return (int) total;
+}
+
+// the running length of the path up to each point, for spacing copies evenly
+void measure_path(Generator* g)
+{
+	g->distances = malloc(sizeof(float) * g->num_points);
+	g->distances[0] = 0;
+	int k;
+	for(k = 1; k < g->num_points; k ++)
+	{
+		float d[3];
+		subtract(&g->points[k * 3], &g->points[(k - 1) * 3], d);
+		g->distances[k] = g->distances[k - 1] + length(d);
+	}
+}
+
+void path_point(Generator* g, float distance, float* point)
+{
+	int k = 1;
+	while(k < g->num_points - 1 && g->distances[k] < distance)
+		k ++;
+
+	float* a = &g->points[(k - 1) * 3];
+	float* b = &g->points[k * 3];
+	float span = g->distances[k] - g->distances[k - 1];
+	float t = span > 0 ? (distance - g->distances[k - 1]) / span : 0;
+
+	float d[3];
+	subtract(b, a, d);
+	scale(d, t, d);
+	add(a, d, point);
+}
+
+// fills in copy k of the generator
+void generator_instance(Generator* g, int k, Instance* instance)
+{
+	*instance = g->base;
+	float offset[3] = { 0, 0, 0 };
+
+	if(g->kind == T_GRID)
+	{
+		offset[0] = g->spacing[0] * (k % g->counts[0]);
+		offset[1] = g->spacing[1] * (k / g->counts[0] % g->counts[1]);
+		offset[2] = g->spacing[2] * (k / g->counts[0] / g->counts[1]);
+	}
+	else if(g->kind == T_SCATTER)
+	{
+		uint64_t state = mix_bits(g->seed) ^ (uint64_t) k * 0xd1b54a32d192ed03ULL;
+		int a;
+		for(a = 0; a < 3; a ++)
+			offset[a] = random_signed(&state) * g->size[a] / 2;
+		for(a = 0; a < 3; a ++)
+			instance->rotation[a] += random_signed(&state) * g->rotation_jitter[a];
+		instance->scale *= 1 + random_signed(&state) * g->scale_jitter;
+	}
+	else if(g->kind == T_PATH)
+	{
+		float total = g->distances[g->num_points - 1];
+		float distance = g->count > 1 ? total * k / (g->count - 1) : 0;
+		path_point(g, distance, offset);
+	}
+
+	add(instance->position, offset, instance->position);
+}
+
+void free_generator(Generator* g)
+{
+	free(g->points);
+	free(g->distances);
+}
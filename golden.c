@@ -0,0 +1,276 @@
+#include <sys/stat.h>
+
+#include "render.c"
+
+// golden image regression harness
+// renders every scene in the corpus, compares it against the stored reference
+// image and checks that rays/sec has not dropped compared to the last recorded run
+
+#define REFERENCE_DIR "tests/reference"
+#define OUTPUT_DIR "tests/output"
+#define TIMING_FILE "tests/timing.txt"
+
+typedef struct {
+	char* name;
+	char* scene;
+	int width;
+	int height;
+	int light_samples; // render with light sampling, 0 shades every light
+	int spp;
+} GoldenCase;
+
+GoldenCase golden_cases[] = {
+	{ "good01", "good01.json", 96, 96, 0, 0 },
+	{ "cylinders", "tests/scenes/cylinders.json", 96, 96, 0, 0 },
+	{ "spotlights", "tests/scenes/spotlights.json", 96, 96, 0, 0 },
+	{ "mirrors", "tests/scenes/mirrors.json", 96, 96, 0, 0 },
+	{ "glass", "tests/scenes/glass.json", 96, 96, 0, 0 },
+	{ "instances", "tests/scenes/instances.json", 96, 96, 0, 0 },
+	{ "groupmirrors", "tests/scenes/groupmirrors.json", 96, 96, 0, 0 },
+	{ "meshes", "tests/scenes/meshes.json", 96, 96, 0, 0 },
+	{ "generators", "tests/scenes/generators.json", 96, 96, 0, 0 },
+	{ "manylights", "tests/scenes/manylights.json", 96, 96, 4, 4 },
+	{ "textures", "tests/scenes/textures.json", 96, 96, 0, 0 },
+};
+
+#define NUM_GOLDEN_CASES ((int) (sizeof(golden_cases) / sizeof(GoldenCase)))
+
+typedef struct {
+	int max_diff; // largest difference of any channel
+	int bad_pixels; // pixels with a channel over the tolerance
+	double psnr;
+	int valid;
+} ImageDiff;
+
+Pixel* load_image(char* path, PPMmeta* meta)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		meta->valid = 1;
+		return NULL;
+	}
+
+	*meta = CheckValidPPM(file);
+	if(meta->valid != 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	Pixel* data = LoadPPM(file, meta->type, meta->width * meta->height);
+	fclose(file);
+	return data;
+}
+
+ImageDiff compare_images(char* reference, char* output, int tolerance)
+{
+	ImageDiff diff;
+	diff.max_diff = 0;
+	diff.bad_pixels = 0;
+	diff.psnr = INFINITY;
+	diff.valid = 0;
+
+	PPMmeta ref_meta;
+	PPMmeta out_meta;
+	Pixel* ref = load_image(reference, &ref_meta);
+	Pixel* out = load_image(output, &out_meta);
+
+	if(ref == NULL || out == NULL)
+		return diff;
+	if(ref_meta.width != out_meta.width || ref_meta.height != out_meta.height)
+		return diff;
+
+	int size = ref_meta.width * ref_meta.height;
+	double squared_error = 0;
+	int c;
+	for(c = 0; c < size; c ++)
+	{
+		int d[3];
+		d[0] = abs(ref[c].r - out[c].r);
+		d[1] = abs(ref[c].g - out[c].g);
+		d[2] = abs(ref[c].b - out[c].b);
+
+		int k;
+		int worst = 0;
+		for(k = 0; k < 3; k ++)
+		{
+			squared_error += d[k] * d[k];
+			if(d[k] > worst) worst = d[k];
+		}
+
+		if(worst > tolerance) diff.bad_pixels ++;
+		if(worst > diff.max_diff) diff.max_diff = worst;
+	}
+
+	double mse = squared_error / (size * 3.0);
+	if(mse > 0)
+		diff.psnr = 10 * log10(255.0 * 255.0 / mse);
+
+	diff.valid = 1;
+	free(ref);
+	free(out);
+	return diff;
+}
+
+// the timing file holds one "name rays_per_second" line per case
+double recorded_rate(char* name)
+{
+	FILE* file = fopen(TIMING_FILE, "r");
+	if(file == NULL)
+		return 0;
+
+	char case_name[128];
+	double rate;
+	double found = 0;
+	while(fscanf(file, "%127s %lf", case_name, &rate) == 2)
+	{
+		if(strcmp(case_name, name) == 0)
+			found = rate;
+	}
+	fclose(file);
+	return found;
+}
+
+void write_rates(double* rates)
+{
+	FILE* file = fopen(TIMING_FILE, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Warning: could not write %s\n", TIMING_FILE);
+		return;
+	}
+
+	int k;
+	for(k = 0; k < NUM_GOLDEN_CASES; k ++)
+		fprintf(file, "%s %.0f\n", golden_cases[k].name, rates[k]);
+	fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+	int tolerance = 2;
+	double min_psnr = 40;
+	double max_slowdown = 0.25;
+	int runs = 3;
+	int update = 0;
+
+	RenderOptions options;
+	default_render_options(&options);
+
+	int a;
+	for(a = 1; a < argc; a ++)
+	{
+		if(strcmp(argv[a], "--tolerance") == 0 && a + 1 < argc)
+			tolerance = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--min-psnr") == 0 && a + 1 < argc)
+			min_psnr = atof(argv[++a]);
+		else if(strcmp(argv[a], "--max-slowdown") == 0 && a + 1 < argc)
+			max_slowdown = atof(argv[++a]);
+		else if(strcmp(argv[a], "--runs") == 0 && a + 1 < argc)
+			runs = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+			options.num_threads = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--update") == 0)
+			update = 1;
+		else
+		{
+			fprintf(stderr, "Usage: %s [--tolerance N] [--min-psnr dB] [--max-slowdown fraction] [--runs N] [--threads N] [--update]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if(runs < 1) runs = 1;
+
+	mkdir(OUTPUT_DIR, 0755);
+	if(update) mkdir(REFERENCE_DIR, 0755);
+
+	double rates[NUM_GOLDEN_CASES];
+	int have_all_rates = 1;
+	int failures = 0;
+
+	int k;
+	for(k = 0; k < NUM_GOLDEN_CASES; k ++)
+	{
+		GoldenCase test = golden_cases[k];
+
+		char output[256];
+		char reference[256];
+		snprintf(output, sizeof(output), "%s/%s.ppm", OUTPUT_DIR, test.name);
+		snprintf(reference, sizeof(reference), "%s/%s.ppm", REFERENCE_DIR, test.name);
+
+		PPMmeta fileinfo;
+		fileinfo.width = test.width;
+		fileinfo.height = test.height;
+		fileinfo.max = 255;
+		fileinfo.type = 6;
+
+		options.light_samples = test.light_samples;
+		options.spp = max(test.spp, 1);
+
+		Scene scene;
+		read_scene(test.scene, &scene);
+		CompiledScene* compiled = malloc(sizeof(CompiledScene));
+		setup_scene(&scene, compiled);
+
+		// keep the fastest run, the others are mostly noise from the machine
+		double best_time = INFINITY;
+		long rays = 0;
+		int r;
+		for(r = 0; r < runs; r ++)
+		{
+			render_stats.rays = 0;
+			double start = now_seconds();
+			raycast(compiled, update ? reference : output, fileinfo, &options);
+			double elapsed = now_seconds() - start;
+			if(elapsed < best_time) best_time = elapsed;
+			rays = render_stats.rays;
+		}
+
+		free_compiled_scene(compiled);
+		rates[k] = rays / best_time;
+
+		if(update)
+		{
+			printf("%-12s updated reference, %ld rays, %.0f rays/sec\n", test.name, rays, rates[k]);
+			continue;
+		}
+
+		int failed = 0;
+		ImageDiff diff = compare_images(reference, output, tolerance);
+		if(!diff.valid)
+		{
+			printf("%-12s FAIL could not compare %s against %s\n", test.name, output, reference);
+			failures ++;
+			continue;
+		}
+		if(diff.bad_pixels > 0 || diff.psnr < min_psnr)
+			failed = 1;
+
+		double previous = recorded_rate(test.name);
+		if(previous <= 0)
+			have_all_rates = 0;
+		else if(rates[k] < previous * (1 - max_slowdown))
+			failed = 1;
+
+		printf("%-12s %s max diff %d, %d pixels over tolerance, PSNR %.2f dB, %.0f rays/sec",
+			test.name, failed ? "FAIL" : "ok  ", diff.max_diff, diff.bad_pixels, diff.psnr, rates[k]);
+		if(previous > 0)
+			printf(" (recorded %.0f)", previous);
+		printf("\n");
+
+		failures += failed;
+	}
+
+	// the first run on a machine records the rates that later runs are held to
+	if(update || (!have_all_rates && failures == 0))
+		write_rates(rates);
+
+	if(failures > 0)
+	{
+		printf("%d of %d golden cases failed\n", failures, NUM_GOLDEN_CASES);
+		return 1;
+	}
+
+	printf("all %d golden cases passed\n", NUM_GOLDEN_CASES);
+	return 0;
+}
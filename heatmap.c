@@ -0,0 +1,109 @@
+// cost heatmap
+// with a heatmap file set, what every pixel cost is kept next to its color: the rays it
+// traced, the intersection tests they made, how many surfaces deep its rays went, or the
+// time it took. after the frame the costs are scaled to the 99.9th percentile, so a few
+// extreme pixels don't wash the rest out, and written as a false color image, dark for
+// cheap pixels through red to pale yellow for the most expensive ones.
+
+#define HEAT_RAYS 0
+#define HEAT_TESTS 1
+#define HEAT_DEPTH 2
+#define HEAT_TIME 3
+
+const char* heat_metric_names[] = { "rays", "tests", "depth", "time" };
+const char* heat_metric_units[] = { "rays", "intersection tests", "surfaces deep", "ns" };
+
+int parse_heat_metric(char* name)
+{
+	int k;
+	for(k = 0; k <= HEAT_TIME; k ++)
+	{
+		if(strcmp(name, heat_metric_names[k]) == 0)
+			return k;
+	}
+	return -1;
+}
+
+// the counters when a pixel started
+typedef struct {
+	long rays;
+	long tests;
+	double start;
+} HeatSample;
+
+void start_heat(RenderJob* job, HeatSample* sample)
+{
+	sample->rays = render_stats.rays;
+	sample->tests = render_stats.tests;
+	sample->start = job->heat_metric == HEAT_TIME ? now_seconds() : 0;
+	render_stats.min_recursion = INT_MAX;
+}
+
+void end_heat(RenderJob* job, HeatSample* sample, int i, int j)
+{
+	float value = 0;
+	if(job->heat_metric == HEAT_RAYS)
+		value = render_stats.rays - sample->rays;
+	else if(job->heat_metric == HEAT_TESTS)
+		value = render_stats.tests - sample->tests;
+	else if(job->heat_metric == HEAT_DEPTH)
+		value = render_stats.min_recursion == INT_MAX ? 0 : job->max_depth - render_stats.min_recursion + 1;
+	else
+		value = (now_seconds() - sample->start) * 1e9;
+	job->heat[i * job->width + j] = value;
+}
+
+// inferno-like, from black through purple, red and orange to pale yellow
+void heat_color(float t, Pixel* pixel)
+{
+	static const float stops[5][3] = {
+		{ 0, 0, 4 }, { 87, 16, 110 }, { 188, 55, 84 }, { 249, 142, 9 }, { 252, 255, 164 },
+	};
+	t = clamp(t, 0, 1) * 4;
+	int k = min(t, 3);
+	float f = t - k;
+	pixel->r = (unsigned char) (stops[k][0] + (stops[k + 1][0] - stops[k][0]) * f);
+	pixel->g = (unsigned char) (stops[k][1] + (stops[k + 1][1] - stops[k][1]) * f);
+	pixel->b = (unsigned char) (stops[k][2] + (stops[k + 1][2] - stops[k][2]) * f);
+}
+
+int compare_floats(const void* a, const void* b)
+{
+	float fa = *(float*) a;
+	float fb = *(float*) b;
+	return fa < fb ? -1 : fa > fb;
+}
+
+// false colors the costs of the job, scaled up to the output size like the image is
+void write_heatmap(RenderJob* job, char* path, PPMmeta fileinfo)
+{
+	int count = job->width * job->height;
+	float* sorted = malloc(sizeof(float) * count);
+	memcpy(sorted, job->heat, sizeof(float) * count);
+	qsort(sorted, count, sizeof(float), compare_floats);
+	float top = sorted[(int) ((count - 1) * 0.999)];
+	float highest = sorted[count - 1];
+	double sum = 0;
+	int k;
+	for(k = 0; k < count; k ++)
+		sum += sorted[k];
+	free(sorted);
+
+	Pixel* image = malloc(sizeof(Pixel) * count);
+	for(k = 0; k < count; k ++)
+		heat_color(top > 0 ? job->heat[k] / top : 0, &image[k]);
+
+	if(job->width != fileinfo.width || job->height != fileinfo.height)
+	{
+		Pixel* full = malloc(sizeof(Pixel) * fileinfo.width * fileinfo.height);
+		upscale_image(image, job->width, job->height, full, fileinfo.width, fileinfo.height);
+		free(image);
+		image = full;
+	}
+
+	WritePPM(image, path, fileinfo);
+	free(image);
+
+	const char* unit = heat_metric_units[job->heat_metric];
+	printf("Heatmap of %s per pixel: mean %.1f, brightest at %.1f, highest %.1f\n", unit, sum / count, top, highest);
+}
@@ -39,6 +39,11 @@ int WritePPM(Pixel* data, char* output, PPMmeta meta);
 
 char* intToStr(int i, int size);
 
+/*	upscale_image
+*	bilinear resize of a sw x sh image into a dw x dh image
+*/
+void upscale_image(Pixel* src, int sw, int sh, Pixel* dst, int dw, int dh);
+
 int WritePPM(Pixel* data, char* output, PPMmeta meta)
 {
 	FILE *out = fopen(output, "w+");
@@ -54,7 +59,6 @@ int WritePPM(Pixel* data, char* output, PPMmeta meta)
 		fprintf(out, "%d\n", meta.max);
 	
 		int c;
-		char newline = 10;
 		for(c = 0; c < meta.width * meta.height; c++)
 		{
 			Pixel p = data[c];
@@ -113,7 +117,6 @@ int PPMtoT(FILE *file, char* output, int out_type, PPMmeta meta)
 		fprintf(out, "%d\n", meta.max);
 	
 		int c;
-		char newline = 10;
 		for(c = 0; c < meta.width * meta.height; c++)
 		{
 			Pixel p = data[c];
@@ -164,7 +167,7 @@ Pixel* LoadPPM(FILE *file, int type, int size)
 	
 	if(type == 3)
 	{
-		char* cbuffer;
+		char cbuffer[4];
 		int cbuffer_size;
 		
 		char character; // holds a character that was read in
@@ -178,7 +181,6 @@ Pixel* LoadPPM(FILE *file, int type, int size)
 			
 			while(r < 0 || g < 0 || b < 0) // read values for each of the rgb components for a single pixel
 			{
-				cbuffer = malloc(sizeof(char) * 4); // set up a buffer
 				cbuffer_size = 0; // the length of the number
 				character = fgetc(file);
 				while(character != 10 && cbuffer_size < 3)
@@ -188,6 +190,7 @@ Pixel* LoadPPM(FILE *file, int type, int size)
 					character = fgetc(file);
 				}
 				
+				cbuffer[cbuffer_size] = 0;
 				if(cbuffer_size > 0)
 				{
 					int value = atoi(cbuffer);
@@ -208,14 +211,9 @@ Pixel* LoadPPM(FILE *file, int type, int size)
 	else if(type == 6)
 	{
 		//printf("type: 6, size: %d\n", size);
-		int c;
-		for(c = 0; c < size; c++)
-		{
-			Pixel* pixel = malloc(sizeof(Pixel));
-			fread(pixel, sizeof(Pixel), 1, file);
-			buffer[c] = *pixel;
-		}
-		
+		// a short file leaves the rest black rather than uninitialized
+		int read = fread(buffer, sizeof(Pixel), size, file);
+		memset(buffer + read, 0, sizeof(Pixel) * (size - read));
 	}
 	
 	return buffer;
@@ -240,7 +238,7 @@ PPMmeta CheckValidPPM(FILE *file)
 	int Mmax = 0;
 	
 	int buffer_len = 0;
-	char* buffer = malloc(sizeof(char) * 4);
+	char buffer[6] = { 0 };
 	
 	// spaghetti code incoming
 	
@@ -269,9 +267,7 @@ PPMmeta CheckValidPPM(FILE *file)
 				if(c == 'P')
 				{
 					int c2 = fgetc(file);
-					char _type[2];
-					_type[0] = c2;
-					meta.type = atoi(_type);
+					meta.type = c2 - '0';
 					Mtype = 2;
 					c2 = fgetc(file);
 				}
@@ -303,7 +299,7 @@ PPMmeta CheckValidPPM(FILE *file)
 					}
 					
 					meta.width = width_value;
-					buffer = malloc(sizeof(char) * 5);
+					memset(buffer, 0, sizeof(buffer));
 					buffer_len = 0;
 				}
 				else
@@ -335,7 +331,7 @@ PPMmeta CheckValidPPM(FILE *file)
 					}
 					
 					meta.height = height_value;
-					buffer = malloc(sizeof(char) * 5);
+					memset(buffer, 0, sizeof(buffer));
 					buffer_len = 0;
 				}
 				else
@@ -387,4 +383,38 @@ char* intToStr(int i, int size)
 	char* str = malloc(sizeof(char) * size);
 	sprintf(str, "%d", i);
 	return str;
-}
\ No newline at end of file
+}
+void upscale_image(Pixel* src, int sw, int sh, Pixel* dst, int dw, int dh)
+{
+	int x;
+	int y;
+	for(y = 0; y < dh; y ++)
+	{
+		// position of the destination pixel center in source pixels
+		float sy = (y + 0.5) * sh / dh - 0.5;
+		if(sy < 0) sy = 0;
+		int y0 = (int) sy;
+		int y1 = y0 + 1 < sh ? y0 + 1 : y0;
+		float fy = sy - y0;
+
+		for(x = 0; x < dw; x ++)
+		{
+			float sx = (x + 0.5) * sw / dw - 0.5;
+			if(sx < 0) sx = 0;
+			int x0 = (int) sx;
+			int x1 = x0 + 1 < sw ? x0 + 1 : x0;
+			float fx = sx - x0;
+
+			Pixel a = src[y0 * sw + x0];
+			Pixel b = src[y0 * sw + x1];
+			Pixel c = src[y1 * sw + x0];
+			Pixel d = src[y1 * sw + x1];
+
+			Pixel p;
+			p.r = (unsigned char) ((a.r * (1 - fx) + b.r * fx) * (1 - fy) + (c.r * (1 - fx) + d.r * fx) * fy + 0.5);
+			p.g = (unsigned char) ((a.g * (1 - fx) + b.g * fx) * (1 - fy) + (c.g * (1 - fx) + d.g * fx) * fy + 0.5);
+			p.b = (unsigned char) ((a.b * (1 - fx) + b.b * fx) * (1 - fy) + (c.b * (1 - fx) + d.b * fx) * fy + 0.5);
+			dst[y * dw + x] = p;
+		}
+	}
+}
@@ -4,8 +4,19 @@
 #define T_PLANE 3
 #define T_LIGHT 4
 #define T_CYLINDER 5
+#define T_INSTANCE 6
+#define T_MESH 7
+#define T_GRID 8
+#define T_SCATTER 9
+#define T_PATH 10
 
-int line = 1;
+#define OVERRIDE_DIFFUSE 1
+#define OVERRIDE_SPECULAR 2
+#define OVERRIDE_REFLECTIVITY 4
+#define OVERRIDE_REFRACTIVITY 8
+#define OVERRIDE_IOR 16
+
+__thread int line = 1;
 
 int next_c(FILE* file)
 {
@@ -14,8 +25,7 @@ int next_c(FILE* file)
 		line ++;
 	}
 	if (c == EOF) {
-		fprintf(stderr, "Error: unexpected EOF\n");
-		exit(1);
+		scene_error("Error: unexpected EOF\n");
 	}
 	return c;
 }
@@ -23,8 +33,7 @@ void expect_c(FILE* file, int d)
 {
 	int c = next_c(file);
 	if (c == d) return;
-	fprintf(stderr, "Error: expected %c got %c on line %d\n", d, c, line);
-	exit(1);
+	scene_error("Error: expected %c got %c on line %d\n", d, c, line);
 }
 void skip_ws(FILE* file)
 {
@@ -44,13 +53,12 @@ float next_number(FILE* file)
 	// error
 	if(res == 1)
 		return val;
-	fprintf(stderr, "Error: Could not read number on line %d\n", line);
-	exit(1);
+	scene_error("Error: Could not read number on line %d\n", line);
 }
 
-float* next_vector(FILE* file)
+// [x,y,z] into v
+void next_vector(FILE* file, float* v)
 {
-	float* v = malloc(3 * sizeof(float));
 	expect_c(file, '[');
 	skip_ws(file);
 	v[0] = next_number(file);
@@ -64,16 +72,51 @@ float* next_vector(FILE* file)
 	v[2] = next_number(file);
 	skip_ws(file);
 	expect_c(file, ']');
-	return v;
+}
+
+// [[x,y,z], [x,y,z], ...], returns the number of vectors read
+int next_vector_list(FILE* file, float** list)
+{
+	int count = 0;
+	int capacity = 16;
+	*list = malloc(sizeof(float) * 3 * capacity);
+
+	expect_c(file, '[');
+	skip_ws(file);
+	int c = next_c(file);
+	if(c == ']')
+		return 0;
+	ungetc(c, file);
+
+	while(1)
+	{
+		if(count == capacity)
+		{
+			capacity *= 2;
+			*list = realloc(*list, sizeof(float) * 3 * capacity);
+		}
+		next_vector(file, &(*list)[count * 3]);
+		count ++;
+
+		skip_ws(file);
+		c = next_c(file);
+		if(c == ']')
+			return count;
+		if(c != ',')
+		{
+			scene_error("Error: expected , or ] in a list of vectors on line %d\n", line);
+		}
+		skip_ws(file);
+	}
 }
 
 char* parse_string(FILE* file)
 {
 	expect_c(file, '"');
 	
-	int max_size = 128;
+	int max_size = 1024;
 	
-	char buffer[max_size];
+	char buffer[max_size + 1];
 	int buff_size = 0;
 	
 	int c = next_c(file);
@@ -82,8 +125,7 @@ char* parse_string(FILE* file)
 		
 		if (c < 32 || c > 126)
 		{
-			fprintf(stderr, "Error: only readable ascii characters are allowed. on line %d\n", line);
-			exit(1);
+			scene_error("Error: only readable ascii characters are allowed. on line %d\n", line);
 		}
 		
 		buffer[buff_size] = c;
@@ -96,10 +138,99 @@ char* parse_string(FILE* file)
 	return strdup(buffer);
 }
 
-Scene read_scene(char* json_name)
+// paths in a scene are relative to the scene file
+char* relative_path(char* json_name, char* path)
 {
-	FILE * json = fopen(json_name, "r");
-	Scene scene;
+	char* slash = strrchr(json_name, '/');
+	if(path[0] == '/' || slash == NULL)
+		return strdup(path);
+
+	int dir_length = slash - json_name + 1;
+	char* full = malloc(dir_length + strlen(path) + 1);
+	memcpy(full, json_name, dir_length);
+	strcpy(full + dir_length, path);
+	return full;
+}
+
+// returns 1 + the index of the named group, adding it if this is the first time it is seen
+int find_group(Scene* scene, char* name)
+{
+	int k;
+	for(k = 0; k < scene->num_groups; k ++)
+	{
+		if(strcmp(scene->group_names[k], name) == 0)
+			return k + 1;
+	}
+
+	if(scene->num_groups == MAX_GROUPS)
+	{
+		scene_error("Error: Too many groups! Line %d\n", line);
+	}
+	scene->group_names[scene->num_groups] = strdup(name);
+	scene->num_groups ++;
+	return scene->num_groups;
+}
+
+void add_instance(Scene* scene, Instance* instance)
+{
+	if(scene->num_instances == scene->instance_capacity)
+	{
+		scene->instance_capacity = scene->instance_capacity * 2 + 16;
+		scene->instances = realloc(scene->instances, sizeof(Instance) * scene->instance_capacity);
+	}
+	scene->instances[scene->num_instances] = *instance;
+	scene->num_instances ++;
+}
+
+// lights aren't limited like objects, a scene can have thousands of them
+void push_light(Scene* scene, Object* light)
+{
+	if(scene->num_lights == scene->light_capacity)
+	{
+		scene->light_capacity = scene->light_capacity * 2 + 16;
+		scene->lights = realloc(scene->lights, sizeof(Object) * scene->light_capacity);
+	}
+	scene->lights[scene->num_lights] = *light;
+	scene->num_lights ++;
+}
+
+#include "generators.c"
+
+// adds the instances a generator stands for
+void expand_generator(Scene* scene, Generator* g)
+{
+	int count = generator_count(g);
+
+	// generators that each stay under MAX_GENERATED can still add up past what an int counts
+	long total = (long) scene->num_instances + count;
+	if(total > INT_MAX)
+	{
+		scene_error("Error: the generators make more than %d instances in all! Line %d\n", INT_MAX, line);
+	}
+
+	if(g->kind == T_PATH)
+		measure_path(g);
+
+	// grow once up front rather than doubling through millions of copies
+	if(total > scene->instance_capacity)
+	{
+		scene->instance_capacity = total;
+		scene->instances = realloc(scene->instances, sizeof(Instance) * scene->instance_capacity);
+	}
+
+	int k;
+	for(k = 0; k < count; k ++)
+		generator_instance(g, k, &scene->instances[scene->num_instances + k]);
+	scene->num_instances += count;
+}
+
+// reads the scene in json into scene. json_name is only used to find files the scene
+// refers to, json is left open. if reading fails scene keeps what was read so far,
+// the object that was being read too, and free_scene frees it
+void read_scene_stream(FILE* json, char* json_name, Scene* scene)
+{
+	memset(scene, 0, sizeof(Scene));
+	line = 1;
 
 	int c;
 	
@@ -114,7 +245,7 @@ Scene read_scene(char* json_name)
 	if (c == ']')
 	{
 		fprintf(stderr, "Warning: empty scene file.\n");
-		return scene;
+		return;
 	}
 
 	ungetc(c, json);
@@ -134,8 +265,8 @@ Scene read_scene(char* json_name)
 		// parse an object
 		char* key = parse_string(json);
 		if (strcmp(key, "type") != 0) {
-			fprintf(stderr, "Error: expected \"type\" key on line %d\n", line);
-			exit(1);
+			free(key);
+			scene_error("Error: expected \"type\" key on line %d\n", line);
 		}
 		free(key);
 		
@@ -146,17 +277,18 @@ Scene read_scene(char* json_name)
 		skip_ws(json);
 		
 		char* type_value = parse_string(json);
+		scene->reading_key = type_value;
 
 		int objtype = 0;
 		
 		int set_radius = 0;
 		float radius = 0; // just in case a sphere is read in
 		int set_color = 0;
-		float color[3];
+		float color[3] = { 0, 0, 0 };
 		int set_normal = 0;
-		float normal[3];
+		float normal[3] = { 0, 0, 0 };
 		int set_position = 0;
-		float position[3];
+		float position[3] = { 0, 0, 0 };
 		
 		int set_specular = 0;
 		float specular[3]; // default specular color of white
@@ -173,19 +305,41 @@ Scene read_scene(char* json_name)
 		float shinyness = 20;
 
 		float reflectivity = 0;
+		int set_reflectivity = 0;
 
 		float transparency = 0;
+		int set_transparency = 0;
 		float ior = 1;
+		int set_ior = 0;
+
+		// mesh and texture files are read into new_object->file and textures
+		float texture_scale = 1;
+
+		// for groups and instances
+		char* group = NULL;
+		float rotation[3];
+		rotation[0] = 0;
+		rotation[1] = 0;
+		rotation[2] = 0;
+		float instance_scale = 1;
+
+		// for generators
+		Generator generator;
+		memset(&generator, 0, sizeof(Generator));
+		generator.counts[0] = 1;
+		generator.counts[1] = 1;
+		generator.counts[2] = 1;
 
 		// for cylinders
 		int set_height = 0;
 		float height = 0;
 		int set_basis1 = 0;
 		int set_basis2 = 0;
-		float basis1[3];
-		float basis2[3];
+		float basis1[3] = { 0, 0, 0 };
+		float basis2[3] = { 0, 0, 0 };
 
-		Object new_object = scene.objects[scene.num_objects];
+		// read into the free slot after the objects so it is found if reading fails
+		Object* new_object = &scene->objects[scene->num_objects];
 		
 		if(strcmp(type_value, "camera") == 0) {
 			objtype = T_CAMERA;
@@ -197,16 +351,26 @@ Scene read_scene(char* json_name)
 			objtype = T_LIGHT;
 		} else if(strcmp(type_value, "cylinder") == 0) {
 			objtype = T_CYLINDER;
+		} else if(strcmp(type_value, "instance") == 0) {
+			objtype = T_INSTANCE;
+		} else if(strcmp(type_value, "mesh") == 0) {
+			objtype = T_MESH;
+		} else if(strcmp(type_value, "grid") == 0) {
+			objtype = T_GRID;
+		} else if(strcmp(type_value, "scatter") == 0) {
+			objtype = T_SCATTER;
+		} else if(strcmp(type_value, "path") == 0) {
+			objtype = T_PATH;
 		} else {
 			
-			fprintf(stderr, "Unknown type \"%s\" on line %d\n", type_value, line);
-			exit(1);
+			scene_error("Unknown type \"%s\" on line %d\n", type_value, line);
 		}
 		
 		free(type_value);
+		scene->reading_key = NULL;
 		
 		// copy the information into the new object
-		new_object.kind = objtype;
+		new_object->kind = objtype;
 
 		int finish = 0;
 
@@ -224,13 +388,13 @@ Scene read_scene(char* json_name)
 			{
 				if(finish)
 				{
-					fprintf(stderr, "Expected , and got end of object on line %d\n", line);
-					exit(1);
+					scene_error("Expected , and got end of object on line %d\n", line);
 				}
 
 				// read another field
 				skip_ws(json);
 				char* key = parse_string(json);
+				scene->reading_key = key;
 				skip_ws(json);
 				expect_c(json, ':');
 				skip_ws(json);
@@ -264,6 +428,7 @@ Scene read_scene(char* json_name)
 				{
 					float value = next_number(json);
 					reflectivity = value;
+					set_reflectivity = 1;
 				}
 				else if(strcmp(key, "angular-a0") == 0)
 				{
@@ -294,15 +459,99 @@ Scene read_scene(char* json_name)
 				{
 					float value = next_number(json);
 					transparency = value;
+					set_transparency = 1;
 				}
 				else if(strcmp(key, "ior") == 0)
 				{
 					float value = next_number(json);
 					ior = value;
+					set_ior = 1;
+				}
+				else if(strcmp(key, "group") == 0)
+				{
+					free(group);
+					group = parse_string(json);
+					scene->reading_group = group;
+				}
+				else if(strcmp(key, "file") == 0)
+				{
+					free(new_object->file);
+					new_object->file = parse_string(json);
+				}
+				else if(strcmp(key, "texture") == 0 || strcmp(key, "diffuse_texture") == 0)
+				{
+					free(new_object->textures[0]);
+					new_object->textures[0] = parse_string(json);
+				}
+				else if(strcmp(key, "specular_texture") == 0)
+				{
+					free(new_object->textures[1]);
+					new_object->textures[1] = parse_string(json);
+				}
+				else if(strcmp(key, "texture_scale") == 0)
+				{
+					texture_scale = next_number(json);
+				}
+				else if(strcmp(key, "rotation") == 0)
+				{
+					float v3[3];
+					next_vector(json, v3);
+					rotation[0] = v3[0];
+					rotation[1] = v3[1];
+					rotation[2] = v3[2];
+				}
+				else if(strcmp(key, "scale") == 0)
+				{
+					instance_scale = next_number(json);
+				}
+				else if(strcmp(key, "count") == 0)
+				{
+					generator.count = (int) min(next_number(json), MAX_GENERATED + 1);
+				}
+				else if(strcmp(key, "counts") == 0)
+				{
+					float v3[3];
+					next_vector(json, v3);
+					generator.counts[0] = (int) min(v3[0], MAX_GENERATED + 1);
+					generator.counts[1] = (int) min(v3[1], MAX_GENERATED + 1);
+					generator.counts[2] = (int) min(v3[2], MAX_GENERATED + 1);
+				}
+				else if(strcmp(key, "spacing") == 0)
+				{
+					float v3[3];
+					next_vector(json, v3);
+					vector_copy(v3, generator.spacing);
+				}
+				else if(strcmp(key, "size") == 0)
+				{
+					float v3[3];
+					next_vector(json, v3);
+					vector_copy(v3, generator.size);
+				}
+				else if(strcmp(key, "seed") == 0)
+				{
+					generator.seed = (uint64_t) next_number(json);
+				}
+				else if(strcmp(key, "scale-jitter") == 0)
+				{
+					generator.scale_jitter = next_number(json);
+				}
+				else if(strcmp(key, "rotation-jitter") == 0)
+				{
+					float v3[3];
+					next_vector(json, v3);
+					vector_copy(v3, generator.rotation_jitter);
+				}
+				else if(strcmp(key, "points") == 0)
+				{
+					free(scene->reading_points);
+					generator.num_points = next_vector_list(json, &scene->reading_points);
+					generator.points = scene->reading_points;
 				}
 				else if(strcmp(key, "specular_color") == 0)
 				{
-					float* value = next_vector(json);
+					float value[3];
+					next_vector(json, value);
 					specular[0] = value[0];
 					specular[1] = value[1];
 					specular[2] = value[2];
@@ -317,56 +566,56 @@ Scene read_scene(char* json_name)
 				}
 				else if(strcmp(key, "color") == 0 || strcmp(key, "diffuse_color") == 0)
 				{
-					float* v3 = next_vector(json);
+					float v3[3];
+					next_vector(json, v3);
 					color[0] = v3[0];
 					color[1] = v3[1];
 					color[2] = v3[2];
 					set_color = 1;
-					free(v3);
 				}
 				else if(strcmp(key, "position") == 0)
 				{
-					float* v3 = next_vector(json);
+					float v3[3];
+					next_vector(json, v3);
 					position[0] = v3[0];
 					position[1] = v3[1];
 					position[2] = v3[2];
 					set_position = 1;
-					free(v3);
 				}
 				else if(strcmp(key, "basis1") == 0)
 				{
-					float* v3 = next_vector(json);
+					float v3[3];
+					next_vector(json, v3);
 					basis1[0] = v3[0];
 					basis1[1] = v3[1];
 					basis1[2] = v3[2];
 					set_basis1 = 1;
-					free(v3);
 				}
 				else if(strcmp(key, "basis2") == 0)
 				{
-					float* v3 = next_vector(json);
+					float v3[3];
+					next_vector(json, v3);
 					basis2[0] = v3[0];
 					basis2[1] = v3[1];
 					basis2[2] = v3[2];
 					set_basis2 = 1;
-					free(v3);
 				}
 				else if(strcmp(key, "normal") == 0 || strcmp(key, "direction") == 0)
 				{
-					float* v3 = next_vector(json);
+					float v3[3];
+					next_vector(json, v3);
 					normal[0] = v3[0] + 0;
 					normal[1] = v3[1] + 0;
 					normal[2] = v3[2] + 0;
 					set_normal = 1;
-					free(v3);
 				}
 				else
 				{
-					fprintf(stderr, "Error: unknown property: %s on line %d\n", key, line);
-					exit(1);
+					scene_error("Error: unknown property: %s on line %d\n", key, line);
 				}
 				
 				free(key);
+				scene->reading_key = NULL;
 				
 				skip_ws(json);
 				c = next_c(json);
@@ -386,219 +635,314 @@ Scene read_scene(char* json_name)
 		{
 			if(set_camera_height != 1)
 			{
-				fprintf(stderr, "Camera must have a height! Line %d\n", line);
-				exit(1);
+				scene_error("Camera must have a height! Line %d\n", line);
 			}
 			if(set_camera_width != 1)
 			{
-				fprintf(stderr, "Camera must have a width! Line %d\n", line);
-				exit(1);
+				scene_error("Camera must have a width! Line %d\n", line);
 			}
 			if(set_position == 1)
 				fprintf(stderr, "Warning, Camera does not use position at this time.\n");
 			if(set_normal == 1)
 				fprintf(stderr, "Warning, Camera does not use a normal vector at this time.\n");
 			
-			scene.camera_width = camera_width;
-			scene.camera_height = camera_height;
+			scene->camera_width = camera_width;
+			scene->camera_height = camera_height;
 			
 		}
 		if(objtype == T_SPHERE)
 		{
 			if(set_radius != 1)
 			{
-				fprintf(stderr, "Sphere must have a defined radius! Line %d\n", line);
-				exit(1);
+				scene_error("Sphere must have a defined radius! Line %d\n", line);
 			}
 			if(radius < 0)
 			{
-				fprintf(stderr, "Sphere must have a non-negative radius! Line %d\n", line);
-				exit(1);
+				scene_error("Sphere must have a non-negative radius! Line %d\n", line);
 			}
 			if(set_color != 1)
 			{
-				fprintf(stderr, "Object must have a color! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a color! Line %d\n", line);
 			}
 			if(set_position != 1)
 			{
-				fprintf(stderr, "Object must have a position! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a position! Line %d\n", line);
 			}
 			
 			// compute properties of a sphere
 
-			new_object.color[0] = color[0];
-			new_object.color[1] = color[1];
-			new_object.color[2] = color[2];
+			new_object->color[0] = color[0];
+			new_object->color[1] = color[1];
+			new_object->color[2] = color[2];
 
-			new_object.specular[0] = specular[0];
-			new_object.specular[1] = specular[1];
-			new_object.specular[2] = specular[2];
+			new_object->specular[0] = specular[0];
+			new_object->specular[1] = specular[1];
+			new_object->specular[2] = specular[2];
 			
-			new_object.position[0] = position[0];
-			new_object.position[1] = position[1];
-			new_object.position[2] = position[2];
-			new_object.a = shinyness;
-			new_object.b = ior;
-			new_object.c = reflectivity;
-			new_object.d = radius;
-
-			new_object.e = transparency;
+			new_object->position[0] = position[0];
+			new_object->position[1] = position[1];
+			new_object->position[2] = position[2];
+			new_object->d = radius;
 		}
 		if(objtype == T_PLANE)
 		{
 			if(set_color != 1)
 			{
-				fprintf(stderr, "Object must have a color! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a color! Line %d\n", line);
 			}
 			if(set_position != 1)
 			{
-				fprintf(stderr, "Object must have a position! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a position! Line %d\n", line);
 			}
 			if(set_normal != 1)
 			{
-				fprintf(stderr, "Plane must have a normal vector! Line %d\n", line);
-				exit(1);
+				scene_error("Plane must have a normal vector! Line %d\n", line);
 			}
 			
 			// calculate the properties of the plane
 
-			new_object.color[0] = color[0];
-			new_object.color[1] = color[1];
-			new_object.color[2] = color[2];
+			new_object->color[0] = color[0];
+			new_object->color[1] = color[1];
+			new_object->color[2] = color[2];
 
-			new_object.specular[0] = specular[0];
-			new_object.specular[1] = specular[1];
-			new_object.specular[2] = specular[2];
+			new_object->specular[0] = specular[0];
+			new_object->specular[1] = specular[1];
+			new_object->specular[2] = specular[2];
 			
 			normalize(normal);
-			new_object.direction[0] = normal[0];
-			new_object.direction[1] = normal[1];
-			new_object.direction[2] = normal[2];
-
-			new_object.a = shinyness;
-			new_object.b = ior;
-			new_object.c = reflectivity;
-			new_object.d = normal[0] * position[0] + normal[1] * position[1] + normal[2] * position[2];
-			
-			new_object.e = transparency;
+			new_object->direction[0] = normal[0];
+			new_object->direction[1] = normal[1];
+			new_object->direction[2] = normal[2];
+
+			new_object->d = normal[0] * position[0] + normal[1] * position[1] + normal[2] * position[2];
 		}
 		if(objtype == T_CYLINDER)
 		{
 			if(set_color != 1)
 			{
-				fprintf(stderr, "Object must have a color! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a color! Line %d\n", line);
 			}
 			if(set_position != 1)
 			{
-				fprintf(stderr, "Object must have a position! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a position! Line %d\n", line);
 			}
 			if(set_basis1 != 1)
 			{
-				fprintf(stderr, "Object must have a basis vector 1! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a basis vector 1! Line %d\n", line);
 			}
 			if(set_basis2 != 1)
 			{
-				fprintf(stderr, "Object must have a basis vector 2! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a basis vector 2! Line %d\n", line);
 			}
 			if(set_height != 1)
 			{
-				fprintf(stderr, "Object must have a height! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a height! Line %d\n", line);
 			}
 			if(set_radius != 1)
 			{
-				fprintf(stderr, "Object must have a radius! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a radius! Line %d\n", line);
 			}
 
 
-			new_object.color[0] = color[0];
-			new_object.color[1] = color[1];
-			new_object.color[2] = color[2];
+			new_object->color[0] = color[0];
+			new_object->color[1] = color[1];
+			new_object->color[2] = color[2];
 
-			new_object.specular[0] = specular[0];
-			new_object.specular[1] = specular[1];
-			new_object.specular[2] = specular[2];
+			new_object->specular[0] = specular[0];
+			new_object->specular[1] = specular[1];
+			new_object->specular[2] = specular[2];
 			
-			new_object.position[0] = position[0];
-			new_object.position[1] = position[1];
-			new_object.position[2] = position[2];
+			new_object->position[0] = position[0];
+			new_object->position[1] = position[1];
+			new_object->position[2] = position[2];
 
 			normalize(basis1);
 			normalize(basis2);
 
-			new_object.direction[0] = basis1[0];
-			new_object.direction[1] = basis1[1];
-			new_object.direction[2] = basis1[2];
+			new_object->direction[0] = basis1[0];
+			new_object->direction[1] = basis1[1];
+			new_object->direction[2] = basis1[2];
 
-			new_object.a = basis2[0];
-			new_object.b = basis2[1];
-			new_object.c = basis2[2];
-			new_object.d = height / 2.0;
-			new_object.e = radius;
+			new_object->a = basis2[0];
+			new_object->b = basis2[1];
+			new_object->c = basis2[2];
+			new_object->d = height / 2.0;
+			new_object->e = radius;
 
 		}
 		if(objtype == T_LIGHT)
 		{
 			if(set_color != 1)
 			{
-				fprintf(stderr, "Object must have a color! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a color! Line %d\n", line);
 			}
 			if(set_position != 1)
 			{
-				fprintf(stderr, "Object must have a position! Line %d\n", line);
-				exit(1);
+				scene_error("Object must have a position! Line %d\n", line);
 			}
 			
-			new_object.color[0] = color[0];
-			new_object.color[1] = color[1];
-			new_object.color[2] = color[2];
+			new_object->color[0] = color[0];
+			new_object->color[1] = color[1];
+			new_object->color[2] = color[2];
 			
-			new_object.position[0] = position[0];
-			new_object.position[1] = position[1];
-			new_object.position[2] = position[2];
+			new_object->position[0] = position[0];
+			new_object->position[1] = position[1];
+			new_object->position[2] = position[2];
 			
 			normalize(normal);
-			new_object.direction[0] = normal[0];
-			new_object.direction[1] = normal[1];
-			new_object.direction[2] = normal[2];
+			new_object->direction[0] = normal[0];
+			new_object->direction[1] = normal[1];
+			new_object->direction[2] = normal[2];
 			//normalize(normal);
-			new_object.a = radial_a2;
-			new_object.b = radial_a1;
-			new_object.c = radial_a0;
-			new_object.d = angular_a0;
-			new_object.e = theta == 0 ? 0 : cos(deg2rad(theta));
+			new_object->a = radial_a2;
+			new_object->b = radial_a1;
+			new_object->c = radial_a0;
+			new_object->d = angular_a0;
+			new_object->e = theta == 0 ? 0 : cos(deg2rad(theta));
 		}
 		
+		if(objtype == T_MESH)
+		{
+			if(new_object->file == NULL)
+			{
+				scene_error("Mesh must have a file! Line %d\n", line);
+			}
+			if(set_color != 1)
+			{
+				scene_error("Object must have a color! Line %d\n", line);
+			}
+
+			new_object->color[0] = color[0];
+			new_object->color[1] = color[1];
+			new_object->color[2] = color[2];
+
+			new_object->specular[0] = specular[0];
+			new_object->specular[1] = specular[1];
+			new_object->specular[2] = specular[2];
+
+			char* file = new_object->file;
+			new_object->file = relative_path(json_name, file);
+			free(file);
+		}
+		else
+		{
+			free(new_object->file);
+			new_object->file = NULL;
+		}
+
+		if(new_object->textures[0] != NULL || new_object->textures[1] != NULL)
+		{
+			if(objtype != T_SPHERE && objtype != T_PLANE && objtype != T_CYLINDER && objtype != T_MESH)
+			{
+				scene_error("Only spheres, planes, cylinders and meshes can have a texture! Line %d\n", line);
+			}
+			if(texture_scale <= 0)
+			{
+				scene_error("Texture scale must be positive! Line %d\n", line);
+			}
+			int k;
+			for(k = 0; k < 2; k ++)
+			{
+				char* texture = new_object->textures[k];
+				if(texture != NULL)
+					new_object->textures[k] = relative_path(json_name, texture);
+				free(texture);
+			}
+		}
+
+		int generates = objtype == T_GRID || objtype == T_SCATTER || objtype == T_PATH;
+		if(objtype == T_INSTANCE || generates)
+		{
+			if(group == NULL)
+			{
+				scene_error("Instance must name a group! Line %d\n", line);
+			}
+			if(instance_scale <= 0)
+			{
+				scene_error("Instance must have a positive scale! Line %d\n", line);
+			}
+
+			Instance instance;
+			memset(&instance, 0, sizeof(Instance));
+			instance.group = find_group(scene, group);
+			if(set_position == 1)
+				vector_copy(position, instance.position);
+			vector_copy(rotation, instance.rotation);
+			instance.scale = instance_scale;
+
+			// anything given here replaces what the objects in the group have
+			if(set_color == 1)
+			{
+				vector_copy(color, instance.material.diffuse);
+				instance.overrides |= OVERRIDE_DIFFUSE;
+			}
+			if(set_specular == 1)
+			{
+				vector_copy(specular, instance.material.specular);
+				instance.overrides |= OVERRIDE_SPECULAR;
+			}
+			if(set_reflectivity == 1)
+			{
+				instance.material.reflectivity = reflectivity;
+				instance.overrides |= OVERRIDE_REFLECTIVITY;
+			}
+			if(set_transparency == 1)
+			{
+				instance.material.refractivity = transparency;
+				instance.overrides |= OVERRIDE_REFRACTIVITY;
+			}
+			if(set_ior == 1)
+			{
+				instance.material.ior = ior;
+				instance.overrides |= OVERRIDE_IOR;
+			}
+
+			if(generates)
+			{
+				generator.kind = objtype;
+				generator.base = instance;
+				expand_generator(scene, &generator);
+			}
+			else
+				add_instance(scene, &instance);
+		}
+		else if(group != NULL)
+		{
+			if(objtype != T_SPHERE && objtype != T_PLANE && objtype != T_CYLINDER && objtype != T_MESH)
+			{
+				scene_error("Only spheres, planes, cylinders and meshes can be in a group! Line %d\n", line);
+			}
+			new_object->group = find_group(scene, group);
+		}
+		free(group);
+		scene->reading_group = NULL;
+		free_generator(&generator);
+		scene->reading_points = NULL;
+
+		// surface properties are kept apart from the kind specific fields
+		new_object->material.shininess = shinyness;
+		new_object->material.ior = ior;
+		new_object->material.reflectivity = reflectivity;
+		new_object->material.refractivity = transparency;
+		new_object->material.texture_scale = texture_scale;
+
 		// increment number to move to the next object
 
-		if(objtype == T_SPHERE || objtype == T_PLANE || objtype == T_CYLINDER)
+		if(objtype == T_SPHERE || objtype == T_PLANE || objtype == T_CYLINDER || objtype == T_MESH)
 		{
-			if(scene.num_objects == MAX_OBJECTS){
-				fprintf(stderr, "Error: Too many objects!\n");
-				exit(1);
+			if(scene->num_objects == MAX_OBJECTS){
+				scene_error("Error: Too many objects!\n");
 			}
-			scene.objects[scene.num_objects] = new_object;
-			scene.num_objects ++;
+			scene->num_objects ++;
 		}
-		
-		if(objtype == T_LIGHT)
+		else
 		{
-			if(scene.num_objects == MAX_LIGHTS){
-				fprintf(stderr, "Error: Too many lights!\n");
-				exit(1);
+			if(objtype == T_LIGHT)
+			{
+				push_light(scene, new_object);
 			}
-			scene.lights[scene.num_lights] = new_object;
-			scene.num_lights ++;
+			// the slot is reused by the next object
+			memset(new_object, 0, sizeof(Object));
 		}
 		
 		// continue with reading
@@ -613,20 +957,47 @@ Scene read_scene(char* json_name)
 		}
 		else if (c == ']') 
 		{
-			fclose(json);
-			return scene;
+			return;
 		}
 		else 
 		{
-			fprintf(stderr, "Error: Expected ] or , on line %d\n", line);
-			exit(1);
+			scene_error("Error: Expected ] or , on line %d\n", line);
 		}
 		
 		// end parsing object
 		skip_ws(json);
 	}
-	
+}
+
+void read_scene(char* json_name, Scene* scene)
+{
+	memset(scene, 0, sizeof(Scene));
+	FILE * json = fopen(json_name, "r");
+	if(json == NULL)
+	{
+		scene_error("Error: could not open %s\n", json_name);
+	}
+
+	read_scene_stream(json, json_name, scene);
 	fclose(json);
+}
 
-	return scene;
-}
\ No newline at end of file
+// frees what read_scene allocated, the scene itself is usually on the stack
+void free_scene(Scene* scene)
+{
+	int k;
+	// and the object after them, which was being read if reading failed
+	for(k = 0; k <= scene->num_objects; k ++)
+	{
+		free(scene->objects[k].file);
+		free(scene->objects[k].textures[0]);
+		free(scene->objects[k].textures[1]);
+	}
+	for(k = 0; k < scene->num_groups; k ++)
+		free(scene->group_names[k]);
+	free(scene->instances);
+	free(scene->lights);
+	free(scene->reading_key);
+	free(scene->reading_group);
+	free(scene->reading_points);
+}
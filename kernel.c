@@ -0,0 +1,348 @@
+
+// one variant of the ray loop, compiled once for every combination of scene features
+// by kernels.c. KERNEL_FEATURES says what this variant handles, code for anything else
+// is left out rather than tested for on every ray.
+
+// returns the scene's object id that intersects the ray
+// the basic object finding loop now lives here
+// avoid is the hit the ray starts from, or NULL
+void KERNEL(send_ray)(Intersection* i, const CompiledScene* scene, float* r0, float* rd, const Intersection* avoid)
+{
+	float best_t = INFINITY;
+	int k;
+	i->object_id = -1;
+	i->instance = -1;
+	i->primitive = -1;
+	render_stats.rays ++;
+	
+	for(k = 0; k < scene->num_objects; k ++)
+	{
+		int skip_triangle;
+		if(avoid_object(avoid, -1, k, &skip_triangle)) {
+			continue;
+		}
+
+		int triangle = -1;
+		float t = intersect_geometry(scene, &scene->geometry[k], r0, rd, best_t, skip_triangle, &triangle);
+		
+		if(t > 0 && t < best_t)
+		{
+			best_t = t;
+			i->object_id = k;
+			i->primitive = triangle;
+		}
+	}
+
+#if KERNEL_FEATURES & KERNEL_INSTANCES
+	int p;
+	for(p = 0; p < scene->num_placements; p ++)
+	{
+		const Placement* placement = &scene->placements[p];
+		if(!ray_hits_bound(placement->bound_center, placement->bound_radius, r0, rd, best_t))
+			continue;
+
+		float local_r0[3];
+		float local_rd[3];
+		ray_to_group(placement, r0, rd, local_r0, local_rd);
+
+		const GeometryGroup* group = &scene->groups[placement->group];
+		for(k = group->first; k < group->first + group->count; k ++)
+		{
+			int skip_triangle;
+			if(avoid_object(avoid, p, k, &skip_triangle)) {
+				continue;
+			}
+
+			int triangle = -1;
+			float t = intersect_geometry(scene, &scene->geometry[k], local_r0, local_rd, best_t, skip_triangle, &triangle);
+
+			if(t > 0 && t < best_t)
+			{
+				best_t = t;
+				i->object_id = k;
+				i->instance = p;
+				i->primitive = triangle;
+			}
+		}
+	}
+#endif
+
+	scale(rd, best_t, i->point); // scale rd by best_t
+	add(i->point, r0, i->point); // then add that to r0
+}
+
+// adds what one light gives a hit to lighting, nothing if the hit is in its shadow.
+// shadow, if not NULL, remembers the result of the shadow ray between calls
+void KERNEL(add_light)(float* lighting, const CompiledScene* scene, int index, Intersection* hit, float* normal, float* rd,
+	const Material* material, unsigned char* shadow)
+{
+	const Light* light = &scene->lights[index];
+
+	float light_dir[3];
+	float dir_to_light[3];
+
+	// distance to light
+	float dist[3];
+	subtract(light->position, hit->point, dist);
+	float distance_to_light = length(dist);
+	
+	subtract(hit->point, light->position, light_dir);
+	normalize(light_dir);
+	scale(light_dir, -1, dir_to_light);
+
+	// (Xs - Xl) / ||Xs-Xl||
+	
+	float incident_light_level = dot(normal, dir_to_light);
+	float visibility = 1;
+
+#if KERNEL_FEATURES & KERNEL_SHADOW_MAPS
+	{
+		// a map lookup is cheap enough that there is nothing to remember in shadow
+		(void) shadow;
+
+		// surfaces facing away from the light get nothing from it either way
+		if(incident_light_level <= 0)
+			return;
+
+		float slope = sqrt(max(1 - sqr(incident_light_level), 0)) / incident_light_level;
+		visibility = shadow_map_visibility(&scene->shadow_maps[index], light, hit->point, slope, scene->shadow_bias);
+		if(visibility <= 0)
+			return;
+	}
+#else
+	if(shadow == NULL || *shadow == SHADOW_UNKNOWN)
+	{
+		int lit = SHADOW_LIT;
+
+		// test for a shadow intersection
+		Intersection blocker;
+		render_stats.shadow_rays ++;
+		KERNEL(send_ray)(&blocker, scene, hit->point, dir_to_light, hit);
+
+		// if there is an object between this object and the light, don't light it
+		if(blocker.object_id != -1) {
+			// make sure that this object isn't actually behind the light
+
+			subtract(blocker.point, hit->point, dist);
+			float distance_to_object = length(dist);
+
+			if(distance_to_light > distance_to_object)
+				lit = SHADOW_DARK;
+		}
+
+		if(shadow != NULL)
+			*shadow = lit;
+		if(lit == SHADOW_DARK)
+			return;
+	}
+	else if(*shadow == SHADOW_DARK)
+		return;
+#endif
+
+	if(incident_light_level > 0)
+	{
+		float Ic[3];
+		Ic[0] = 0;
+		Ic[1] = 0;
+		Ic[2] = 0;
+
+		// calculate attenuation
+			float ang_att = 1;
+#if KERNEL_FEATURES & KERNEL_SPOTLIGHTS
+			if(light->cos_theta != 0) // is spotlight
+			{
+				float att_dot = dot(light_dir, light->direction);
+				if(att_dot < light->cos_theta)
+					ang_att = 0;
+				else
+					ang_att = powf(att_dot, light->angular_a0);
+			}
+#endif
+
+			float rad_att = 1 / 
+						(light->radial_a2 * sqr(distance_to_light) + 
+							light->radial_a1 * distance_to_light + light->radial_a0);
+
+			float attenuation = clamp(ang_att * rad_att, 0.0, 1.0) * visibility;
+
+			float spec[3];
+			
+			// reflect the light normal across the surface normal
+			// r = d - 2(d*n)n
+			float r[3];
+			scale(normal, dot(light_dir, normal) * 2, r);
+			subtract(light_dir, r, r);
+
+			float v[3];
+			scale(rd, -1, v);
+
+			float speck = powf(dot(r, v), material->shininess) * SPEC_K;
+			scale(light->color, speck, spec);
+			multiply(material->specular, spec, spec);
+			
+		// do diffuse lighting
+			float diffuse[3];
+			scale(material->diffuse, incident_light_level * DIFFUSE_K, diffuse);
+			
+		if(speck > 0)
+		{
+			add(spec, diffuse, Ic);
+			scale(Ic, attenuation, Ic);
+		}
+		else
+			scale(diffuse, attenuation, Ic);
+
+		add(Ic, lighting, lighting);
+	}
+}
+
+// adds scene->light_samples lights picked by sample_light, each weighted so that
+// they stand in for all the lights
+void KERNEL(sample_lights)(float* lighting, const CompiledScene* scene, Intersection* hit, float* normal, float* rd,
+	const Material* material)
+{
+	int s;
+	for(s = 0; s < scene->light_samples; s ++)
+	{
+		float weight;
+		int light = sample_light(scene, hit->point, &weight);
+		if(light < 0)
+			continue;
+
+		float sampled[3] = { 0, 0, 0 };
+		KERNEL(add_light)(sampled, scene, light, hit, normal, rd, material, NULL);
+		scale(sampled, weight / scene->light_samples, sampled);
+		add(sampled, lighting, lighting);
+	}
+}
+
+void KERNEL(get_color_hit)(float* color, const CompiledScene* scene, Intersection* hit, float* rd, int recursion);
+
+void KERNEL(get_color_ray)(float* color, const CompiledScene* scene, float* r0, float* rd, int recursion)
+{
+	if(recursion <= 0){
+		vector_copy(scene->ambient_color, color);
+		return;
+	} 
+
+	Intersection intersection;
+	KERNEL(send_ray)(&intersection, scene, r0, rd, NULL);
+
+	if(intersection.object_id == -1)
+	{
+		vector_copy(scene->ambient_color, color);
+		return;
+	}
+
+	KERNEL(get_color_hit)(color, scene, &intersection, rd, recursion);
+}
+
+// the color seen along rd, once the ray has been found to hit something
+void KERNEL(get_color_hit)(float* color, const CompiledScene* scene, Intersection* hit, float* rd, int recursion)
+{
+	if(recursion < render_stats.min_recursion)
+		render_stats.min_recursion = recursion;
+
+	Intersection intersection = *hit;
+
+	// do reflections here
+
+	// keep a reference to the intersected object
+	Material hit_scratch;
+#if KERNEL_FEATURES & KERNEL_INSTANCES
+	const Material* closest = hit_material(scene, &intersection, &hit_scratch);
+#else
+	// few scenes have textures, a test per hit is cheaper than twice the variants
+	const Material* closest = &scene->materials[intersection.object_id];
+	if(scene->num_textures > 0)
+		closest = hit_material(scene, &intersection, &hit_scratch);
+#endif
+
+	// do lighting on the object
+	float lighting[3];
+	vector_copy(scene->ambient_color, lighting);
+	int number_contributors = 1;
+
+	float normal[3];
+	surface_normal(scene, &intersection, normal);
+
+	float added_color[3]; // from any transparency that might happen
+	added_color[0] = 0;
+	added_color[1] = 0;
+	added_color[2] = 0;
+	// transparency stuff goes here
+#if KERNEL_FEATURES & KERNEL_REFRACTION
+	if(closest->refractivity > 0 && !scene->skip_refraction)
+	{
+		// do some refraction
+		
+		float refracted_ray[3];
+		float new_point[3];
+		float n1 = 1;
+		float n2 = 1;
+		
+		if(dot(normal, rd) < 0) n2 = closest->ior; else n1 = closest->ior;
+		smellit(rd, normal, n1, n2, refracted_ray);
+		
+		// continue on through the object
+		add(intersection.point, refracted_ray, new_point);
+		KERNEL(get_color_ray)(added_color, scene, new_point, refracted_ray, recursion - 1);
+		scale(added_color, closest->refractivity, added_color);
+		added_color[0] = clamp(added_color[0], 0.0, 1.0);
+		added_color[1] = clamp(added_color[1], 0.0, 1.0);
+		added_color[2] = clamp(added_color[2], 0.0, 1.0);
+		number_contributors ++;
+	}
+#endif
+
+	// loop through the lights
+	if(scene->light_samples > 0 && scene->light_samples < scene->num_lights)
+	{
+		KERNEL(sample_lights)(lighting, scene, &intersection, normal, rd, closest);
+	}
+	else
+	{
+		int shaded[scene->num_lights + 1];
+		int num_shaded = pick_lights(scene, intersection.point, shaded);
+
+		int s;
+		for(s = 0; s < num_shaded; s ++)
+		{
+			KERNEL(add_light)(lighting, scene, shaded[s], &intersection, normal, rd, closest, NULL);
+		}
+	}
+
+	float reflect_color[3];
+	reflect_color[0] = 0;
+	reflect_color[1] = 0;
+	reflect_color[2] = 0;
+	// do reflection here
+#if KERNEL_FEATURES & KERNEL_REFLECTION
+	if(closest->reflectivity > 0)
+	{
+		float reflect_r[3];
+		//scale(rd, -1, reflect_r);
+		vector_copy(rd, reflect_r);
+		scale(normal, dot(reflect_r, normal) * 2, reflect_r);
+		subtract(rd, reflect_r, reflect_r);
+		
+		float reflect_new_point[3];
+		add(intersection.point, reflect_r, reflect_new_point);
+		KERNEL(get_color_ray)(reflect_color, scene, reflect_new_point, reflect_r, recursion - 1);
+		
+		scale(reflect_color, closest->reflectivity, reflect_color);
+		reflect_color[0] = clamp(reflect_color[0], 0.0, 1.0);
+		reflect_color[1] = clamp(reflect_color[1], 0.0, 1.0);
+		reflect_color[2] = clamp(reflect_color[2], 0.0, 1.0);
+		//number_contributors ++;
+	}
+#endif
+
+	//scale(lighting, 1 - (closest->e), lighting);
+
+	vector_copy(lighting, color);
+	add(added_color, color, color);
+	add(reflect_color, color, color);
+
+	scale(color, 1/number_contributors, color);
+}
@@ -0,0 +1,212 @@
+
+// specialized ray loops
+// most scenes only use a few of the shading features, so kernel.c is compiled once for
+// every combination of them and raycast picks the variant that matches the scene. a
+// variant without a feature has no code for it at all instead of testing for it per ray.
+
+#define KERNEL_REFRACTION 1 // some material refracts and refraction isn't skipped
+#define KERNEL_REFLECTION 2 // some material reflects
+#define KERNEL_SPOTLIGHTS 4 // some light is a spotlight
+#define KERNEL_INSTANCES 8 // the scene places groups
+#define KERNEL_SHADOW_MAPS 16 // shadows come from shadow maps, not shadow rays
+#define KERNEL_ALL 31
+
+#define KERNEL_PASTE(name, features) name##_##features
+#define KERNEL_NAME(name, features) KERNEL_PASTE(name, features)
+#define KERNEL(name) KERNEL_NAME(name, KERNEL_FEATURES)
+
+typedef void (*SendRayFunction)(Intersection* i, const CompiledScene* scene, float* r0, float* rd, const Intersection* avoid);
+// what a shadow ray found, for callers of add_light that keep it
+#define SHADOW_DARK 0
+#define SHADOW_LIT 1
+#define SHADOW_UNKNOWN 2
+
+typedef void (*LightFunction)(float* lighting, const CompiledScene* scene, int index, Intersection* hit, float* normal, float* rd,
+	const Material* material, unsigned char* shadow);
+typedef void (*ColorRayFunction)(float* color, const CompiledScene* scene, float* r0, float* rd, int recursion);
+typedef void (*ColorHitFunction)(float* color, const CompiledScene* scene, Intersection* hit, float* rd, int recursion);
+
+#define KERNEL_FEATURES 0
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 1
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 2
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 3
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 4
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 5
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 6
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 7
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 8
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 9
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 10
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 11
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 12
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 13
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 14
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 15
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 16
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 17
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 18
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 19
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 20
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 21
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 22
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 23
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 24
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 25
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 26
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 27
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 28
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 29
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 30
+#include "kernel.c"
+#undef KERNEL_FEATURES
+#define KERNEL_FEATURES 31
+#include "kernel.c"
+#undef KERNEL_FEATURES
+
+SendRayFunction send_ray_kernels[] = {
+	send_ray_0, send_ray_1, send_ray_2, send_ray_3,
+	send_ray_4, send_ray_5, send_ray_6, send_ray_7,
+	send_ray_8, send_ray_9, send_ray_10, send_ray_11,
+	send_ray_12, send_ray_13, send_ray_14, send_ray_15,
+	send_ray_16, send_ray_17, send_ray_18, send_ray_19,
+	send_ray_20, send_ray_21, send_ray_22, send_ray_23,
+	send_ray_24, send_ray_25, send_ray_26, send_ray_27,
+	send_ray_28, send_ray_29, send_ray_30, send_ray_31,
+};
+
+LightFunction add_light_kernels[] = {
+	add_light_0, add_light_1, add_light_2, add_light_3,
+	add_light_4, add_light_5, add_light_6, add_light_7,
+	add_light_8, add_light_9, add_light_10, add_light_11,
+	add_light_12, add_light_13, add_light_14, add_light_15,
+	add_light_16, add_light_17, add_light_18, add_light_19,
+	add_light_20, add_light_21, add_light_22, add_light_23,
+	add_light_24, add_light_25, add_light_26, add_light_27,
+	add_light_28, add_light_29, add_light_30, add_light_31,
+};
+
+ColorRayFunction color_ray_kernels[] = {
+	get_color_ray_0, get_color_ray_1, get_color_ray_2, get_color_ray_3,
+	get_color_ray_4, get_color_ray_5, get_color_ray_6, get_color_ray_7,
+	get_color_ray_8, get_color_ray_9, get_color_ray_10, get_color_ray_11,
+	get_color_ray_12, get_color_ray_13, get_color_ray_14, get_color_ray_15,
+	get_color_ray_16, get_color_ray_17, get_color_ray_18, get_color_ray_19,
+	get_color_ray_20, get_color_ray_21, get_color_ray_22, get_color_ray_23,
+	get_color_ray_24, get_color_ray_25, get_color_ray_26, get_color_ray_27,
+	get_color_ray_28, get_color_ray_29, get_color_ray_30, get_color_ray_31,
+};
+
+ColorHitFunction color_hit_kernels[] = {
+	get_color_hit_0, get_color_hit_1, get_color_hit_2, get_color_hit_3,
+	get_color_hit_4, get_color_hit_5, get_color_hit_6, get_color_hit_7,
+	get_color_hit_8, get_color_hit_9, get_color_hit_10, get_color_hit_11,
+	get_color_hit_12, get_color_hit_13, get_color_hit_14, get_color_hit_15,
+	get_color_hit_16, get_color_hit_17, get_color_hit_18, get_color_hit_19,
+	get_color_hit_20, get_color_hit_21, get_color_hit_22, get_color_hit_23,
+	get_color_hit_24, get_color_hit_25, get_color_hit_26, get_color_hit_27,
+	get_color_hit_28, get_color_hit_29, get_color_hit_30, get_color_hit_31,
+};
+
+// the features a frame of the scene needs, with its quality settings applied
+int scene_features(const CompiledScene* scene)
+{
+	int features = 0;
+	int k;
+	// the objects of groups are compiled after the top level ones
+	int num_geometry = scene->num_objects;
+	if(scene->num_groups > 0)
+		num_geometry = scene->groups[scene->num_groups - 1].first + scene->groups[scene->num_groups - 1].count;
+	for(k = 0; k < num_geometry; k ++)
+	{
+		if(scene->materials[k].refractivity > 0) features |= KERNEL_REFRACTION;
+		if(scene->materials[k].reflectivity > 0) features |= KERNEL_REFLECTION;
+	}
+	for(k = 0; k < scene->num_placements; k ++)
+	{
+		const Placement* p = &scene->placements[k];
+		if((p->overrides & OVERRIDE_REFRACTIVITY) && p->material.refractivity > 0) features |= KERNEL_REFRACTION;
+		if((p->overrides & OVERRIDE_REFLECTIVITY) && p->material.reflectivity > 0) features |= KERNEL_REFLECTION;
+	}
+	for(k = 0; k < scene->num_lights; k ++)
+	{
+		if(scene->lights[k].cos_theta != 0) features |= KERNEL_SPOTLIGHTS;
+	}
+
+	if(scene->skip_refraction) features &= ~KERNEL_REFRACTION;
+	if(scene->num_placements > 0) features |= KERNEL_INSTANCES;
+	if(scene->shadow_maps != NULL) features |= KERNEL_SHADOW_MAPS;
+	return features;
+}
+
+// the variants with everything, for callers that don't pick one for the scene
+void send_ray(Intersection* i, const CompiledScene* scene, float* r0, float* rd, const Intersection* avoid)
+{
+	send_ray_kernels[KERNEL_ALL & ~KERNEL_SHADOW_MAPS](i, scene, r0, rd, avoid);
+}
+
+void get_color_ray(float* color, const CompiledScene* scene, float* r0, float* rd, int recursion)
+{
+	int features = KERNEL_ALL;
+	if(scene->shadow_maps == NULL) features &= ~KERNEL_SHADOW_MAPS;
+	color_ray_kernels[features](color, scene, r0, rd, recursion);
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "render.h"
+
+// checks of the library api, linked against librender.a like an embedding program would be.
+// full renders have to match the golden reference images exactly.
+
+#define SIZE 96
+
+int failures = 0;
+
+void check(int ok, char* what)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAIL");
+	if(!ok) failures ++;
+}
+
+unsigned char* read_reference(char* name)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "tests/reference/%s.ppm", name);
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+
+	int width;
+	int height;
+	int max;
+	unsigned char* rgb = malloc(SIZE * SIZE * 3);
+	if(fscanf(file, "P6 %d %d %d", &width, &height, &max) != 3 || width != SIZE || height != SIZE
+		|| fgetc(file) == EOF || fread(rgb, 3, SIZE * SIZE, file) != SIZE * SIZE)
+	{
+		free(rgb);
+		rgb = NULL;
+	}
+	fclose(file);
+	return rgb;
+}
+
+char* read_text(char* path, size_t* length)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	*length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* text = malloc(*length);
+	if(fread(text, 1, *length, file) != *length)
+	{
+		free(text);
+		text = NULL;
+	}
+	fclose(file);
+	return text;
+}
+
+// renders a scene file and compares it against its reference image
+int matches_reference(char* name, char* path, int threads)
+{
+	unsigned char* reference = read_reference(name);
+	RTScene* scene = rt_load_scene_file(path, NULL, 0);
+	if(reference == NULL || scene == NULL)
+		return 0;
+
+	RTOptions options;
+	rt_default_options(&options);
+	options.threads = threads;
+
+	unsigned char* rgb = malloc(SIZE * SIZE * 3);
+	int same = rt_render(scene, SIZE, SIZE, rgb, &options) == 0 && memcmp(rgb, reference, SIZE * SIZE * 3) == 0;
+
+	rt_free_scene(scene);
+	free(rgb);
+	free(reference);
+	return same;
+}
+
+// loads scenes that fail part way, after textures, meshes, lights and instances are
+// read, over and over. returns how much more of the heap is in use than after the first round.
+// libc can keep a little for itself along the way, anything leaked per load adds up far beyond that
+long failed_load_growth(int rounds)
+{
+	char* broken[] = {
+		// a group that is used but has nothing in it, found once everything else is loaded
+		"[ { \"type\":\"camera\", \"width\":1, \"height\":1 },"
+		"  { \"type\":\"light\", \"color\":[1,1,1], \"position\":[0,5,0] },"
+		"  { \"type\":\"sphere\", \"radius\":1, \"position\":[0,0,5], \"color\":[1,1,1], \"texture\":\"checker.ppm\" },"
+		"  { \"type\":\"mesh\", \"file\":\"icosphere.obj\", \"color\":[1,1,1], \"group\":\"full\" },"
+		"  { \"type\":\"instance\", \"group\":\"full\", \"position\":[0,0,10] },"
+		"  { \"type\":\"instance\", \"group\":\"empty\", \"position\":[0,0,10] } ]",
+		// an unknown property in the middle of an object that has files
+		"[ { \"type\":\"light\", \"color\":[1,1,1], \"position\":[0,5,0] },"
+		"  { \"type\":\"sphere\", \"radius\":1, \"position\":[0,0,5], \"color\":[1,1,1], \"texture\":\"checker.ppm\" },"
+		"  { \"type\":\"mesh\", \"file\":\"icosphere.obj\", \"texture\":\"checker.ppm\", \"bogus\":1 } ]",
+		// a texture that isn't there, after one that is
+		"[ { \"type\":\"sphere\", \"radius\":1, \"position\":[0,0,5], \"color\":[1,1,1], \"texture\":\"checker.ppm\" },"
+		"  { \"type\":\"mesh\", \"file\":\"icosphere.obj\", \"color\":[1,1,1], \"texture\":\"missing.ppm\" } ]",
+		// a value that isn't a number, while its key is being looked at
+		"[ { \"type\":\"sphere\", \"group\":\"g\", \"radius\":x } ]",
+		// a vector that breaks off part way
+		"[ { \"type\":\"sphere\", \"radius\":1, \"color\":[1,x,1] } ]",
+		// an instance that is rejected once its group is read
+		"[ { \"type\":\"sphere\", \"group\":\"g\", \"radius\":1, \"position\":[0,0,0], \"color\":[1,1,1] },"
+		"  { \"type\":\"instance\", \"group\":\"g\", \"scale\":-1 } ]",
+		// generators that are rejected once their points and group are read
+		"[ { \"type\":\"sphere\", \"group\":\"g\", \"radius\":1, \"position\":[0,0,0], \"color\":[1,1,1] },"
+		"  { \"type\":\"path\", \"group\":\"g\", \"points\":[[0,0,0]], \"count\":4 } ]",
+		"[ { \"type\":\"sphere\", \"group\":\"g\", \"radius\":1, \"position\":[0,0,0], \"color\":[1,1,1] },"
+		"  { \"type\":\"path\", \"group\":\"g\", \"points\":[[0,0,0], [1,0,0], [2,x,0]], \"count\":4 } ]",
+		"[ { \"type\":\"sphere\", \"group\":\"g\", \"radius\":1, \"position\":[0,0,0], \"color\":[1,1,1] },"
+		"  { \"type\":\"scatter\", \"group\":\"g\", \"count\":4, \"scale-jitter\":2 } ]",
+	};
+	int count = sizeof(broken) / sizeof(char*);
+
+	long start = 0;
+	int round;
+	for(round = 0; round <= rounds; round ++)
+	{
+		// the first round sets up what is kept for good, like the texture cache
+		if(round == 1)
+			start = mallinfo2().uordblks;
+		int k;
+		for(k = 0; k < count; k ++)
+		{
+			RTScene* scene = rt_load_scene_memory(broken[k], strlen(broken[k]), "tests/scenes", NULL, 0);
+			if(scene != NULL)
+			{
+				rt_free_scene(scene);
+				return -1;
+			}
+		}
+	}
+	return (long) mallinfo2().uordblks - start;
+}
+
+typedef struct {
+	char* name;
+	char* path;
+	int same;
+} ThreadCase;
+
+typedef struct {
+	RTFramebuffer* framebuffer;
+	unsigned char* reference;
+	int coarse_step;
+	int done;
+	int snapshots;
+	int whole; // every snapshot was one whole pass
+} SnapshotReader;
+
+// the pass with spacing step traces the corner pixel of every step by step block, the
+// same as the full image has there, and fills the rest of the block with it
+int is_whole_pass(unsigned char* rgb, unsigned char* reference, int step)
+{
+	int x;
+	int y;
+	for(y = 0; y < SIZE; y ++)
+	{
+		for(x = 0; x < SIZE; x ++)
+		{
+			unsigned char* corner = reference + ((y - y % step) * SIZE + x - x % step) * 3;
+			if(memcmp(rgb + (y * SIZE + x) * 3, corner, 3) != 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+void* snapshot_thread(void* arg)
+{
+	SnapshotReader* reader = arg;
+	unsigned char* rgb = malloc(SIZE * SIZE * 3);
+	int last = 0;
+	while(!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE))
+	{
+		int generation = rt_framebuffer_snapshot(reader->framebuffer, rgb);
+		int step = generation > 0 ? reader->coarse_step >> (generation - 1) : 1;
+		if(generation < last || (generation > 0 && !is_whole_pass(rgb, reader->reference, step > 1 ? step : 1)))
+			reader->whole = 0;
+		last = generation;
+		reader->snapshots ++;
+	}
+	free(rgb);
+	return NULL;
+}
+
+void* render_thread(void* arg)
+{
+	ThreadCase* test = arg;
+	test->same = matches_reference(test->name, test->path, 1);
+	return NULL;
+}
+
+int main()
+{
+	check(matches_reference("good01", "good01.json", 0), "file scene matches the reference");
+
+	// the same scene from memory, rendered a region at a time into a wider buffer
+	size_t length;
+	char* json = read_text("good01.json", &length);
+	RTScene* scene = rt_load_scene_memory(json, length, NULL, NULL, 0);
+	check(scene != NULL, "scene loads from memory");
+
+	unsigned char* reference = read_reference("good01");
+	int stride = SIZE + 7;
+	unsigned char* rgb = calloc(stride * SIZE, 3);
+	int x0 = 20, y0 = 10, x1 = 70, y1 = 60;
+	int ok = scene != NULL && reference != NULL;
+	ok = ok && rt_render_region(scene, SIZE, SIZE, x0, y0, x1, y1, rgb, stride, NULL) == 0;
+	int y;
+	for(y = y0; ok && y < y1; y ++)
+		ok = memcmp(rgb + (y - y0) * stride * 3, reference + (y * SIZE + x0) * 3, (x1 - x0) * 3) == 0;
+	check(ok, "region matches the same part of the full image");
+	check(rt_render_region(scene, SIZE, SIZE, 0, 0, SIZE + 1, SIZE, rgb, stride, NULL) == -1, "region outside the image is refused");
+	rt_free_scene(scene);
+	free(rgb);
+	free(reference);
+	free(json);
+
+	// meshes in a scene from memory are found in base_dir
+	json = read_text("tests/scenes/meshes.json", &length);
+	scene = rt_load_scene_memory(json, length, "tests/scenes", NULL, 0);
+	check(scene != NULL, "memory scene finds its files in base_dir");
+	rt_free_scene(scene);
+	free(json);
+
+	// errors come back instead of ending the program
+	char error[256] = "";
+	char* broken = "[ { \"type\":\"sphere\", \"position\":[0,0,1] } ]";
+	scene = rt_load_scene_memory(broken, strlen(broken), NULL, error, sizeof(error));
+	check(scene == NULL && strstr(error, "radius") != NULL, "parse error is returned");
+	scene = rt_load_scene_file("tests/scenes/missing.json", error, sizeof(error));
+	check(scene == NULL && strstr(error, "missing.json") != NULL, "missing file is returned");
+	check(failed_load_growth(100) < 1024, "scenes that fail to load leave nothing behind");
+
+	// a progressive render watched from another thread
+	scene = rt_load_scene_file("good01.json", NULL, 0);
+	reference = read_reference("good01");
+	RTOptions options;
+	rt_default_options(&options);
+	options.coarse_step = 8;
+	SnapshotReader reader = { rt_create_framebuffer(SIZE, SIZE), reference, options.coarse_step, 0, 0, 1 };
+	pthread_t reader_thread;
+	pthread_create(&reader_thread, NULL, snapshot_thread, &reader);
+	int passes = rt_render_progressive(scene, reader.framebuffer, &options);
+	__atomic_store_n(&reader.done, 1, __ATOMIC_RELEASE);
+	pthread_join(reader_thread, NULL);
+	rgb = malloc(SIZE * SIZE * 3);
+	check(passes == 4 && rt_framebuffer_snapshot(reader.framebuffer, rgb) == 4 && reference != NULL
+		&& memcmp(rgb, reference, SIZE * SIZE * 3) == 0, "progressive render ends with the full image");
+	check(reader.snapshots > 0 && reader.whole, "snapshots during it are whole passes");
+	rt_free_framebuffer(reader.framebuffer);
+	rt_free_scene(scene);
+	free(rgb);
+	free(reference);
+
+	// independent scenes at the same time
+	ThreadCase cases[] = {
+		{ "good01", "good01.json", 0 },
+		{ "mirrors", "tests/scenes/mirrors.json", 0 },
+		{ "instances", "tests/scenes/instances.json", 0 },
+		{ "meshes", "tests/scenes/meshes.json", 0 },
+	};
+	int count = sizeof(cases) / sizeof(ThreadCase);
+	pthread_t threads[count];
+	int k;
+	for(k = 0; k < count; k ++)
+		pthread_create(&threads[k], NULL, render_thread, &cases[k]);
+	ok = 1;
+	for(k = 0; k < count; k ++)
+	{
+		pthread_join(threads[k], NULL);
+		ok = ok && cases[k].same;
+	}
+	check(ok, "scenes rendered from several threads match");
+
+	if(failures > 0)
+	{
+		printf("%d library checks failed\n", failures);
+		return 1;
+	}
+	printf("all library checks passed\n");
+	return 0;
+}
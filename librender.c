@@ -0,0 +1,190 @@
+#include "render.c"
+#include "render.h"
+
+// the library side of render.h
+// everything from render.c is built in but only the rt_ functions are exported,
+// librender.so through visibility and librender.a by localizing the other symbols
+
+#define RT_EXPORT __attribute__((visibility("default")))
+
+struct RTScene {
+	CompiledScene* compiled;
+};
+
+struct RTFramebuffer {
+	Framebuffer* display;
+};
+
+RT_EXPORT void rt_default_options(RTOptions* options)
+{
+	RenderOptions defaults;
+	default_render_options(&defaults);
+
+	options->threads = 0;
+	options->tile_size = defaults.tile_size;
+	options->preview = 0;
+	options->shadow_map_size = 0;
+	options->shadow_bias = defaults.shadow_bias;
+	options->light_samples = 0;
+	options->spp = defaults.spp;
+	options->coarse_step = defaults.coarse_step;
+	options->time_budget = 0;
+}
+
+void copy_options(const RTOptions* options, RenderOptions* render_options)
+{
+	default_render_options(render_options);
+	if(options->threads > 0)
+		render_options->num_threads = options->threads;
+	if(options->tile_size > 0)
+		render_options->tile_size = options->tile_size;
+	render_options->preview = options->preview;
+	render_options->shadow_map_size = max(options->shadow_map_size, 0);
+	render_options->shadow_bias = options->shadow_bias;
+	render_options->light_samples = max(options->light_samples, 0);
+	render_options->spp = max(options->spp, 1);
+	render_options->coarse_step = max(options->coarse_step, 1);
+	render_options->time_budget = max(options->time_budget, 0);
+}
+
+void copy_error(char* error, int error_size, const char* message)
+{
+	if(error != NULL && error_size > 0)
+		snprintf(error, error_size, "%s", message);
+}
+
+// parse errors come back here through scene_error instead of ending the program
+RTScene* load_scene(FILE* json, char* path, char* error, int error_size)
+{
+	CompiledScene* compiled = load_scene_stream(json, path);
+	if(compiled == NULL)
+	{
+		copy_error(error, error_size, scene_error_message);
+		return NULL;
+	}
+
+	RTScene* loaded = malloc(sizeof(RTScene));
+	loaded->compiled = compiled;
+	return loaded;
+}
+
+RT_EXPORT RTScene* rt_load_scene_file(const char* path, char* error, int error_size)
+{
+	FILE* json = fopen(path, "r");
+	if(json == NULL)
+	{
+		char message[256];
+		snprintf(message, sizeof(message), "Error: could not open %s", path);
+		copy_error(error, error_size, message);
+		return NULL;
+	}
+
+	RTScene* scene = load_scene(json, (char*) path, error, error_size);
+	fclose(json);
+	return scene;
+}
+
+RT_EXPORT RTScene* rt_load_scene_memory(const char* json, size_t length, const char* base_dir, char* error, int error_size)
+{
+	FILE* stream = fmemopen((void*) json, length, "r");
+	if(stream == NULL)
+	{
+		copy_error(error, error_size, "Error: could not read the scene from memory");
+		return NULL;
+	}
+
+	// relative paths are resolved against the directory of the scene's name
+	char path[strlen(base_dir != NULL ? base_dir : ".") + 16];
+	sprintf(path, "%s/scene.json", base_dir != NULL ? base_dir : ".");
+
+	RTScene* scene = load_scene(stream, path, error, error_size);
+	fclose(stream);
+	return scene;
+}
+
+RT_EXPORT int rt_render_region(const RTScene* scene, int width, int height, int x0, int y0, int x1, int y1,
+	unsigned char* rgb, int stride, const RTOptions* options)
+{
+	if(scene == NULL || rgb == NULL || width < 1 || height < 1)
+		return -1;
+	if(x0 < 0 || y0 < 0 || x1 > width || y1 > height || x0 >= x1 || y0 >= y1 || stride < x1 - x0)
+		return -1;
+
+	RTOptions defaults;
+	if(options == NULL)
+	{
+		rt_default_options(&defaults);
+		options = &defaults;
+	}
+
+	RenderOptions render_options;
+	copy_options(options, &render_options);
+
+	render_region(scene->compiled, width, height, x0, y0, x1, y1, (Pixel*) rgb, stride, &render_options);
+	return 0;
+}
+
+RT_EXPORT int rt_render(const RTScene* scene, int width, int height, unsigned char* rgb, const RTOptions* options)
+{
+	return rt_render_region(scene, width, height, 0, 0, width, height, rgb, width, options);
+}
+
+RT_EXPORT void rt_free_scene(RTScene* scene)
+{
+	if(scene == NULL)
+		return;
+	free_compiled_scene(scene->compiled);
+	free(scene);
+}
+
+RT_EXPORT RTFramebuffer* rt_create_framebuffer(int width, int height)
+{
+	if(width < 1 || height < 1)
+		return NULL;
+	RTFramebuffer* framebuffer = malloc(sizeof(RTFramebuffer));
+	framebuffer->display = create_framebuffer(width, height);
+	return framebuffer;
+}
+
+RT_EXPORT int rt_framebuffer_snapshot(RTFramebuffer* framebuffer, unsigned char* rgb)
+{
+	if(framebuffer == NULL || rgb == NULL)
+		return -1;
+	return framebuffer_snapshot(framebuffer->display, (Pixel*) rgb);
+}
+
+RT_EXPORT int rt_render_progressive(const RTScene* scene, RTFramebuffer* framebuffer, const RTOptions* options)
+{
+	if(scene == NULL || framebuffer == NULL)
+		return -1;
+
+	RTOptions defaults;
+	if(options == NULL)
+	{
+		rt_default_options(&defaults);
+		options = &defaults;
+	}
+
+	RenderOptions render_options;
+	copy_options(options, &render_options);
+	render_options.progressive = 1;
+	render_options.display = framebuffer->display;
+
+	PPMmeta fileinfo;
+	fileinfo.width = framebuffer->display->width;
+	fileinfo.height = framebuffer->display->height;
+	fileinfo.max = 255;
+	fileinfo.type = 6;
+
+	int passes = framebuffer_generation(framebuffer->display);
+	raycast(scene->compiled, NULL, fileinfo, &render_options);
+	return framebuffer_generation(framebuffer->display) - passes;
+}
+
+RT_EXPORT void rt_free_framebuffer(RTFramebuffer* framebuffer)
+{
+	if(framebuffer == NULL)
+		return;
+	free_framebuffer(framebuffer->display);
+	free(framebuffer);
+}
@@ -0,0 +1,497 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// triangle meshes
+// a mesh is an indexed vertex buffer and a triangle buffer, read from either a
+// wavefront .obj file or the binary format below, plus a bounding volume
+// hierarchy over its triangles. the binary format is laid out so that it can be
+// used straight out of the memory map, without parsing or copying:
+//
+//   char     magic[8]    "RTMESH1" and a zero byte
+//   uint32   num_vertices
+//   uint32   num_triangles
+//   float    vertices[num_vertices * 3]
+//   uint32   triangles[num_triangles * 3]
+
+#define MESH_MAGIC "RTMESH1"
+#define MESH_HEADER_SIZE 16
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+
+void map_file(char* path, Mesh* mesh)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		scene_error("Error: could not open mesh %s\n", path);
+	}
+
+	struct stat info;
+	fstat(fd, &info);
+	mesh->map_size = info.st_size;
+	mesh->map = mesh->map_size > 0 ? mmap(NULL, mesh->map_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+
+	if(mesh->map == MAP_FAILED || mesh->map == NULL)
+	{
+		mesh->map = NULL;
+		scene_error("Error: could not map mesh %s\n", path);
+	}
+}
+
+int is_binary_mesh(Mesh* mesh)
+{
+	return mesh->map_size >= MESH_HEADER_SIZE && memcmp(mesh->map, MESH_MAGIC, 8) == 0;
+}
+
+void load_binary_mesh(char* path, Mesh* mesh)
+{
+	const uint32_t* header = (const uint32_t*) ((const char*) mesh->map + 8);
+	mesh->num_vertices = header[0];
+	mesh->num_triangles = header[1];
+
+	size_t expected = MESH_HEADER_SIZE + (size_t) mesh->num_vertices * 3 * sizeof(float)
+		+ (size_t) mesh->num_triangles * 3 * sizeof(uint32_t);
+	if(expected != mesh->map_size)
+	{
+		scene_error("Error: mesh %s is %ld bytes, its header says %ld\n", path, (long) mesh->map_size, (long) expected);
+	}
+
+	mesh->vertices = (const float*) ((const char*) mesh->map + MESH_HEADER_SIZE);
+	mesh->triangles = (const unsigned int*) (mesh->vertices + (size_t) mesh->num_vertices * 3);
+
+	long k;
+	for(k = 0; k < (long) mesh->num_triangles * 3; k ++)
+	{
+		if(mesh->triangles[k] >= (unsigned int) mesh->num_vertices)
+		{
+			scene_error("Error: mesh %s has a triangle with a bad vertex index\n", path);
+		}
+	}
+}
+
+// turns an obj index (1 based, negative counts back from the last vertex) into a 0 based one
+int obj_index(char* token, int num_vertices)
+{
+	int index = atoi(token);
+	if(index < 0)
+		return num_vertices + index;
+	return index - 1;
+}
+
+void load_obj_mesh(char* path, Mesh* mesh)
+{
+	int vertex_capacity = 1024;
+	int triangle_capacity = 1024;
+	float* vertices = malloc(sizeof(float) * 3 * vertex_capacity);
+	unsigned int* triangles = malloc(sizeof(unsigned int) * 3 * triangle_capacity);
+	// kept in the mesh as they grow, so free_mesh finds them if a line is bad
+	mesh->owned_vertices = vertices;
+	mesh->owned_triangles = triangles;
+	int num_vertices = 0;
+	int num_triangles = 0;
+
+	const char* data = mesh->map;
+	size_t pos = 0;
+	int line_number = 0;
+	char text[1024];
+
+	while(pos < mesh->map_size)
+	{
+		// copy the line out, the map has no terminating zero
+		size_t len = 0;
+		while(pos < mesh->map_size && data[pos] != '\n')
+		{
+			if(len < sizeof(text) - 1)
+				text[len ++] = data[pos];
+			pos ++;
+		}
+		pos ++;
+		text[len] = 0;
+		line_number ++;
+
+		if(text[0] == 'v' && text[1] == ' ')
+		{
+			if(num_vertices == vertex_capacity)
+			{
+				vertex_capacity *= 2;
+				vertices = realloc(vertices, sizeof(float) * 3 * vertex_capacity);
+				mesh->owned_vertices = vertices;
+			}
+			float* v = &vertices[num_vertices * 3];
+			if(sscanf(text + 2, "%f %f %f", &v[0], &v[1], &v[2]) != 3)
+			{
+				scene_error("Error: bad vertex in %s on line %d\n", path, line_number);
+			}
+			num_vertices ++;
+		}
+		else if(text[0] == 'f' && text[1] == ' ')
+		{
+			// polygons are split into a fan of triangles around the first corner
+			int corners[3];
+			int num_corners = 0;
+			char* token = strtok(text + 2, " \t\r");
+			while(token != NULL)
+			{
+				int index = obj_index(token, num_vertices);
+				if(index < 0 || index >= num_vertices)
+				{
+					scene_error("Error: bad face index in %s on line %d\n", path, line_number);
+				}
+
+				if(num_corners < 3)
+					corners[num_corners ++] = index;
+				else
+				{
+					corners[1] = corners[2];
+					corners[2] = index;
+				}
+
+				if(num_corners == 3)
+				{
+					if(num_triangles == triangle_capacity)
+					{
+						triangle_capacity *= 2;
+						triangles = realloc(triangles, sizeof(unsigned int) * 3 * triangle_capacity);
+						mesh->owned_triangles = triangles;
+					}
+					triangles[num_triangles * 3] = corners[0];
+					triangles[num_triangles * 3 + 1] = corners[1];
+					triangles[num_triangles * 3 + 2] = corners[2];
+					num_triangles ++;
+				}
+				token = strtok(NULL, " \t\r");
+			}
+		}
+	}
+
+	// the text isn't needed anymore, only the buffers built from it
+	munmap(mesh->map, mesh->map_size);
+	mesh->map = NULL;
+	mesh->map_size = 0;
+
+	mesh->num_vertices = num_vertices;
+	mesh->num_triangles = num_triangles;
+	mesh->vertices = mesh->owned_vertices = realloc(vertices, sizeof(float) * 3 * (num_vertices + 1));
+	mesh->triangles = mesh->owned_triangles = realloc(triangles, sizeof(unsigned int) * 3 * (num_triangles + 1));
+}
+
+const float* mesh_vertex(const Mesh* mesh, int triangle, int corner)
+{
+	return &mesh->vertices[mesh->triangles[triangle * 3 + corner] * 3];
+}
+
+// rearranges order[first..first+count-1] so the triangle at first+nth has the median
+// centroid along axis, with smaller ones before it and larger ones after
+void select_median(unsigned int* order, const float* centroids, int axis, int first, int count, int nth)
+{
+	int lo = first;
+	int hi = first + count - 1;
+	int target = first + nth;
+
+	while(lo < hi)
+	{
+		float pivot = centroids[order[(lo + hi) / 2] * 3 + axis];
+		int i = lo;
+		int j = hi;
+		while(i <= j)
+		{
+			while(centroids[order[i] * 3 + axis] < pivot) i ++;
+			while(centroids[order[j] * 3 + axis] > pivot) j --;
+			if(i <= j)
+			{
+				unsigned int t = order[i];
+				order[i] = order[j];
+				order[j] = t;
+				i ++;
+				j --;
+			}
+		}
+		if(target <= j) hi = j;
+		else if(target >= i) lo = i;
+		else return;
+	}
+}
+
+// builds the node at index node for triangles first..first+count-1 of mesh->order
+void build_bvh_node(Mesh* mesh, const float* centroids, int node, int first, int count)
+{
+	BVHNode* n = &mesh->nodes[node];
+	int k;
+	int a;
+	for(a = 0; a < 3; a ++)
+	{
+		n->lo[a] = INFINITY;
+		n->hi[a] = -INFINITY;
+	}
+	for(k = first; k < first + count; k ++)
+	{
+		int c;
+		for(c = 0; c < 3; c ++)
+		{
+			const float* v = mesh_vertex(mesh, mesh->order[k], c);
+			for(a = 0; a < 3; a ++)
+			{
+				n->lo[a] = min(n->lo[a], v[a]);
+				n->hi[a] = max(n->hi[a], v[a]);
+			}
+		}
+	}
+
+	if(count <= BVH_LEAF_SIZE)
+	{
+		n->first = first;
+		n->count = count;
+		return;
+	}
+
+	// split at the median along the longest side
+	int axis = 0;
+	for(a = 1; a < 3; a ++)
+	{
+		if(n->hi[a] - n->lo[a] > n->hi[axis] - n->lo[axis])
+			axis = a;
+	}
+	int half = count / 2;
+	select_median(mesh->order, centroids, axis, first, count, half);
+
+	int left = mesh->num_nodes;
+	mesh->num_nodes += 2;
+	n->first = left;
+	n->count = 0;
+
+	build_bvh_node(mesh, centroids, left, first, half);
+	build_bvh_node(mesh, centroids, left + 1, first + half, count - half);
+}
+
+void build_bvh(Mesh* mesh)
+{
+	int k;
+	mesh->order = malloc(sizeof(unsigned int) * (mesh->num_triangles + 1));
+	for(k = 0; k < mesh->num_triangles; k ++)
+		mesh->order[k] = k;
+
+	float* centroids = malloc(sizeof(float) * 3 * (mesh->num_triangles + 1));
+	for(k = 0; k < mesh->num_triangles; k ++)
+	{
+		float* c = &centroids[k * 3];
+		add(mesh_vertex(mesh, k, 0), mesh_vertex(mesh, k, 1), c);
+		add(c, mesh_vertex(mesh, k, 2), c);
+		scale(c, 1.0 / 3, c);
+	}
+
+	// a binary tree with leaves of at least half BVH_LEAF_SIZE can't need more than this
+	mesh->nodes = malloc(sizeof(BVHNode) * (2 * mesh->num_triangles + 1));
+	mesh->num_nodes = 1;
+	build_bvh_node(mesh, centroids, 0, 0, mesh->num_triangles);
+	free(centroids);
+	mesh->nodes = realloc(mesh->nodes, sizeof(BVHNode) * mesh->num_nodes);
+}
+
+// if loading fails mesh keeps what was loaded so far, which free_mesh frees
+void load_mesh(char* path, Mesh* mesh)
+{
+	memset(mesh, 0, sizeof(Mesh));
+
+	map_file(path, mesh);
+	if(is_binary_mesh(mesh))
+		load_binary_mesh(path, mesh);
+	else
+		load_obj_mesh(path, mesh);
+
+	if(mesh->num_triangles == 0)
+	{
+		scene_error("Error: mesh %s has no triangles\n", path);
+	}
+
+	build_bvh(mesh);
+}
+
+void free_mesh(Mesh* mesh)
+{
+	if(mesh->map != NULL)
+		munmap(mesh->map, mesh->map_size);
+	free(mesh->owned_vertices);
+	free(mesh->owned_triangles);
+	free(mesh->order);
+	free(mesh->nodes);
+}
+
+// writes a mesh in the binary format so later loads can map it directly
+int write_binary_mesh(const Mesh* mesh, char* path)
+{
+	FILE* out = fopen(path, "wb");
+	if(out == NULL)
+		return 1;
+
+	char magic[8] = MESH_MAGIC;
+	uint32_t counts[2];
+	counts[0] = mesh->num_vertices;
+	counts[1] = mesh->num_triangles;
+
+	fwrite(magic, 1, 8, out);
+	fwrite(counts, sizeof(uint32_t), 2, out);
+	fwrite(mesh->vertices, sizeof(float) * 3, mesh->num_vertices, out);
+	fwrite(mesh->triangles, sizeof(uint32_t) * 3, mesh->num_triangles, out);
+	fclose(out);
+	return 0;
+}
+
+// the ray, sheared so it points down +z, for the watertight triangle test
+// (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection", 2013)
+typedef struct {
+	int kx, ky, kz;
+	float sx, sy, sz;
+	float inverse[3]; // 1/rd, for the box tests
+} ShearedRay;
+
+void shear_ray(float* rd, ShearedRay* ray)
+{
+	ray->kz = 0;
+	if(fabsf(rd[1]) > fabsf(rd[ray->kz])) ray->kz = 1;
+	if(fabsf(rd[2]) > fabsf(rd[ray->kz])) ray->kz = 2;
+	ray->kx = (ray->kz + 1) % 3;
+	ray->ky = (ray->kx + 1) % 3;
+
+	// keep the winding the same
+	if(rd[ray->kz] < 0)
+	{
+		int t = ray->kx;
+		ray->kx = ray->ky;
+		ray->ky = t;
+	}
+
+	ray->sx = rd[ray->kx] / rd[ray->kz];
+	ray->sy = rd[ray->ky] / rd[ray->kz];
+	ray->sz = 1 / rd[ray->kz];
+
+	ray->inverse[0] = 1 / rd[0];
+	ray->inverse[1] = 1 / rd[1];
+	ray->inverse[2] = 1 / rd[2];
+}
+
+// returns t of the hit or -1
+float intersect_triangle(const Mesh* mesh, int triangle, float* r0, const ShearedRay* ray)
+{
+	float a[3];
+	float b[3];
+	float c[3];
+	subtract(mesh_vertex(mesh, triangle, 0), r0, a);
+	subtract(mesh_vertex(mesh, triangle, 1), r0, b);
+	subtract(mesh_vertex(mesh, triangle, 2), r0, c);
+
+	float ax = a[ray->kx] - ray->sx * a[ray->kz];
+	float ay = a[ray->ky] - ray->sy * a[ray->kz];
+	float bx = b[ray->kx] - ray->sx * b[ray->kz];
+	float by = b[ray->ky] - ray->sy * b[ray->kz];
+	float cx = c[ray->kx] - ray->sx * c[ray->kz];
+	float cy = c[ray->ky] - ray->sy * c[ray->kz];
+
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+
+	// on an edge, redo it in double so neighbouring triangles agree
+	if(u == 0 || v == 0 || w == 0)
+	{
+		u = (float) ((double) cx * by - (double) cy * bx);
+		v = (float) ((double) ax * cy - (double) ay * cx);
+		w = (float) ((double) bx * ay - (double) by * ax);
+	}
+
+	if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		return -1;
+
+	float det = u + v + w;
+	if(det == 0)
+		return -1;
+
+	float az = ray->sz * a[ray->kz];
+	float bz = ray->sz * b[ray->kz];
+	float cz = ray->sz * c[ray->kz];
+	float t = (u * az + v * bz + w * cz) / det;
+
+	return t > 0 ? t : -1;
+}
+
+// returns 1 if the ray enters the box somewhere before best_t
+int ray_hits_box(const BVHNode* node, float* r0, const ShearedRay* ray, float best_t)
+{
+	float t_near = 0;
+	float t_far = best_t;
+	int a;
+	for(a = 0; a < 3; a ++)
+	{
+		float t0 = (node->lo[a] - r0[a]) * ray->inverse[a];
+		float t1 = (node->hi[a] - r0[a]) * ray->inverse[a];
+		if(t0 > t1)
+		{
+			float t = t0;
+			t0 = t1;
+			t1 = t;
+		}
+		// the comparisons are written so a NaN from 0 * inf doesn't cut the interval
+		if(t0 > t_near) t_near = t0;
+		if(t1 < t_far) t_far = t1;
+	}
+	return t_near <= t_far;
+}
+
+// closest triangle of the mesh hit by the ray before best_t, skipping triangle avoid.
+// returns t or -1, and the triangle in *hit
+float intersect_mesh(const Mesh* mesh, float* r0, float* rd, float best_t, int avoid, int* hit)
+{
+	ShearedRay ray;
+	shear_ray(rd, &ray);
+
+	float closest = -1;
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top ++] = 0;
+
+	while(top > 0)
+	{
+		const BVHNode* node = &mesh->nodes[stack[-- top]];
+		if(!ray_hits_box(node, r0, &ray, best_t))
+			continue;
+
+		if(node->count == 0)
+		{
+			stack[top ++] = node->first;
+			stack[top ++] = node->first + 1;
+			continue;
+		}
+
+		int k;
+		for(k = node->first; k < node->first + node->count; k ++)
+		{
+			int triangle = mesh->order[k];
+			if(triangle == avoid)
+				continue;
+
+			render_stats.tests ++;
+			float t = intersect_triangle(mesh, triangle, r0, &ray);
+			if(t > 0 && t < best_t)
+			{
+				best_t = t;
+				closest = t;
+				*hit = triangle;
+			}
+		}
+	}
+
+	return closest;
+}
+
+void triangle_normal(const Mesh* mesh, int triangle, float* normal)
+{
+	float e1[3];
+	float e2[3];
+	subtract(mesh_vertex(mesh, triangle, 1), mesh_vertex(mesh, triangle, 0), e1);
+	subtract(mesh_vertex(mesh, triangle, 2), mesh_vertex(mesh, triangle, 0), e2);
+	cross(e1, e2, normal);
+	normalize(normal);
+}
@@ -0,0 +1,25 @@
+#include "render.c"
+
+// converts an obj file into the binary mesh format, which loads by mapping it
+// into memory instead of parsing it
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		fprintf(stderr, "Usage: input.obj output.mesh\n");
+		exit(1);
+	}
+
+	Mesh mesh;
+	load_mesh(argv[1], &mesh);
+	if(write_binary_mesh(&mesh, argv[2]) != 0)
+	{
+		fprintf(stderr, "Error: could not write %s\n", argv[2]);
+		exit(1);
+	}
+
+	printf("Wrote %d vertices and %d triangles\n", mesh.num_vertices, mesh.num_triangles);
+	free_mesh(&mesh);
+	return 0;
+}
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+// hardware counters per phase of a run
+// the counters are opened once, on the main thread, before any render thread exists, and
+// count the threads started later too. the phases are marked by perf_phase, which is
+// a no-op unless perf_start was called, and each gets what the counters moved by while
+// it ran. counters the machine or the kernel won't give are left out of the report.
+
+#define PERF_EVENTS 4
+#define MAX_PERF_PHASES 8
+
+// misses per thousand instructions above which a phase is said to wait on that
+#define MEMORY_BOUND_MPKI 5
+#define BRANCH_BOUND_MPKI 10
+
+typedef struct {
+	const char* name;
+	double seconds;
+	long rays;
+	double counts[PERF_EVENTS];
+} PerfPhase;
+
+typedef struct {
+	int fds[PERF_EVENTS]; // -1 for counters that couldn't be opened
+	int num_phases;
+	PerfPhase phases[MAX_PERF_PHASES];
+	PerfPhase* current;
+	double start_counts[PERF_EVENTS];
+	double start_time;
+	long start_rays;
+} PerfCounters;
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_LLC_MISSES };
+
+const uint64_t perf_event_configs[PERF_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_BRANCH_MISSES,
+	PERF_COUNT_HW_CACHE_MISSES, // last level cache
+};
+
+const char* perf_event_names[PERF_EVENTS] = { "cycles", "instructions", "branch misses", "LLC misses" };
+
+PerfCounters* perf = NULL;
+
+int open_perf_counter(uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.inherit = 1; // the render threads are started after this
+	attr.exclude_kernel = 1; // user space is all that perf_event_paranoid 2 allows
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// the count so far, scaled up for the time the counter had to share the hardware
+double read_perf_counter(int fd)
+{
+	uint64_t values[3]; // value, time enabled, time running
+	if(fd < 0 || read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0)
+		return 0;
+	return (double) values[0] * values[1] / values[2];
+}
+
+void perf_start()
+{
+	perf = calloc(1, sizeof(PerfCounters));
+	int errors[PERF_EVENTS];
+	int opened = 0;
+	int k;
+	for(k = 0; k < PERF_EVENTS; k ++)
+	{
+		perf->fds[k] = open_perf_counter(perf_event_configs[k]);
+		errors[k] = errno;
+		if(perf->fds[k] >= 0)
+			opened ++;
+	}
+
+	if(opened == 0)
+	{
+		fprintf(stderr, "Warning: no hardware counters (%s), --perf only reports times\n", strerror(errors[0]));
+		return;
+	}
+	for(k = 0; k < PERF_EVENTS; k ++)
+	{
+		if(perf->fds[k] < 0)
+			fprintf(stderr, "Warning: no %s counter: %s\n", perf_event_names[k], strerror(errors[k]));
+	}
+}
+
+// ends the phase running now, if any, and starts one called name, unless name is NULL
+void perf_phase(const char* name)
+{
+	if(perf == NULL)
+		return;
+
+	double counts[PERF_EVENTS];
+	int k;
+	for(k = 0; k < PERF_EVENTS; k ++)
+		counts[k] = read_perf_counter(perf->fds[k]);
+	double time = now_seconds();
+
+	PerfPhase* phase = perf->current;
+	if(phase != NULL)
+	{
+		phase->seconds = time - perf->start_time;
+		phase->rays = render_stats.rays - perf->start_rays;
+		for(k = 0; k < PERF_EVENTS; k ++)
+			phase->counts[k] = counts[k] - perf->start_counts[k];
+	}
+
+	perf->current = NULL;
+	if(name == NULL || perf->num_phases == MAX_PERF_PHASES)
+		return;
+
+	perf->current = &perf->phases[perf->num_phases ++];
+	perf->current->name = name;
+	memcpy(perf->start_counts, counts, sizeof(counts));
+	perf->start_time = time;
+	perf->start_rays = render_stats.rays;
+}
+
+// what a phase waits on the most, going by its misses per thousand instructions
+const char* perf_bound(PerfPhase* phase)
+{
+	double kilo_instructions = phase->counts[PERF_INSTRUCTIONS] / 1000;
+	if(perf->fds[PERF_INSTRUCTIONS] < 0 || kilo_instructions == 0)
+		return "";
+	if(perf->fds[PERF_LLC_MISSES] >= 0 && phase->counts[PERF_LLC_MISSES] / kilo_instructions > MEMORY_BOUND_MPKI)
+		return "memory";
+	if(perf->fds[PERF_BRANCH_MISSES] >= 0 && phase->counts[PERF_BRANCH_MISSES] / kilo_instructions > BRANCH_BOUND_MPKI)
+		return "branching";
+	return "arithmetic";
+}
+
+// prints a column of counts, or n/a if the counter isn't there
+void print_perf_count(int event, double count)
+{
+	if(perf->fds[event] < 0)
+		printf(" %14s", "n/a");
+	else
+		printf(" %14.0f", count);
+}
+
+void perf_report()
+{
+	if(perf == NULL)
+		return;
+	perf_phase(NULL);
+
+	int k;
+	printf("\n%-8s %9s %14s %14s %5s %14s %14s %10s\n", "phase", "seconds", "cycles", "instructions", "IPC",
+		"branch misses", "LLC misses", "bound by");
+	for(k = 0; k < perf->num_phases; k ++)
+	{
+		PerfPhase* phase = &perf->phases[k];
+		printf("%-8s %9.3f", phase->name, phase->seconds);
+		print_perf_count(PERF_CYCLES, phase->counts[PERF_CYCLES]);
+		print_perf_count(PERF_INSTRUCTIONS, phase->counts[PERF_INSTRUCTIONS]);
+		if(phase->counts[PERF_CYCLES] > 0 && perf->fds[PERF_INSTRUCTIONS] >= 0)
+			printf(" %5.2f", phase->counts[PERF_INSTRUCTIONS] / phase->counts[PERF_CYCLES]);
+		else
+			printf(" %5s", "n/a");
+		print_perf_count(PERF_BRANCH_MISSES, phase->counts[PERF_BRANCH_MISSES]);
+		print_perf_count(PERF_LLC_MISSES, phase->counts[PERF_LLC_MISSES]);
+		printf(" %10s\n", perf_bound(phase));
+	}
+
+	// per ray, for the phases that traced any
+	for(k = 0; k < perf->num_phases; k ++)
+	{
+		PerfPhase* phase = &perf->phases[k];
+		if(phase->rays == 0)
+			continue;
+		printf("%s: %ld rays, %.1f ns", phase->name, phase->rays, phase->seconds * 1e9 / phase->rays);
+		int e;
+		for(e = 0; e < PERF_EVENTS; e ++)
+		{
+			if(perf->fds[e] >= 0)
+				printf(", %.2f %s", phase->counts[e] / phase->rays, perf_event_names[e]);
+		}
+		printf(" per ray\n");
+	}
+
+	for(k = 0; k < PERF_EVENTS; k ++)
+	{
+		if(perf->fds[k] >= 0)
+			close(perf->fds[k]);
+	}
+	free(perf);
+	perf = NULL;
+}
@@ -0,0 +1,236 @@
+// screen space candidates for primary rays
+// primary rays all start at the camera, so before a frame the bounding sphere of every
+// object and placement is projected onto the image and the pixels it can cover are
+// marked in bins of PRIMARY_BIN by PRIMARY_BIN pixels. a primary ray then only tests the
+// candidates of its bin, in the same order send_ray would, so it finds the same hit.
+// planes, cylinders and anything reaching behind the camera could be anywhere and are
+// candidates in every bin. a bin with nothing in it is background without a single test.
+
+#define PRIMARY_BIN 8
+#define PRIMARY_MARGIN 1.001 // bounds are grown by this much against rounding
+
+struct PrimaryBins {
+	int columns;
+	int rows;
+	int* first; // candidates of bin b are entries first[b] to first[b + 1] - 1
+	int* entries; // object k of the scene is k, placement p is num_objects + p
+};
+
+// extent of the sphere on the image plane z = 1 along one axis, seen from the origin.
+// a is the sphere's coordinate on that axis, z its depth. returns 0 if it reaches behind
+// the camera and has no bounded extent
+int project_extent(float a, float z, float radius, float* lo, float* hi)
+{
+	if(z - radius <= 1e-4)
+		return 0;
+	float distance = sqrt(sqr(a) + sqr(z));
+	float center = atan2(a, z);
+	float spread = asin(min(radius / distance, 1));
+	*lo = tan(center - spread);
+	*hi = tan(center + spread);
+	return 1;
+}
+
+// the bins a bounding sphere can cover, or 0 if it can cover any of them
+int sphere_bins(RenderJob* job, const float* center, float radius, int* range)
+{
+	if(isinf(radius))
+		return 0;
+	radius *= PRIMARY_MARGIN;
+
+	float x_lo, x_hi, y_lo, y_hi;
+	if(!project_extent(center[0], center[2], radius, &x_lo, &x_hi) || !project_extent(center[1], center[2], radius, &y_lo, &y_hi))
+		return 0;
+
+	// image plane to pixels of the job, as primary_ray does it backwards, with a pixel to spare
+	float w = job->scene->camera_width;
+	float h = job->scene->camera_height;
+	float j0 = (x_lo + w / 2.0) / job->pixel_width - 0.5 - job->x0 - 1;
+	float j1 = (x_hi + w / 2.0) / job->pixel_width - 0.5 - job->x0 + 1;
+	float i0 = (h / 2.0 - y_hi) / job->pixel_height - 0.5 - job->y0 - 1;
+	float i1 = (h / 2.0 - y_lo) / job->pixel_height - 0.5 - job->y0 + 1;
+
+	range[0] = (int) clamp(floor(j0), 0, job->width - 1) / PRIMARY_BIN;
+	range[1] = (int) clamp(ceil(j1), 0, job->width - 1) / PRIMARY_BIN;
+	range[2] = (int) clamp(floor(i0), 0, job->height - 1) / PRIMARY_BIN;
+	range[3] = (int) clamp(ceil(i1), 0, job->height - 1) / PRIMARY_BIN;
+	if(j1 < 0 || i1 < 0 || j0 > job->width - 1 || i0 > job->height - 1)
+		range[1] = range[0] - 1; // off the image
+	return 1;
+}
+
+// the bounds of entry e, objects first and then placements
+void entry_bound(const CompiledScene* scene, int e, float* center, float* radius)
+{
+	if(e < scene->num_objects)
+	{
+		*radius = bound_object((CompiledScene*) scene, &scene->geometry[e], center);
+	}
+	else
+	{
+		const Placement* p = &scene->placements[e - scene->num_objects];
+		vector_copy(p->bound_center, center);
+		*radius = p->bound_radius;
+	}
+}
+
+// adds entry e to the bins it can cover at fill, or only counts it there when entries is NULL
+void bin_entry(RenderJob* job, PrimaryBins* bins, int* fill, int e)
+{
+	float center[3];
+	float radius;
+	entry_bound(job->scene, e, center, &radius);
+
+	int range[4] = { 0, bins->columns - 1, 0, bins->rows - 1 };
+	sphere_bins(job, center, radius, range);
+
+	int x;
+	int y;
+	for(y = range[2]; y <= range[3]; y ++)
+	{
+		for(x = range[0]; x <= range[1]; x ++)
+		{
+			int b = y * bins->columns + x;
+			if(bins->entries != NULL)
+				bins->entries[fill[b]] = e;
+			fill[b] ++;
+		}
+	}
+}
+
+// returns NULL when the scene has nothing that binning would leave out
+PrimaryBins* build_primary_bins(RenderJob* job)
+{
+	const CompiledScene* scene = job->scene;
+	int num_entries = scene->num_objects + scene->num_placements;
+
+	int bounded = 0;
+	int e;
+	for(e = 0; e < num_entries; e ++)
+	{
+		float center[3];
+		float radius;
+		entry_bound(scene, e, center, &radius);
+		if(!isinf(radius))
+			bounded ++;
+	}
+	if(bounded < 2)
+		return NULL;
+
+	PrimaryBins* bins = malloc(sizeof(PrimaryBins));
+	bins->columns = (job->width + PRIMARY_BIN - 1) / PRIMARY_BIN;
+	bins->rows = (job->height + PRIMARY_BIN - 1) / PRIMARY_BIN;
+	int num_bins = bins->columns * bins->rows;
+	bins->first = calloc(num_bins + 1, sizeof(int));
+	bins->entries = NULL;
+
+	// count, then fill in the same order so each bin keeps the scene's order
+	int* fill = calloc(num_bins + 1, sizeof(int));
+	for(e = 0; e < num_entries; e ++)
+		bin_entry(job, bins, fill, e);
+
+	long total = 0;
+	int b;
+	for(b = 0; b < num_bins; b ++)
+	{
+		bins->first[b] = total;
+		total += fill[b];
+		fill[b] = bins->first[b];
+	}
+	bins->first[num_bins] = total;
+
+	// most objects are everywhere, testing them all is as good
+	if(total > (long) num_bins * num_entries * 3 / 4 || total > INT_MAX / 2)
+	{
+		free(fill);
+		free(bins->first);
+		free(bins);
+		return NULL;
+	}
+
+	bins->entries = malloc(sizeof(int) * (total + 1));
+	for(e = 0; e < num_entries; e ++)
+		bin_entry(job, bins, fill, e);
+
+	free(fill);
+	return bins;
+}
+
+void free_primary_bins(PrimaryBins* bins)
+{
+	if(bins == NULL)
+		return;
+	free(bins->first);
+	free(bins->entries);
+	free(bins);
+}
+
+// send_ray for the primary ray of pixel (i, j), only looking at the candidates of its bin,
+// or at everything when there are no bins. objects of the scene itself are tested with the
+// primary ray versions of the intersections, placements move the ray and can't be
+void send_primary_ray(Intersection* i, RenderJob* job, int row, int column, float* r0, float* rd)
+{
+	const CompiledScene* scene = job->scene;
+	const PrimaryBins* bins = job->bins;
+	float best_t = INFINITY;
+	i->object_id = -1;
+	i->instance = -1;
+	i->primitive = -1;
+	render_stats.rays ++;
+
+	float rd2 = sqr(rd[0]) + sqr(rd[1]) + sqr(rd[2]);
+
+	int first = 0;
+	int last = scene->num_objects + scene->num_placements;
+	if(bins != NULL)
+	{
+		int b = row / PRIMARY_BIN * bins->columns + column / PRIMARY_BIN;
+		first = bins->first[b];
+		last = bins->first[b + 1];
+	}
+
+	int n;
+	for(n = first; n < last; n ++)
+	{
+		int e = bins != NULL ? bins->entries[n] : n;
+		if(e < scene->num_objects)
+		{
+			int triangle = -1;
+			float t = intersect_primary(scene, &scene->geometry[e], r0, rd, rd2, best_t, &triangle);
+			if(t > 0 && t < best_t)
+			{
+				best_t = t;
+				i->object_id = e;
+				i->primitive = triangle;
+			}
+			continue;
+		}
+
+		int p = e - scene->num_objects;
+		const Placement* placement = &scene->placements[p];
+		if(!ray_hits_bound(placement->bound_center, placement->bound_radius, r0, rd, best_t))
+			continue;
+
+		float local_r0[3];
+		float local_rd[3];
+		ray_to_group(placement, r0, rd, local_r0, local_rd);
+
+		const GeometryGroup* group = &scene->groups[placement->group];
+		int k;
+		for(k = group->first; k < group->first + group->count; k ++)
+		{
+			int triangle = -1;
+			float t = intersect_geometry(scene, &scene->geometry[k], local_r0, local_rd, best_t, -1, &triangle);
+			if(t > 0 && t < best_t)
+			{
+				best_t = t;
+				i->object_id = k;
+				i->instance = p;
+				i->primitive = triangle;
+			}
+		}
+	}
+
+	scale(rd, best_t, i->point);
+	add(i->point, r0, i->point);
+}
@@ -1,40 +1,4 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-
-#define MAX_OBJECTS 128
-#define MAX_LIGHTS 128
-
-typedef struct {
-	int kind;
-	float color[3]; // also diffuse color for non-lights
-	float position[3];
-	float direction[3]; // for lights only
-	float a, b, c, d, e;
-	float specular[3];
-} Object;
-
-typedef struct {
-	int num_objects;
-	Object objects[MAX_OBJECTS + 1];
-	int num_lights;
-	Object lights[MAX_LIGHTS + 1];
-	float camera_width;
-	float camera_height;
-	float ambient_color[3]; // for fun!
-} Scene;
-
-typedef struct {
-	float point[3];
-	Object* object;
-	int object_id;
-} Intersection;
-
-#include "3dmath.c"
-#include "imageread.c"
-#include "jsonread.c"
-#include "raycast.c"
+#include "render.c"
 
 // diffuse reflection
 // used for a rough surface, light bounces off in random directions
@@ -47,29 +11,205 @@ typedef struct {
 
 int main(int argc, char** argv)
 {
-	if(argc < 5)
+	// --batch MANIFEST stands in for the size and files of a single render
+	int batch = argc >= 3 && strcmp(argv[1], "--batch") == 0;
+	if(argc < 5 && !batch)
 	{
-		fprintf(stderr, "Usage: width height input.json output.ppm\n");
+		fprintf(stderr, "Usage: width height input.json output.ppm [options]\n");
+		fprintf(stderr, "       --batch manifest [options]\n");
+		fprintf(stderr, "   --batch manifest        render every \"width height input.json output.ppm\" line of the\n");
+		fprintf(stderr, "                           manifest in one run, reading each scene once\n");
+		fprintf(stderr, "   --threads N             number of render threads (default: all cores)\n");
+		fprintf(stderr, "   --tile-size N           edge length of a tile in pixels (default: 16)\n");
+		fprintf(stderr, "   --order rows|morton|hilbert   order tiles are handed out in (default: hilbert)\n");
+		fprintf(stderr, "   --progressive           render coarse to fine, rewriting the output after each pass\n");
+		fprintf(stderr, "   --coarse N              pixel spacing of the first progressive pass (default: 8)\n");
+		fprintf(stderr, "   --time-budget MS        stop refining after MS milliseconds (implies --progressive)\n");
+		fprintf(stderr, "   --preview               fast low quality render: reduced size, 2 bounces, no refraction,\n");
+		fprintf(stderr, "                           only the 2 most important lights per point\n");
+		fprintf(stderr, "   --preview-scale N       preview renders at 1/N of the output size (default: 2)\n");
+		fprintf(stderr, "   --preview-lights N      lights shaded per point in preview (default: 2)\n");
+		fprintf(stderr, "   --preview-target MS     pick the preview size to fit a frame into MS milliseconds\n");
+		fprintf(stderr, "   --shadow-maps N         look shadows up in N by N shadow maps traced once per frame\n");
+		fprintf(stderr, "                           instead of tracing a shadow ray per light and hit\n");
+		fprintf(stderr, "   --shadow-bias B         shadow map depth bias in scene units (default: 0.05)\n");
+		fprintf(stderr, "   --gbuffer FILE          keep the hits of the frame in FILE and only shade them again\n");
+		fprintf(stderr, "                           while the geometry is the same, for fast relighting\n");
+		fprintf(stderr, "   --wavefront             trace every ray of a bounce together, sorted by direction\n");
+		fprintf(stderr, "   --light-samples N       shade N lights picked at random per point instead of all of them\n");
+		fprintf(stderr, "   --spp N                 average N samples per pixel with --light-samples (default: 1)\n");
+		fprintf(stderr, "   --heatmap FILE          also write what every pixel cost as a false color image\n");
+		fprintf(stderr, "   --heatmap-metric M      rays, tests (intersection tests), depth or time (default: rays)\n");
+		fprintf(stderr, "   --estimate              only trace a sample of the pixels and estimate the rays and time\n");
+		fprintf(stderr, "                           the frame would take, nothing is written\n");
+		fprintf(stderr, "   --estimate-samples N    pixels the estimate traces (default: 1024)\n");
+		fprintf(stderr, "   --checkpoint FILE       save finished tiles to FILE while rendering, removed at the end\n");
+		fprintf(stderr, "   --checkpoint-interval S seconds between checkpoint saves (default: 60)\n");
+		fprintf(stderr, "   --resume                only render the tiles the checkpoint doesn't have\n");
+		fprintf(stderr, "   --texture-cache MB      memory the tiles of image textures may take (default: 64)\n");
+		fprintf(stderr, "   --perf                  count cycles, instructions, branch and cache misses of each phase\n");
+		fprintf(stderr, "   --trace FILE            write a timeline of the phases and of every tile each thread\n");
+		fprintf(stderr, "                           rendered to FILE, for chrome://tracing or ui.perfetto.dev\n");
+		fprintf(stderr, "   --tile Z X Y            only render tile X, Y of level Z of a deep zoom pyramid of the\n");
+		fprintf(stderr, "                           width by height image, output is then the pyramid's directory\n");
 		exit(1);
 	}
+
+	RenderOptions options;
+	default_render_options(&options);
+	int tile[3] = { -1, -1, -1 }; // level, column and row of a pyramid tile
+	int use_perf = 0;
+	int estimate_samples = 0; // 0 renders the frame
+
+	int a;
+	for(a = batch ? 3 : 5; a < argc; a ++)
+	{
+		if(strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+			options.num_threads = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--tile-size") == 0 && a + 1 < argc)
+			options.tile_size = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--progressive") == 0)
+			options.progressive = 1;
+		else if(strcmp(argv[a], "--coarse") == 0 && a + 1 < argc)
+			options.coarse_step = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--time-budget") == 0 && a + 1 < argc)
+		{
+			options.time_budget = atof(argv[++a]) / 1000.0;
+			options.progressive = 1;
+		}
+		else if(strcmp(argv[a], "--preview") == 0)
+			options.preview = 1;
+		else if(strcmp(argv[a], "--preview-scale") == 0 && a + 1 < argc)
+			options.preview_divisor = max(atoi(argv[++a]), 1);
+		else if(strcmp(argv[a], "--preview-lights") == 0 && a + 1 < argc)
+			options.preview_lights = atoi(argv[++a]);
+		else if(strcmp(argv[a], "--preview-target") == 0 && a + 1 < argc)
+			options.preview_target = atof(argv[++a]) / 1000.0;
+		else if(strcmp(argv[a], "--shadow-maps") == 0 && a + 1 < argc)
+			options.shadow_map_size = max(atoi(argv[++a]), 0);
+		else if(strcmp(argv[a], "--shadow-bias") == 0 && a + 1 < argc)
+			options.shadow_bias = atof(argv[++a]);
+		else if(strcmp(argv[a], "--gbuffer") == 0 && a + 1 < argc)
+			options.gbuffer = argv[++a];
+		else if(strcmp(argv[a], "--wavefront") == 0)
+			options.wavefront = 1;
+		else if(strcmp(argv[a], "--light-samples") == 0 && a + 1 < argc)
+			options.light_samples = max(atoi(argv[++a]), 0);
+		else if(strcmp(argv[a], "--spp") == 0 && a + 1 < argc)
+			options.spp = max(atoi(argv[++a]), 1);
+		else if(strcmp(argv[a], "--trace") == 0 && a + 1 < argc)
+			trace_start(argv[++a]);
+		else if(strcmp(argv[a], "--heatmap") == 0 && a + 1 < argc)
+			options.heatmap = argv[++a];
+		else if(strcmp(argv[a], "--heatmap-metric") == 0 && a + 1 < argc)
+		{
+			options.heat_metric = parse_heat_metric(argv[++a]);
+			if(options.heat_metric < 0)
+			{
+				fprintf(stderr, "Error: unknown heatmap metric %s\n", argv[a]);
+				exit(1);
+			}
+		}
+		else if(strcmp(argv[a], "--estimate") == 0)
+			estimate_samples = estimate_samples > 0 ? estimate_samples : 1024;
+		else if(strcmp(argv[a], "--estimate-samples") == 0 && a + 1 < argc)
+			estimate_samples = max(atoi(argv[++a]), 1);
+		else if(strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc)
+			options.checkpoint = argv[++a];
+		else if(strcmp(argv[a], "--checkpoint-interval") == 0 && a + 1 < argc)
+			options.checkpoint_interval = atof(argv[++a]);
+		else if(strcmp(argv[a], "--resume") == 0)
+			options.resume = 1;
+		else if(strcmp(argv[a], "--texture-cache") == 0 && a + 1 < argc)
+			texture_cache_budget = (size_t) (max(atof(argv[++a]), 0) * 1024 * 1024);
+		else if(strcmp(argv[a], "--perf") == 0)
+			use_perf = 1;
+		else if(strcmp(argv[a], "--tile") == 0 && a + 3 < argc)
+		{
+			tile[0] = atoi(argv[++a]);
+			tile[1] = atoi(argv[++a]);
+			tile[2] = atoi(argv[++a]);
+		}
+		else if(strcmp(argv[a], "--order") == 0 && a + 1 < argc)
+		{
+			options.tile_order = parse_tile_order(argv[++a]);
+			if(options.tile_order < 0)
+			{
+				fprintf(stderr, "Error: unknown tile order %s\n", argv[a]);
+				exit(1);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown option %s\n", argv[a]);
+			exit(1);
+		}
+	}
 	
+	if(options.resume && options.checkpoint == NULL)
+	{
+		fprintf(stderr, "Error: --resume needs the --checkpoint file to resume from\n");
+		exit(1);
+	}
+
+	if(batch)
+	{
+		if(options.progressive || options.gbuffer != NULL || options.heatmap != NULL || options.checkpoint != NULL
+			|| estimate_samples > 0 || tile[0] >= 0)
+		{
+			fprintf(stderr, "Error: --batch only renders whole frames, without --progressive, --time-budget, --gbuffer,\n"
+				"--heatmap, --checkpoint, --estimate or --tile\n");
+			exit(1);
+		}
+		if(use_perf)
+			perf_start();
+		perf_phase("batch");
+		int failures = render_batch(argv[2], &options);
+		texture_cache_report();
+		perf_report();
+		return failures > 0;
+	}
+
 	PPMmeta fileinfo;
 	fileinfo.width = atoi(argv[1]);
 	fileinfo.height = atoi(argv[2]);
 	fileinfo.max = 255;
 	fileinfo.type = 6;
 	
-	Scene scene = read_scene(argv[3]);
+	if(use_perf)
+		perf_start();
+
+	perf_phase("read");
+	double start = now_seconds();
+	Scene scene;
+	read_scene(argv[3], &scene);
+	trace_span("read scene", start);
 
 	printf("Read in %d items:\n", scene.num_objects + scene.num_lights);
 	printf("   %d objects\n", scene.num_objects);
 	printf("   %d lights\n", scene.num_lights);
+	if(scene.num_instances > 0)
+		printf("   %d instances of %d groups\n", scene.num_instances, scene.num_groups);
+
+	perf_phase("setup");
+	start = now_seconds();
+	CompiledScene* compiled = malloc(sizeof(CompiledScene));
+	setup_scene(&scene, compiled);
+	trace_span("setup", start);
 
-	scene.ambient_color[0] = 0.15;
-	scene.ambient_color[1] = 0.15;
-	scene.ambient_color[2] = 0.15;
+	perf_phase("render");
+	start = now_seconds();
 	
-	raycast(scene, argv[4], fileinfo);
+	if(estimate_samples > 0)
+		estimate_render(compiled, fileinfo, &options, estimate_samples);
+	else if(tile[0] >= 0)
+		render_pyramid_tile(compiled, argv[4], fileinfo.width, fileinfo.height, tile[0], tile[1], tile[2], &options);
+	else
+		raycast(compiled, argv[4], fileinfo, &options);
+	trace_span("render", start);
+
+	texture_cache_report();
+	perf_report();
 
 	return 0;
 }
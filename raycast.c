@@ -4,7 +4,7 @@
 #define SPEC_K 0.4
 #define DIFFUSE_K 1.0
 
-float intersect_sphere(float* c, float R, float* r0, float* rd)
+float intersect_sphere(const float* c, float R, float* r0, float* rd)
 {
 	// A = xd^2 + yd^2 + zd^2
 	// B = 2 * (xd * (x0 - xc) + yd * (y0 - yc) + zd * (z0 - zc))
@@ -14,9 +14,8 @@ float intersect_sphere(float* c, float R, float* r0, float* rd)
 	float B = 2 * (rd[0] * (r0[0] - c[0]) + rd[1] * (r0[1] - c[1]) + rd[2] * (r0[2] - c[2]));
 	float C = sqr(r0[0] - c[0]) + sqr(r0[1] - c[1]) + sqr(r0[2] - c[2]) - sqr(R);
 	
-	float* zeroes = quadratic_formula(A, B, C);
-	
-	if(isnan(zeroes[0]))
+	float zeroes[2];
+	if(!quadratic_zeroes(A, B, C, zeroes))
 		return -1;
 	
 	if(zeroes[0] > 0) return zeroes[0];
@@ -24,18 +23,11 @@ float intersect_sphere(float* c, float R, float* r0, float* rd)
 	return -1;
 }
 
-float intersect_cylinder(Object cyl, float* r0, float* rd)
+float intersect_cylinder(const Geometry* cyl, float* r0, float* rd)
 {
-	float basis2[3];
-	basis2[0] = cyl.a;
-	basis2[1] = cyl.b;
-	basis2[2] = cyl.c;
-
-	float basis1[3];
-	vector_copy(cyl.direction, basis1);
-
-	float c[3];
-	vector_copy(cyl.position, c);
+	const float* basis1 = cyl->normal;
+	const float* basis2 = cyl->basis2;
+	const float* c = cyl->position;
 
 	float r0_dot_b1 = dot(r0, basis1);
 	float r0_dot_b2 = dot(r0, basis2);
@@ -46,10 +38,10 @@ float intersect_cylinder(Object cyl, float* r0, float* rd)
 
 	float A = sqr(rd_dot_b1) + sqr(rd_dot_b2);
 	float B = 2 * (rd_dot_b1*r0_dot_b1 + r0_dot_b2*r0_dot_b2 - rd_dot_b1*c_dot_b1 - rd_dot_b2*c_dot_b2);
-	float C = sqr(r0_dot_b2 - c_dot_b2) + sqr(r0_dot_b1 - c_dot_b1) - sqr(cyl.e);
+	float C = sqr(r0_dot_b2 - c_dot_b2) + sqr(r0_dot_b1 - c_dot_b1) - sqr(cyl->radius);
 
-	float* zeroes = quadratic_formula(A, B, C);
-	if(isnan(zeroes[0]))
+	float zeroes[2];
+	if(!quadratic_zeroes(A, B, C, zeroes))
 		return -1;
 	
 	if(zeroes[0] > 0) return zeroes[0];
@@ -63,296 +55,855 @@ float intersect_plane(float a, float b, float c, float d, float* r0, float* rd)
 	return (a*r0[0] + b*r0[1] + c*r0[2] + d) / (a*rd[0] + b*rd[1] + c*rd[2]);
 }
 
-// returns the scene's object id that intersects the ray
-// the basic object finding loop now lives here
-void send_ray(Intersection* i, Scene scene, float* r0, float* rd, int avoid)
+// intersect_sphere and intersect_cylinder for a ray from the camera, with the terms that
+// don't change from ray to ray taken from compile_eye_terms. rd2 is dot(rd, rd), which
+// the caller works out once for all the objects a ray is tested against
+float intersect_sphere_primary(const Geometry* o, const float* rd, float rd2)
+{
+	float B = -2 * dot(rd, o->position);
+	float zeroes[2];
+	if(!quadratic_zeroes(rd2, B, o->eye_c, zeroes))
+		return -1;
+
+	if(zeroes[0] > 0) return zeroes[0];
+	if(zeroes[1] > 0) return zeroes[1];
+	return -1;
+}
+
+float intersect_cylinder_primary(const Geometry* o, const float* rd)
+{
+	float rd_dot_b1 = dot(rd, o->normal);
+	float rd_dot_b2 = dot(rd, o->basis2);
+
+	float A = sqr(rd_dot_b1) + sqr(rd_dot_b2);
+	float B = 2 * (-rd_dot_b1*o->eye_dot[0] - rd_dot_b2*o->eye_dot[1]);
+	float zeroes[2];
+	if(!quadratic_zeroes(A, B, o->eye_c, zeroes))
+		return -1;
+
+	if(zeroes[0] > 0) return zeroes[0];
+	if(zeroes[1] > 0) return zeroes[1];
+	return -1;
+}
+
+// returns t of the hit or -1. for meshes, best_t lets the tree skip branches that are
+// further away, avoid is a triangle not to hit and the triangle hit goes in *primitive
+float intersect_geometry(const CompiledScene* scene, const Geometry* o, float* r0, float* rd, float best_t, int avoid, int* primitive)
+{
+	if(o->kind != T_MESH)
+		render_stats.tests ++; // meshes count their triangles
+	if(o->kind == T_SPHERE)
+	{
+		return intersect_sphere(o->position, o->radius, r0, rd);
+	}
+	else if(o->kind == T_PLANE)
+	{
+		return intersect_plane(o->normal[0], o->normal[1], o->normal[2], o->offset, r0, rd);
+	}
+	else if(o->kind == T_CYLINDER)
+	{
+		return intersect_cylinder(o, r0, rd);
+	}
+	else if(o->kind == T_MESH)
+	{
+		return intersect_mesh(&scene->meshes[o->mesh], r0, rd, best_t, avoid, primitive);
+	}
+	return -1;
+}
+
+// intersect_geometry for a ray from the camera, r0 is only needed by meshes
+float intersect_primary(const CompiledScene* scene, const Geometry* o, float* r0, float* rd, float rd2, float best_t, int* primitive)
+{
+	if(o->kind != T_MESH)
+		render_stats.tests ++;
+	if(o->kind == T_SPHERE)
+		return intersect_sphere_primary(o, rd, rd2);
+	if(o->kind == T_PLANE)
+		return o->offset / dot(o->normal, rd);
+	if(o->kind == T_CYLINDER)
+		return intersect_cylinder_primary(o, rd);
+	return intersect_geometry(scene, o, r0, rd, best_t, -1, primitive);
+}
+
+// whether an object has to be skipped for a ray leaving from hit avoid,
+// for meshes the triangle to skip goes in *triangle
+int avoid_object(const Intersection* avoid, int instance, int object_id, int* triangle)
+{
+	*triangle = -1;
+	if(avoid == NULL || avoid->instance != instance || avoid->object_id != object_id)
+		return 0;
+	if(avoid->primitive < 0)
+		return 1;
+	*triangle = avoid->primitive;
+	return 0;
+}
+
+// quick test for whether a ray can hit anything in a bounding sphere closer than best_t
+int ray_hits_bound(const float* center, float radius, float* r0, float* rd, float best_t)
+{
+	if(isinf(radius))
+		return 1;
+
+	float oc[3];
+	subtract(center, r0, oc);
+	float rd2 = dot(rd, rd);
+	float closest_t = dot(oc, rd) / rd2;
+	float miss2 = dot(oc, oc) - sqr(closest_t) * rd2; // squared distance of the ray from the center
+	if(miss2 > sqr(radius))
+		return 0;
+
+	float half = sqrt((sqr(radius) - miss2) / rd2);
+	return closest_t + half > 0 && closest_t - half < best_t;
+}
+
+// moves a ray into the space of a placement's group. rd isn't normalized afterwards,
+// so a distance t along the moved ray is the same point as t along the original
+void ray_to_group(const Placement* p, float* r0, float* rd, float* local_r0, float* local_rd)
+{
+	subtract(r0, p->position, local_r0);
+	matrix_multiply_transposed(p->rotation, local_r0, local_r0);
+	scale(local_r0, 1 / p->scale, local_r0);
+
+	matrix_multiply_transposed(p->rotation, rd, local_rd);
+	scale(local_rd, 1 / p->scale, local_rd);
+}
+
+// the surface normal at a hit, in world space
+// the hit point in the space of the group its object is in
+void hit_point_in_group(const CompiledScene* scene, const Intersection* hit, float* point)
+{
+	vector_copy(hit->point, point);
+	if(hit->instance >= 0)
+	{
+		const Placement* placement = &scene->placements[hit->instance];
+		subtract(point, placement->position, point);
+		matrix_multiply_transposed(placement->rotation, point, point);
+		scale(point, 1 / placement->scale, point);
+	}
+}
+
+void surface_normal(const CompiledScene* scene, const Intersection* hit, float* normal)
+{
+	const Geometry* shape = &scene->geometry[hit->object_id];
+
+	float point[3];
+	hit_point_in_group(scene, hit, point);
+
+	// a test to see how we need to calculate the normal
+	if(shape->kind == T_SPHERE)
+	{
+		subtract(point, shape->position, normal);
+		normalize(normal);
+	}
+	else if(shape->kind == T_PLANE)
+	{
+		vector_copy(shape->normal, normal);
+	}
+	else if(shape->kind == T_CYLINDER)
+	{
+		// the part of (point - center) that lies in the plane of the two basis vectors
+		float from_center[3];
+		subtract(point, shape->position, from_center);
+
+		float b1[3];
+		float b2[3];
+		scale(shape->normal, dot(from_center, shape->normal), b1);
+		scale(shape->basis2, dot(from_center, shape->basis2), b2);
+		add(b1, b2, normal);
+		normalize(normal);
+	}
+	else if(shape->kind == T_MESH)
+	{
+		triangle_normal(&scene->meshes[shape->mesh], hit->primitive, normal);
+	}
+
+	// the scale is the same in every direction, so only the rotation matters
+	if(hit->instance >= 0)
+		matrix_multiply(scene->placements[hit->instance].rotation, normal, normal);
+}
+
+// the material at a hit, with the overrides of an instance and the textures applied in scratch
+const Material* hit_material(const CompiledScene* scene, const Intersection* hit, Material* scratch)
+{
+	const Material* material = &scene->materials[hit->object_id];
+	int textured = material->diffuse_texture >= 0 || material->specular_texture >= 0;
+	if(!textured && (hit->instance < 0 || scene->placements[hit->instance].overrides == 0))
+		return material;
+
+	*scratch = *material;
+	if(hit->instance >= 0)
+	{
+		const Placement* p = &scene->placements[hit->instance];
+		if(p->overrides & OVERRIDE_DIFFUSE) vector_copy(p->material.diffuse, scratch->diffuse);
+		if(p->overrides & OVERRIDE_SPECULAR) vector_copy(p->material.specular, scratch->specular);
+		if(p->overrides & OVERRIDE_REFLECTIVITY) scratch->reflectivity = p->material.reflectivity;
+		if(p->overrides & OVERRIDE_REFRACTIVITY) scratch->refractivity = p->material.refractivity;
+		if(p->overrides & OVERRIDE_IOR) scratch->ior = p->material.ior;
+	}
+	if(textured)
+	{
+		float point[3];
+		hit_point_in_group(scene, hit, point);
+		texture_material(scene, hit, point, scratch);
+	}
+	return scratch;
+}
+
+
+// rough guess at how much a light adds at a point, ignoring shadows and the surface
+float light_importance(const Light* light, float* point)
+{
+	float dist[3];
+	subtract(point, light->position, dist);
+	float distance_to_light = length(dist);
+
+	float ang_att = 1;
+	if(light->cos_theta != 0)
+	{
+		scale(dist, 1 / distance_to_light, dist);
+		float att_dot = dot(dist, light->direction);
+		ang_att = att_dot < light->cos_theta ? 0 : powf(att_dot, light->angular_a0);
+	}
+
+	float rad_att = 1 / (light->radial_a2 * sqr(distance_to_light) + light->radial_a1 * distance_to_light + light->radial_a0);
+	return light_brightness(light) * clamp(ang_att * rad_att, 0.0, 1.0);
+}
+
+// fills indexes with the lights to shade at point, in scene order
+// normally that is all of them, if the scene limits the lights per point only the most important are kept
+int pick_lights(const CompiledScene* scene, float* point, int* indexes)
 {
-	float best_t = INFINITY;
 	int k;
-	i->object_id = -1;
-	
-	for(k = 0; k < scene.num_objects; k ++)
+	int limit = scene->max_shaded_lights;
+	if(limit <= 0 || limit >= scene->num_lights)
 	{
-		if(k == avoid) {
-			continue;
-		}
+		for(k = 0; k < scene->num_lights; k ++)
+			indexes[k] = k;
+		return scene->num_lights;
+	}
 
-		float t = -1;
-		Object o = scene.objects[k];
-		
-		if(o.kind == T_SPHERE)
-		{
-			t = intersect_sphere(o.position, o.d, r0, rd);
-		}
-		else if(o.kind == T_PLANE)
-		{
-			t = intersect_plane(o.direction[0], o.direction[1], o.direction[2], o.d, r0, rd);
-		}
-		else if(o.kind == T_CYLINDER)
+	float importance[scene->num_lights];
+	int keep[scene->num_lights];
+	for(k = 0; k < scene->num_lights; k ++)
+	{
+		importance[k] = light_importance(&scene->lights[k], point);
+		keep[k] = 0;
+	}
+
+	// limit is small, so just pick the brightest remaining light limit times
+	int n;
+	for(n = 0; n < limit; n ++)
+	{
+		int best = -1;
+		for(k = 0; k < scene->num_lights; k ++)
 		{
-			t = intersect_cylinder(o, r0, rd);
+			if(!keep[k] && (best < 0 || importance[k] > importance[best]))
+				best = k;
 		}
-		else if(o.kind == 0)
-			break;
-		
-		if(t > 0 && t < best_t)
+		keep[best] = 1;
+	}
+
+	n = 0;
+	for(k = 0; k < scene->num_lights; k ++)
+	{
+		if(keep[k])
+			indexes[n ++] = k;
+	}
+	return n;
+}
+
+// light sampling
+// with thousands of lights, shading every one of them at every point is out of the question.
+// instead a few lights are picked at random per point, and what they add is weighted so that
+// on average it comes to the same as all the lights together. each pick draws
+// LIGHT_CANDIDATES lights by brightness, then keeps one of them in proportion to
+// light_importance at the point, so that near and bright lights are picked the most
+// (resampled importance sampling). the random numbers are seeded per pixel and sample,
+// so a frame comes out the same every time.
+
+#define LIGHT_CANDIDATES 8
+
+__thread uint64_t light_rng;
+
+float light_random()
+{
+	light_rng = mix_bits(light_rng);
+	return (light_rng >> 40) / 16777216.0f;
+}
+
+// a light drawn with probability proportional to its brightness
+int draw_light(const CompiledScene* scene, float* probability)
+{
+	float total = scene->light_cdf[scene->num_lights - 1];
+	float u = light_random() * total;
+
+	int lo = 0;
+	int hi = scene->num_lights - 1;
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(scene->light_cdf[mid] <= u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*probability = (scene->light_cdf[lo] - (lo > 0 ? scene->light_cdf[lo - 1] : 0)) / total;
+	return lo;
+}
+
+// returns the light to shade and in weight what to scale its contribution by,
+// or -1 if none of the candidates would add anything at point
+int sample_light(const CompiledScene* scene, float* point, float* weight)
+{
+	int picked = -1;
+	float picked_importance = 0;
+	float total = 0;
+
+	int k;
+	for(k = 0; k < LIGHT_CANDIDATES; k ++)
+	{
+		float probability;
+		int light = draw_light(scene, &probability);
+		float importance = light_importance(&scene->lights[light], point);
+		float w = importance / probability;
+		if(w <= 0)
+			continue;
+
+		total += w;
+		if(light_random() * total < w)
 		{
-			best_t = t;
-			i->object_id = k;
+			picked = light;
+			picked_importance = importance;
 		}
 	}
 
-	if(i->object_id < -1) printf("Strange object id: %d. Avoid: %d\n", i->object_id, avoid);
-	
-	scale(rd, best_t, i->point); // scale rd by best_t
-	add(i->point, r0, i->point); // then add that to r0
-	
-	i->object = &(scene.objects[i->object_id]);
+	if(picked >= 0)
+		*weight = total / LIGHT_CANDIDATES / picked_importance;
+	return picked;
 }
 
+// seeds light sampling for one sample of one pixel of the image
+void seed_light_sampling(int x, int y, int sample)
+{
+	light_rng = mix_bits(((uint64_t) y << 32 | (uint32_t) x) ^ mix_bits(sample));
+}
 
-void get_color_ray(float* color, Scene scene, float* r0, float* rd, int recursion)
+#include "kernels.c"
+
+typedef struct PrimaryBins PrimaryBins;
+
+typedef struct {
+	const CompiledScene* scene;
+	Pixel* data;
+	int width; // of the part of the image being rendered
+	int height;
+	int x0, y0; // where that part starts in the image
+	int stride; // pixels per row of data
+	float pixel_width;
+	float pixel_height;
+	int max_depth; // recursion limit for get_color_ray
+	ColorRayFunction color_ray; // the get_color_ray variant for the scene's features
+	ColorHitFunction color_hit; // and get_color_hit, for primary rays that found their hit in bins
+	const PrimaryBins* bins; // candidates for primary rays, NULL to send them like any other ray
+	int spp; // samples averaged per pixel, more than 1 only with light sampling
+	float* heat; // width * height costs for the heatmap, NULL when there is none
+	int heat_metric;
+	int step; // only every step'th pixel is traced, the rest of its block is filled in
+	int first_pass;
+	double deadline; // tiles that start after this are skipped, 0 for none
+	int expired;
+	RenderStats stats; // summed over all threads
+} RenderJob;
+
+// the ray through the center of pixel (i, j) of the part being rendered
+void primary_ray(RenderJob* job, int i, int j, float* r0, float* rd)
 {
-	if(recursion <= 0){
-		vector_copy(scene.ambient_color, color);
-		return;
-	} 
+	float w = job->scene->camera_width;
+	float h = job->scene->camera_height;
+
+	r0[0] = 0;
+	r0[1] = 0;
+	r0[2] = 0;
+
+	rd[0] = r0[0] - w/2.0 + job->pixel_width * (job->x0 + j + 0.5);
+	rd[1] = -r0[1] + h/2.0 - job->pixel_height * (job->y0 + i + 0.5);
+	rd[2] = 1;
+}
+
+void store_pixel(RenderJob* job, int i, int j, float* colors)
+{
+	colors[0] = clamp(colors[0], 0.0, 1.0);
+	colors[1] = clamp(colors[1], 0.0, 1.0);
+	colors[2] = clamp(colors[2], 0.0, 1.0);
+
+	Pixel pixel;
+	pixel.r = (unsigned char) (colors[0] * 255);
+	pixel.g = (unsigned char) (colors[1] * 255);
+	pixel.b = (unsigned char) (colors[2] * 255);
+	job->data[i * job->stride + j] = pixel;
+}
 
-	Intersection intersection;
-	send_ray(&intersection, scene, r0, rd, -1);
+#include "primary.c"
+#include "heatmap.c"
 
-	if(intersection.object_id == -1)
+// the color of a primary ray, found through the bins when there are some
+void primary_color(RenderJob* job, int i, int j, float* r0, float* rd, float* colors)
+{
+	if(job->max_depth <= 0)
 	{
-		vector_copy(scene.ambient_color, color);
+		job->color_ray(colors, job->scene, r0, rd, job->max_depth);
 		return;
 	}
 
-	// do reflections here
+	Intersection hit;
+	send_primary_ray(&hit, job, i, j, r0, rd);
+	if(hit.object_id == -1)
+		vector_copy(job->scene->ambient_color, colors);
+	else
+		job->color_hit(colors, job->scene, &hit, rd, job->max_depth);
+}
+
+void render_pixel(RenderJob* job, int i, int j)
+{
+	HeatSample heat;
+	if(job->heat != NULL)
+		start_heat(job, &heat);
 
-	// keep a reference to the intersected object
-	Object* closest = intersection.object;
+	float r0[3];
+	float rd[3];
+	primary_ray(job, i, j, r0, rd);
 
-	// do lighting on the object
-	float lighting[3];
-	vector_copy(scene.ambient_color, lighting);
-	int number_contributors = 1;
+	float colors[3];
 
-	float normal[3];
-	// a test to see how we need to calculate the normal
-	if(closest->kind == T_SPHERE)
+	if(job->spp <= 1)
 	{
-		subtract(intersection.point, closest->position, normal);
-		normalize(normal);
+		seed_light_sampling(job->x0 + j, job->y0 + i, 0);
+		primary_color(job, i, j, r0, rd, colors);
 	}
-	else if(closest->kind == T_PLANE)
+	else
 	{
-		vector_copy(closest->direction, normal);
+		colors[0] = 0;
+		colors[1] = 0;
+		colors[2] = 0;
+		int s;
+		for(s = 0; s < job->spp; s ++)
+		{
+			float sample[3];
+			float sample_rd[3];
+			vector_copy(rd, sample_rd);
+			seed_light_sampling(job->x0 + j, job->y0 + i, s);
+			primary_color(job, i, j, r0, sample_rd, sample);
+			add(sample, colors, colors);
+		}
+		scale(colors, 1.0 / job->spp, colors);
 	}
 
-	float added_color[3]; // from any transparency that might happen
-	// transparency stuff goes here
-	if(closest->e > 0)
+	store_pixel(job, i, j, colors);
+	if(job->heat != NULL)
+		end_heat(job, &heat, i, j);
+}
+
+// copy a traced pixel over the rest of its step by step block
+void fill_block(RenderJob* job, int i, int j)
+{
+	Pixel pixel = job->data[i * job->stride + j];
+	int bottom = min(i + job->step, job->height);
+	int right = min(j + job->step, job->width);
+
+	int y;
+	int x;
+	for(y = i; y < bottom; y ++)
 	{
-		// do some refraction
-		
-		float refracted_ray[3];
-		float new_point[3];
-		float n1 = 1;
-		float n2 = 1;
-		
-		if(dot(normal, rd) < 0) n2 = closest->b; else n1 = closest->b;
-		smellit(rd, normal, n1, n2, refracted_ray);
-		
-		// continue on through the object
-		add(intersection.point, refracted_ray, new_point);
-		get_color_ray(added_color, scene, new_point, refracted_ray, recursion - 1);
-		scale(added_color, closest->e, added_color);
-		added_color[0] = clamp(added_color[0], 0.0, 1.0);
-		added_color[1] = clamp(added_color[1], 0.0, 1.0);
-		added_color[2] = clamp(added_color[2], 0.0, 1.0);
-		number_contributors ++;
+		for(x = j; x < right; x ++)
+		{
+			job->data[y * job->stride + x] = pixel;
+		}
 	}
+}
 
-	// loop through the lights
-	int k;
-	for(k = 0; k < scene.num_lights; k ++)
-	{
-		Object light = scene.lights[k];
+void render_tile(Tile tile, void* data)
+{
+	RenderJob* job = data;
 
-		float light_dir[3];
-		float dir_to_light[3];
+	// the first pass always finishes so there is a complete image to show
+	if(job->deadline > 0 && !job->first_pass && now_seconds() > job->deadline)
+	{
+		__atomic_store_n(&job->expired, 1, __ATOMIC_RELAXED);
+		return;
+	}
 
-		// distance to light
-		float dist[3];
-		subtract(light.position, intersection.point, dist);
-		float distance_to_light = length(dist);
-		
-		subtract(intersection.point, light.position, light_dir);
-		normalize(light_dir);
-		scale(light_dir, -1, dir_to_light);
+	long rays = render_stats.rays;
+	int step = job->step;
 
-		// test for a shadow intersection
-		Intersection shadow;
-		send_ray(&shadow, scene, intersection.point, dir_to_light, intersection.object_id);
+	int i;
+	int j;
+	for(i = tile.y0; i < tile.y1; i += step)
+	{
+		for(j = tile.x0; j < tile.x1; j += step)
+		{
+			// pixels on the grid of the last pass already have their color
+			if(!job->first_pass && i % (2 * step) == 0 && j % (2 * step) == 0)
+				continue;
 
-		// if there is an object between this object and the light, don't light it
-		if(shadow.object_id != -1) {
-			// make sure that this object isn't actually behind the light
+			render_pixel(job, i, j);
+			if(step > 1)
+				fill_block(job, i, j);
+		}
+	}
 
-			subtract(shadow.point, intersection.point, dist);
-			float distance_to_object = length(dist);
+	__atomic_add_fetch(&job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
 
-			if(distance_to_light > distance_to_object)
-				continue;
-		}
+typedef struct {
+	const CompiledScene* scene;
+	const Light* light;
+	ShadowMap* map;
+	SendRayFunction send_ray;
+	long rays;
+} ShadowJob;
 
-		// (Xs - Xl) / ||Xs-Xl||
-		
-		float incident_light_level = dot(normal, dir_to_light);
+// the faces of a shadow map are stacked on top of each other so they can be tiled like an image
+void trace_shadow_tile(Tile tile, void* data)
+{
+	ShadowJob* job = data;
+	ShadowMap* map = job->map;
+	long rays = render_stats.rays;
 
-		if(incident_light_level > 0)
+	int y;
+	int x;
+	for(y = tile.y0; y < tile.y1; y ++)
+	{
+		for(x = tile.x0; x < tile.x1; x ++)
 		{
-			float Ic[3];
-			Ic[0] = 0;
-			Ic[1] = 0;
-			Ic[2] = 0;
-
-			// calculate attenuation
-				float ang_att = 1;
-				if(light.e != 0) // is spotlight
-				{
-					float att_dot = dot(light_dir, light.direction);
-					if(att_dot < light.e)
-						ang_att = 0;
-					else
-						ang_att = powf(att_dot, light.d);
-				}
-
-				float rad_att = 1 / 
-							(light.a * sqr(distance_to_light) + 
-								light.b * distance_to_light + light.c);
-
-				float attenuation = clamp(ang_att * rad_att, 0.0, 1.0);
-
-				float spec[3];
-				
-				// reflect the light normal across the surface normal
-				// r = d - 2(d*n)n
-				float r[3];
-				scale(normal, dot(light_dir, normal) * 2, r);
-				subtract(light_dir, r, r);
-
-				float v[3];
-				scale(rd, -1, v);
-
-				float speck = powf(dot(r, v), closest->a) * SPEC_K;
-				scale(light.color, speck, spec);
-				multiply(closest->specular, spec, spec);
-				
-			// do diffuse lighting
-				float diffuse[3];
-				scale(closest->color, incident_light_level * DIFFUSE_K, diffuse);
-				
-			if(speck > 0)
+			float r0[3];
+			float rd[3];
+			vector_copy(job->light->position, r0);
+			shadow_texel_direction(map, y / map->size, x, y % map->size, rd);
+
+			Intersection hit;
+			job->send_ray(&hit, job->scene, r0, rd, NULL);
+
+			float depth = INFINITY;
+			if(hit.object_id != -1)
 			{
-				add(spec, diffuse, Ic);
-				scale(Ic, attenuation, Ic);
+				float d[3];
+				subtract(hit.point, r0, d);
+				depth = length(d);
 			}
-			else
-				scale(diffuse, attenuation, Ic);
-
-			add(Ic, lighting, lighting);
+			map->depth[y * map->size + x] = depth;
 		}
 	}
 
-	float reflect_color[3];
-	scale(reflect_color,0,reflect_color);
-	// do reflection here
-	if(closest->c > 0)
+	__atomic_add_fetch(&job->rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+// traces a shadow map for every light, the rays are counted like any others
+ShadowMap* build_shadow_maps(const CompiledScene* scene, RenderOptions* options)
+{
+	ShadowMap* maps = malloc(sizeof(ShadowMap) * (scene->num_lights + 1));
+	SendRayFunction send = send_ray_kernels[scene_features(scene) & KERNEL_INSTANCES];
+
+	int k;
+	for(k = 0; k < scene->num_lights; k ++)
 	{
-		float reflect_r[3];
-		//scale(rd, -1, reflect_r);
-		vector_copy(rd, reflect_r);
-		scale(normal, dot(reflect_r, normal) * 2, reflect_r);
-		subtract(rd, reflect_r, reflect_r);
-		
-		float reflect_new_point[3];
-		add(intersection.point, reflect_r, reflect_new_point);
-		get_color_ray(reflect_color, scene, reflect_new_point, reflect_r, recursion - 1);
-		
-		scale(reflect_color, closest->c, reflect_color);
-		reflect_color[0] = clamp(reflect_color[0], 0.0, 1.0);
-		reflect_color[1] = clamp(reflect_color[1], 0.0, 1.0);
-		reflect_color[2] = clamp(reflect_color[2], 0.0, 1.0);
-		//number_contributors ++;
+		ShadowJob job;
+		job.scene = scene;
+		job.light = &scene->lights[k];
+		job.map = &maps[k];
+		job.send_ray = send;
+		job.rays = 0;
+
+		init_shadow_map(job.map, job.light, options->shadow_map_size);
+		run_tiles(job.map->size, job.map->size * job.map->faces, options->tile_size, 1, ORDER_ROWS,
+			options->num_threads, trace_shadow_tile, &job);
+		render_stats.rays += job.rays;
 	}
+	return maps;
+}
 
-	//scale(lighting, 1 - (closest->e), lighting);
+void free_shadow_maps(ShadowMap* maps, int count)
+{
+	int k;
+	for(k = 0; k < count; k ++)
+		free_shadow_map(&maps[k]);
+	free(maps);
+}
 
-	vector_copy(lighting, color);
-	add(added_color, color, color);
-	add(reflect_color, color, color);
+// make a pass visible: readers of the framebuffer see a whole pass at a time,
+// and the output file is replaced in one rename so it is never half written.
+// outfile is NULL when only the framebuffer is wanted
+void publish_pass(RenderJob* job, char* outfile, PPMmeta fileinfo, Framebuffer* display)
+{
+	Pixel* image = job->data;
+	if(job->width != fileinfo.width || job->height != fileinfo.height)
+	{
+		image = malloc(sizeof(Pixel) * fileinfo.width * fileinfo.height);
+		upscale_image(job->data, job->width, job->height, image, fileinfo.width, fileinfo.height);
+	}
 
-	scale(color, 1/number_contributors, color);
+	if(display != NULL)
+	{
+		pthread_mutex_lock(&display->lock);
+		memcpy(display->pixels, image, sizeof(Pixel) * fileinfo.width * fileinfo.height);
+		display->generation ++;
+		pthread_mutex_unlock(&display->lock);
+	}
+
+	if(outfile != NULL)
+	{
+		double write_start = now_seconds();
+		char temp[strlen(outfile) + 8];
+		sprintf(temp, "%s.part", outfile);
+		if(WritePPM(image, temp, fileinfo) == 0)
+			rename(temp, outfile);
+		trace_span("write pass", write_start);
+	}
+
+	if(image != job->data)
+		free(image);
+}
+
+// picks how much smaller than the output the preview is rendered, so that a frame fits in
+// options->preview_target seconds. a tiny probe frame gives the cost of one pixel.
+int preview_divisor(RenderJob* job, PPMmeta fileinfo, RenderOptions* options)
+{
+	if(options->preview_target <= 0)
+		return options->preview_divisor;
+
+	RenderJob probe = *job;
+	probe.width = max(fileinfo.width / 16, 1);
+	probe.height = max(fileinfo.height / 16, 1);
+	probe.stride = probe.width;
+	probe.pixel_width = job->scene->camera_width / probe.width;
+	probe.pixel_height = job->scene->camera_height / probe.height;
+	probe.data = malloc(sizeof(Pixel) * probe.width * probe.height);
+
+	double start = now_seconds();
+	run_tiles(probe.width, probe.height, options->tile_size, 1, options->tile_order, options->num_threads, render_tile, &probe);
+	double per_pixel = (now_seconds() - start) / (probe.width * probe.height);
+	free(probe.data);
+
+	int divisor = 1;
+	while(divisor < 64 && per_pixel * (fileinfo.width / divisor) * (fileinfo.height / divisor) > options->preview_target)
+		divisor *= 2;
+	return divisor;
+}
+
+#include "gbuffer.c"
+#include "wavefront.c"
+#include "checkpoint.c"
+
+// the settings for a frame go into a copy of the scene header, the object and light
+// arrays are shared. preview here only lowers the quality of each ray.
+// returns the shadow maps built for the frame, for the caller to free
+ShadowMap* setup_frame(RenderJob* job, CompiledScene* frame_scene, const CompiledScene* scene, RenderOptions* options)
+{
+	*frame_scene = *scene;
+	job->scene = frame_scene;
+
+	ShadowMap* shadow_maps = NULL;
+	if(options->shadow_map_size > 0)
+	{
+		shadow_maps = build_shadow_maps(scene, options);
+		frame_scene->shadow_maps = shadow_maps;
+		frame_scene->shadow_bias = options->shadow_bias;
+	}
+
+	// preview: shallower rays, no refraction and only the strongest lights
+	if(options->preview)
+	{
+		frame_scene->skip_refraction = 1;
+		frame_scene->max_shaded_lights = options->preview_lights;
+		job->max_depth = options->preview_depth;
+	}
+	// light sampling is noisy, more samples per pixel average it out
+	frame_scene->light_samples = options->light_samples;
+	job->spp = options->light_samples > 0 ? max(options->spp, 1) : 1;
+
+	job->color_ray = color_ray_kernels[scene_features(frame_scene)];
+	job->color_hit = color_hit_kernels[scene_features(frame_scene)];
+	job->bins = NULL;
+	job->heat = NULL;
+	job->heat_metric = options->heat_metric;
+	return shadow_maps;
 }
 
-void raycast(Scene scene, char* outfile, PPMmeta fileinfo)
+// renders a frame into outfile. a progressive render into options->display can leave outfile NULL
+void raycast(const CompiledScene* scene, char* outfile, PPMmeta fileinfo, RenderOptions* options)
 {
 	Pixel* data = malloc(sizeof(Pixel) * fileinfo.width * fileinfo.height);
 	
 	// raycasting here
 	
-	int N = fileinfo.width;
-	int M = fileinfo.height;
-	float w = scene.camera_width;
-	float h = scene.camera_height;
-	
-	float pixel_height = h / M;
-	float pixel_width = w / N;
-	
-	float p_z = 0;
-	
-	float c_x = 0;
-	float c_y = 0;
-	float c_z = 0;
-	
-	float r0[3];
-	r0[0] = c_x;
-	r0[1] = c_y;
-	r0[2] = c_z;
-	
-	float rd[3];
-	rd[2] = 1;
-	
-	int i;
-	int j;
-	int k;
-	
-	for(i = 0; i < M; i ++)
+	RenderJob job;
+	job.scene = scene;
+	job.data = data;
+	job.width = fileinfo.width;
+	job.height = fileinfo.height;
+	job.max_depth = 7;
+	job.step = 1;
+	job.x0 = 0;
+	job.y0 = 0;
+	job.first_pass = 1;
+	job.deadline = 0;
+	job.expired = 0;
+	job.stats.rays = 0;
+
+	CompiledScene frame_scene;
+	ShadowMap* shadow_maps = setup_frame(&job, &frame_scene, scene, options);
+
+	// preview also renders fewer pixels and scales them up
+	if(options->preview)
+	{
+		int divisor = preview_divisor(&job, fileinfo, options);
+		job.width = max(fileinfo.width / divisor, 1);
+		job.height = max(fileinfo.height / divisor, 1);
+	}
+	job.stride = job.width;
+	job.pixel_width = scene->camera_width / job.width;
+	job.pixel_height = scene->camera_height / job.height;
+	frame_scene.pixel_size = job.pixel_width;
+
+	long rays = render_stats.rays;
+
+	// the heatmap is filled in by render_pixel, so only tiled renders have one
+	if(options->heatmap != NULL && (options->gbuffer != NULL || options->wavefront))
+		fprintf(stderr, "Warning: no heatmap with --gbuffer or --wavefront\n");
+	else if(options->heatmap != NULL)
+		job.heat = calloc(job.width * job.height, sizeof(float));
+
+	// lights are sampled in render_pixel, the other ways of rendering shade all of them
+	if(options->light_samples > 0 && (options->gbuffer != NULL || options->wavefront))
+		fprintf(stderr, "Warning: no --light-samples or --spp with --gbuffer or --wavefront, every light is shaded\n");
+
+	// checkpoints keep finished tiles, the other ways of rendering don't have any
+	if(options->checkpoint != NULL && (options->progressive || options->gbuffer != NULL || options->wavefront))
+		fprintf(stderr, "Warning: no checkpoints with --progressive, --gbuffer or --wavefront\n");
+
+	if(!options->progressive || options->gbuffer != NULL || options->wavefront)
 	{
-		rd[1] = -r0[1] + h/2.0 - pixel_height * (i + 0.5);
-		
-		for(j = 0; j < N; j ++)
+		if(options->gbuffer != NULL)
+			render_gbuffer(&job, options);
+		else if(options->wavefront)
+			render_wavefront(&job, options);
+		else
+		{
+			PrimaryBins* bins = build_primary_bins(&job);
+			job.bins = bins;
+			if(options->checkpoint != NULL)
+				render_checkpointed(&job, scene, options);
+			else
+				run_tiles(job.width, job.height, options->tile_size, 1, options->tile_order, options->num_threads, render_tile, &job);
+			free_primary_bins(bins);
+		}
+		render_stats.rays = rays + job.stats.rays;
+
+		if(job.width != fileinfo.width || job.height != fileinfo.height)
 		{
-			rd[0] = r0[0] - w/2.0 + pixel_width * (j + 0.5);
-			
-			float colors[3];
-
-			get_color_ray(colors, scene, r0, rd, 7);
-
-			colors[0] = clamp(colors[0], 0.0, 1.0);
-			colors[1] = clamp(colors[1], 0.0, 1.0);
-			colors[2] = clamp(colors[2], 0.0, 1.0);
-
-			Pixel pixel = data[i * N + j];
-			pixel.r = (unsigned char) (colors[0] * 255);
-			pixel.g = (unsigned char) (colors[1] * 255);
-			pixel.b = (unsigned char) (colors[2] * 255);
-			data[i * N + j] = pixel;
-			
+			Pixel* full = malloc(sizeof(Pixel) * fileinfo.width * fileinfo.height);
+			upscale_image(data, job.width, job.height, full, fileinfo.width, fileinfo.height);
+			free(data);
+			data = full;
 		}
-		
+
+		if(options->writer != NULL)
+		{
+			// the writer frees it once it is written
+			queue_image(options->writer, data, outfile, fileinfo);
+			data = NULL;
+		}
+		else
+		{
+			perf_phase("write");
+			double write_start = now_seconds();
+			if(WritePPM(data, outfile, fileinfo) == 0 && options->checkpoint != NULL)
+				remove_checkpoint(options);
+			if(job.heat != NULL)
+				write_heatmap(&job, options->heatmap, fileinfo);
+			trace_span("write", write_start);
+		}
+		free(job.heat);
+		free(data);
+		if(shadow_maps != NULL)
+			free_shadow_maps(shadow_maps, scene->num_lights);
+		return;
 	}
-	
-	WritePPM(data, outfile, fileinfo);
-}
\ No newline at end of file
+
+	// progressive: start with one traced pixel per coarse_step block and halve the step each pass
+	int coarse_step = 1;
+	while(coarse_step * 2 <= options->coarse_step)
+		coarse_step *= 2;
+
+	// tiles have to line up with the coarsest blocks
+	int tile_size = (options->tile_size + coarse_step - 1) / coarse_step * coarse_step;
+
+	if(options->time_budget > 0)
+		job.deadline = now_seconds() + options->time_budget;
+
+	PrimaryBins* bins = build_primary_bins(&job);
+	job.bins = bins;
+	for(job.step = coarse_step; job.step >= 1; job.step /= 2)
+	{
+		run_tiles(job.width, job.height, tile_size, job.step, options->tile_order, options->num_threads, render_tile, &job);
+		publish_pass(&job, outfile, fileinfo, options->display);
+
+		if(job.expired)
+		{
+			if(outfile != NULL)
+				fprintf(stderr, "Time budget reached, stopped during the %d pixel pass\n", job.step);
+			break;
+		}
+		job.first_pass = 0;
+	}
+	render_stats.rays = rays + job.stats.rays;
+
+	free_primary_bins(bins);
+	if(job.heat != NULL)
+		write_heatmap(&job, options->heatmap, fileinfo);
+	free(job.heat);
+	free(data);
+	if(shadow_maps != NULL)
+		free_shadow_maps(shadow_maps, scene->num_lights);
+}
+
+
+// renders the pixels x0 <= x < x1, y0 <= y < y1 of a width by height image into out,
+// which has stride pixels per row. the region is always rendered at full size.
+void render_region(const CompiledScene* scene, int width, int height, int x0, int y0, int x1, int y1,
+	Pixel* out, int stride, RenderOptions* options)
+{
+	RenderJob job;
+	job.data = out;
+	job.width = x1 - x0;
+	job.height = y1 - y0;
+	job.x0 = x0;
+	job.y0 = y0;
+	job.stride = stride;
+	job.pixel_width = scene->camera_width / width;
+	job.pixel_height = scene->camera_height / height;
+	job.max_depth = 7;
+	job.step = 1;
+	job.first_pass = 1;
+	job.deadline = 0;
+	job.expired = 0;
+	job.stats.rays = 0;
+
+	CompiledScene frame_scene;
+	ShadowMap* shadow_maps = setup_frame(&job, &frame_scene, scene, options);
+	frame_scene.pixel_size = job.pixel_width;
+
+	PrimaryBins* bins = build_primary_bins(&job);
+	job.bins = bins;
+
+	long rays = render_stats.rays;
+	run_tiles(job.width, job.height, options->tile_size, 1, options->tile_order, options->num_threads, render_tile, &job);
+	render_stats.rays = rays + job.stats.rays;
+
+	free_primary_bins(bins);
+	if(shadow_maps != NULL)
+		free_shadow_maps(shadow_maps, scene->num_lights);
+}
+
+#include "tiles.c"
+#include "estimate.c"
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+
+#define MAX_OBJECTS 128
+#define MAX_GROUPS 64
+
+// surface properties, only looked at once a ray has hit something
+typedef struct {
+	float diffuse[3];
+	float specular[3];
+	float shininess;
+	float ior;
+	float reflectivity;
+	float refractivity;
+	int diffuse_texture; // index into CompiledScene.textures, -1 for none
+	int specular_texture;
+	float texture_scale; // scene units one repeat of a texture covers on planes and meshes
+} Material;
+
+typedef struct {
+	int kind;
+	float color[3]; // also diffuse color for non-lights
+	float position[3];
+	float direction[3]; // for lights only
+	float a, b, c, d, e;
+	float specular[3];
+	Material material; // for non-lights
+	int group; // 0 if the object is in the scene itself, otherwise 1 + its group
+	char* file; // meshes only
+	char* textures[2]; // diffuse and specular image files, NULL for none
+} Object;
+
+// a copy of a group of objects, moved, turned and scaled into place
+typedef struct {
+	int group; // 1 + index into Scene.group_names
+	float position[3];
+	float rotation[3]; // degrees about x, then y, then z
+	float scale;
+	int overrides; // OVERRIDE_* bits, which fields of material replace the group's own
+	Material material;
+} Instance;
+
+typedef struct {
+	int num_objects;
+	Object objects[MAX_OBJECTS + 1];
+	int num_lights;
+	int light_capacity;
+	Object* lights;
+	float camera_width;
+	float camera_height;
+	float ambient_color[3]; // for fun!
+	int num_groups;
+	char* group_names[MAX_GROUPS];
+	int num_instances;
+	int instance_capacity;
+	Instance* instances;
+	// strings the parser is holding on to, so free_scene finds them if reading fails
+	char* reading_key;
+	char* reading_group;
+	float* reading_points; // of a path generator
+} Scene;
+
+// the shape of an object, everything send_ray reads while looking for the closest hit
+typedef struct {
+	int kind;
+	float position[3]; // center of spheres and cylinders
+	float normal[3]; // plane normal, first basis vector of cylinders
+	float basis2[3]; // second basis vector of cylinders
+	float radius; // spheres and cylinders
+	float offset; // planes
+	int mesh; // index into CompiledScene.meshes
+	// the same for every ray from the camera, worked out once by compile_object
+	float radius2; // radius squared
+	float eye_c; // C of the quadratic for a ray from the origin
+	float eye_dot[2]; // position along normal and basis2 of cylinders
+} Geometry;
+
+typedef struct {
+	float lo[3];
+	float hi[3];
+	int first; // inner nodes: the left child, the right one comes after it. leaves: index into Mesh.order
+	int count; // triangles in a leaf, 0 for inner nodes
+} BVHNode;
+
+// an indexed triangle mesh. for binary mesh files vertices and triangles point
+// straight into the memory mapped file, for obj files they are owned copies
+typedef struct {
+	int num_vertices;
+	int num_triangles;
+	const float* vertices; // x, y, z for each vertex
+	const unsigned int* triangles; // three vertex indexes for each triangle
+	unsigned int* order; // triangle indexes, in the order the bvh leaves refer to them
+	BVHNode* nodes;
+	int num_nodes;
+	void* map;
+	size_t map_size;
+	float* owned_vertices;
+	unsigned int* owned_triangles;
+} Mesh;
+
+#define TEXTURE_LEVELS 16
+
+// one mip level of a texture, cut into tiles that are stored row by row
+typedef struct {
+	int width;
+	int height;
+	int columns; // tiles across
+	int first_tile; // counted over all the levels, in the order they are stored
+} TextureLevel;
+
+// an image a material takes its colors from. only the tiles of its levels are kept,
+// in a temporary file, and read back through the texture cache as they are needed
+typedef struct {
+	char* path;
+	uint32_t id; // tags its tiles in the cache, never reused
+	int num_levels; // level 0 is the image, each next one half as big
+	TextureLevel levels[TEXTURE_LEVELS];
+	FILE* store;
+	uint64_t hash; // of the image's pixels
+} Texture;
+
+// objects first..first+count-1 of the geometry and material arrays
+typedef struct {
+	int first;
+	int count;
+	float bound_center[3]; // a sphere around all of them, in group space
+	float bound_radius; // INFINITY if a plane or cylinder makes the group unbounded
+} GeometryGroup;
+
+// a placed instance of a group. rays are moved into group space rather than
+// copying the group's geometry, so memory only grows with the unique geometry
+typedef struct {
+	int group;
+	float rotation[3][3]; // group space to world space, without the scale
+	float position[3];
+	float scale;
+	float bound_center[3]; // world space
+	float bound_radius;
+	int overrides;
+	Material material;
+} Placement;
+
+typedef struct {
+	float color[3];
+	float position[3];
+	float direction[3]; // spotlights only
+	float radial_a0, radial_a1, radial_a2;
+	float angular_a0;
+	float cos_theta; // cosine of the spotlight cone, 0 for point lights
+} Light;
+
+// distance from a light to the nearest surface in every direction, traced once per frame.
+// point lights get the six faces of a cube, spotlights one face covering the cone.
+typedef struct {
+	int faces;
+	int size; // texels along each edge of a face
+	float extent; // tangent of the half angle a face covers
+	float basis[6][3][3]; // forward, right and up of each face
+	float* depth;
+} ShadowMap;
+
+// the scene as the renderer sees it, built once by compile_scene and then only read.
+// geometry[k] and materials[k] belong to the same object. the first num_objects
+// are in the scene itself, the objects of the groups come after them.
+typedef struct {
+	int num_objects;
+	Geometry* geometry;
+	Material* materials;
+	int num_groups;
+	GeometryGroup* groups;
+	int num_placements;
+	Placement* placements;
+	int num_meshes;
+	Mesh* meshes;
+	int num_textures;
+	Texture* textures;
+	int num_lights;
+	Light* lights;
+	float camera_width;
+	float camera_height;
+	float ambient_color[3];
+	int skip_refraction; // quality settings, filled in by raycast
+	int max_shaded_lights; // 0 shades every light
+	const ShadowMap* shadow_maps; // one per light, NULL traces shadow rays instead
+	float shadow_bias;
+	int light_samples; // lights sampled per point, 0 shades every light
+	float* light_cdf; // running total of the lights' brightness, to draw sample candidates from
+	float pixel_size; // width of a pixel on the image plane, picks texture mip levels. 0 for the sharpest
+} CompiledScene;
+
+typedef struct {
+	float point[3];
+	int object_id;
+	int instance; // index of the placement that was hit, -1 for objects in the scene itself
+	int primitive; // triangle of a mesh, -1 for everything else
+} Intersection;
+
+// counters filled in while rendering, used for reporting rays/sec
+// each thread counts into its own copy
+typedef struct {
+	long rays;
+	long shadow_rays; // the part of rays sent towards lights
+	long tests; // intersections of a ray with a shape or a triangle
+	int min_recursion; // the lowest recursion a surface was hit at, for the heatmap
+} RenderStats;
+
+__thread RenderStats render_stats;
+
+// settings that control how a frame is rendered, not what is in it
+typedef struct Framebuffer Framebuffer;
+typedef struct ImageWriter ImageWriter;
+
+typedef struct {
+	int num_threads;
+	int tile_size;
+	int tile_order;
+	int progressive; // render coarse to fine, writing the output after each pass
+	int coarse_step; // pixel spacing of the first progressive pass
+	double time_budget; // seconds, 0 for no limit
+	Framebuffer* display; // if set, progressive passes are copied here as they finish
+	int preview; // low quality tier for interactive layout work
+	int preview_divisor; // preview renders at 1/divisor of the output size and scales up
+	int preview_depth; // recursion limit in preview
+	int preview_lights; // lights shaded per point in preview
+	double preview_target; // seconds per frame, picks the divisor when set
+	int shadow_map_size; // texels per face edge, 0 traces a shadow ray for every light
+	float shadow_bias; // depth offset in scene units against shadow acne
+	char* gbuffer; // file to relight the frame from, traced first if it is missing or stale
+	int wavefront; // trace a bounce of all rays at a time instead of a pixel at a time
+	int light_samples; // shade this many lights picked at random per point, 0 for all of them
+	int spp; // samples per pixel with light sampling, averaged
+	char* heatmap; // file to write what every pixel cost to, NULL for none
+	int heat_metric; // HEAT_*, the cost it shows
+	char* checkpoint; // file to save finished tiles to while rendering, NULL for none
+	double checkpoint_interval; // seconds between saves
+	int resume; // start from the tiles in the checkpoint
+	ImageWriter* writer; // if set, whole frames are queued on it and written in the background
+} RenderOptions;
+
+// a scene that can't be loaded ends the program, unless the thread has pointed
+// scene_error_jump somewhere to go back to, then the message is kept for the caller
+__thread jmp_buf* scene_error_jump;
+__thread char scene_error_message[256];
+
+__attribute__((noreturn)) void scene_error(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	if(scene_error_jump == NULL)
+	{
+		vfprintf(stderr, format, args);
+		exit(1);
+	}
+
+	vsnprintf(scene_error_message, sizeof(scene_error_message), format, args);
+	va_end(args);
+
+	int end = strlen(scene_error_message);
+	if(end > 0 && scene_error_message[end - 1] == '\n')
+		scene_error_message[end - 1] = 0;
+	longjmp(*scene_error_jump, 1);
+}
+
+double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define HASH_START 14695981039346656037ULL
+
+// fnv-1a
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = data;
+	size_t k;
+	for(k = 0; k < size; k ++)
+	{
+		hash ^= bytes[k];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+#include "3dmath.c"
+#include "imageread.c"
+#include "mesh.c"
+#include "framebuffer.c"
+#include "jsonread.c"
+#include "texture.c"
+#include "compile.c"
+#include "trace.c"
+#include "scheduler.c"
+#include "perf.c"
+#include "writer.c"
+#include "shadowmap.c"
+#include "raycast.c"
+
+void default_render_options(RenderOptions* options)
+{
+	options->num_threads = default_thread_count();
+	options->tile_size = 16;
+	options->tile_order = ORDER_HILBERT;
+	options->progressive = 0;
+	options->coarse_step = 8;
+	options->time_budget = 0;
+	options->display = NULL;
+	options->preview = 0;
+	options->preview_divisor = 2;
+	options->preview_depth = 2;
+	options->preview_lights = 2;
+	options->preview_target = 0;
+	options->shadow_map_size = 0;
+	options->shadow_bias = 0.05;
+	options->gbuffer = NULL;
+	options->wavefront = 0;
+	options->light_samples = 0;
+	options->spp = 1;
+	options->heatmap = NULL;
+	options->heat_metric = HEAT_RAYS;
+	options->checkpoint = NULL;
+	options->checkpoint_interval = 60;
+	options->resume = 0;
+	options->writer = NULL;
+}
+
+// anything that has to happen to a scene after it is read in and before it is rendered.
+// if it fails compiled keeps what was done so far, for free_compiled_scene
+void setup_scene(Scene* scene, CompiledScene* compiled)
+{
+	scene->ambient_color[0] = 0.15;
+	scene->ambient_color[1] = 0.15;
+	scene->ambient_color[2] = 0.15;
+
+	compile_scene(scene, compiled);
+}
+
+// reads and sets up the scene in json, for callers that go on after a bad scene. returns
+// NULL with the reason in scene_error_message if it fails, with everything freed again
+CompiledScene* load_scene_stream(FILE* json, char* path)
+{
+	jmp_buf jump;
+	Scene* volatile scene = calloc(1, sizeof(Scene));
+	CompiledScene* volatile compiled = calloc(1, sizeof(CompiledScene));
+
+	scene_error_jump = &jump;
+	if(setjmp(jump) != 0)
+	{
+		scene_error_jump = NULL;
+		free_scene(scene);
+		free(scene);
+		free_compiled_scene(compiled);
+		return NULL;
+	}
+
+	read_scene_stream(json, path, scene);
+	setup_scene(scene, compiled);
+	scene_error_jump = NULL;
+
+	free_scene(scene);
+	free(scene);
+	return compiled;
+}
+
+#include "batch.c"
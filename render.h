@@ -0,0 +1,62 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+
+// the renderer as a library, see librender.c
+// link with librender.a or librender.so and -lm -lpthread.
+// different scenes can be loaded, rendered and freed from different threads at the
+// same time. a loaded scene is only read while rendering, so one scene can also be
+// rendered from several threads at once.
+
+typedef struct RTScene RTScene;
+
+typedef struct {
+	int threads; // threads each render uses, 0 for all cores
+	int tile_size; // edge length of a tile in pixels
+	int preview; // cheaper rays: 2 bounces, no refraction, the 2 most important lights
+	int shadow_map_size; // look shadows up in maps this big, 0 traces shadow rays
+	float shadow_bias; // shadow map depth bias in scene units
+	int light_samples; // shade this many lights picked at random per point, 0 for all of them
+	int spp; // samples averaged per pixel when light_samples is set
+	int coarse_step; // pixel spacing of the first pass of rt_render_progressive
+	double time_budget; // seconds rt_render_progressive refines for, 0 for no limit
+} RTOptions;
+
+void rt_default_options(RTOptions* options);
+
+// both return NULL if the scene can't be loaded, with a message in error if it isn't NULL.
+// files a scene refers to, like meshes, are looked up next to the scene file, or in
+// base_dir for a scene in memory (the working directory if base_dir is NULL)
+RTScene* rt_load_scene_file(const char* path, char* error, int error_size);
+RTScene* rt_load_scene_memory(const char* json, size_t length, const char* base_dir, char* error, int error_size);
+
+// render a width by height image into rgb, 3 bytes per pixel, one row after another.
+// options may be NULL for the defaults. return 0, or -1 if the arguments make no sense
+int rt_render(const RTScene* scene, int width, int height, unsigned char* rgb, const RTOptions* options);
+
+// render only the pixels x0 <= x < x1, y0 <= y < y1 of a width by height image.
+// rgb gets the region, with stride pixels from the start of one row to the next
+int rt_render_region(const RTScene* scene, int width, int height, int x0, int y0, int x1, int y1,
+	unsigned char* rgb, int stride, const RTOptions* options);
+
+void rt_free_scene(RTScene* scene);
+
+// an image that a progressive render refines while other threads look at it
+typedef struct RTFramebuffer RTFramebuffer;
+
+RTFramebuffer* rt_create_framebuffer(int width, int height);
+
+// copies the latest pass into rgb, width * height * 3 bytes. a snapshot is always one
+// whole pass. returns how many passes the framebuffer has had, 0 if none yet and rgb is black
+int rt_framebuffer_snapshot(RTFramebuffer* framebuffer, unsigned char* rgb);
+
+// renders the framebuffer's size coarse to fine: one pixel per coarse_step block first,
+// then passes with half the spacing until every pixel is traced, or until time_budget
+// is up. the first pass always finishes. returns the number of passes, or -1 if the
+// arguments make no sense
+int rt_render_progressive(const RTScene* scene, RTFramebuffer* framebuffer, const RTOptions* options);
+
+void rt_free_framebuffer(RTFramebuffer* framebuffer);
+
+#endif
@@ -0,0 +1,460 @@
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// work stealing tile scheduler
+// the image is cut into tiles, the tiles are put in order along a curve and
+// handed out in contiguous runs to each thread's deque. a thread works through
+// its own deque from the bottom and steals from the top of the others when it
+// runs dry. near the end of the frame tiles are split up so that the last
+// expensive tile doesn't leave the other threads idle.
+
+#define ORDER_ROWS 0
+#define ORDER_MORTON 1
+#define ORDER_HILBERT 2
+
+#define MIN_SPLIT_SIZE 4
+
+typedef struct {
+	int x0, y0; // inclusive
+	int x1, y1; // exclusive
+	long key; // position along the traversal curve
+} Tile;
+
+typedef void (*TileFunction)(Tile tile, void* data);
+
+typedef struct {
+	Tile* tiles;
+	int capacity;
+	int top; // thieves take from here
+	int bottom; // the owner pushes and pops here
+	pthread_mutex_t lock;
+} TileDeque;
+
+typedef struct {
+	int num_threads;
+	int align; // tiles are only split on multiples of this
+	TileDeque* deques;
+	int remaining; // tiles in the deques that nobody has started
+	int outstanding; // tiles that were queued and haven't finished
+	TileFunction function;
+	void* data;
+} TileScheduler;
+
+typedef struct {
+	TileScheduler* scheduler;
+	int id;
+} TileWorker;
+
+int default_thread_count()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+int parse_tile_order(char* name)
+{
+	if(strcmp(name, "rows") == 0) return ORDER_ROWS;
+	if(strcmp(name, "morton") == 0) return ORDER_MORTON;
+	if(strcmp(name, "hilbert") == 0) return ORDER_HILBERT;
+	return -1;
+}
+
+// interleave the bits of x and y
+long morton_index(int x, int y)
+{
+	long key = 0;
+	int b;
+	for(b = 0; b < 16; b ++)
+	{
+		key |= (long) ((x >> b) & 1) << (2 * b);
+		key |= (long) ((y >> b) & 1) << (2 * b + 1);
+	}
+	return key;
+}
+
+// distance along a hilbert curve covering an n by n grid, n a power of two
+long hilbert_index(int n, int x, int y)
+{
+	long key = 0;
+	int s;
+	for(s = n / 2; s > 0; s /= 2)
+	{
+		int rx = (x & s) > 0;
+		int ry = (y & s) > 0;
+		key += (long) s * s * ((3 * rx) ^ ry);
+
+		// rotate the quadrant so the curve stays continuous
+		if(ry == 0)
+		{
+			if(rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			int t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return key;
+}
+
+int compare_tiles(const void* a, const void* b)
+{
+	long ka = ((Tile*) a)->key;
+	long kb = ((Tile*) b)->key;
+	return ka < kb ? -1 : ka > kb;
+}
+
+void deque_push(TileDeque* deque, Tile tile)
+{
+	pthread_mutex_lock(&deque->lock);
+	if(deque->bottom == deque->capacity)
+	{
+		// slide everything down before growing
+		int count = deque->bottom - deque->top;
+		if(deque->top > 0)
+			memmove(deque->tiles, deque->tiles + deque->top, sizeof(Tile) * count);
+		else
+		{
+			deque->capacity = deque->capacity * 2 + 4;
+			deque->tiles = realloc(deque->tiles, sizeof(Tile) * deque->capacity);
+		}
+		deque->top = 0;
+		deque->bottom = count;
+	}
+	deque->tiles[deque->bottom] = tile;
+	deque->bottom ++;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// returns 1 if a tile was taken from the bottom
+int deque_pop(TileDeque* deque, Tile* tile)
+{
+	int found = 0;
+	pthread_mutex_lock(&deque->lock);
+	if(deque->bottom > deque->top)
+	{
+		deque->bottom --;
+		*tile = deque->tiles[deque->bottom];
+		found = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// returns 1 if a tile was taken from the top
+int deque_steal(TileDeque* deque, Tile* tile)
+{
+	int found = 0;
+	pthread_mutex_lock(&deque->lock);
+	if(deque->bottom > deque->top)
+	{
+		*tile = deque->tiles[deque->top];
+		deque->top ++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+int next_tile(TileScheduler* s, int id, Tile* tile)
+{
+	while(1)
+	{
+		if(deque_pop(&s->deques[id], tile))
+			return 1;
+
+		int k;
+		for(k = 1; k < s->num_threads; k ++)
+		{
+			if(deque_steal(&s->deques[(id + k) % s->num_threads], tile))
+				return 1;
+		}
+
+		// a tile being worked on might still be split, so only stop once everything is done
+		if(__atomic_load_n(&s->outstanding, __ATOMIC_ACQUIRE) == 0)
+			return 0;
+		sched_yield();
+	}
+}
+
+// function on one tile, recorded in the trace
+void run_tile(TileFunction function, Tile tile, void* data)
+{
+	double start = trace_path != NULL ? now_seconds() : 0;
+	long rays = render_stats.rays;
+	function(tile, data);
+	trace_tile(tile.x0, tile.y0, tile.x1, tile.y1, render_stats.rays - rays, start);
+}
+
+void* tile_worker(void* arg)
+{
+	TileWorker* worker = arg;
+	TileScheduler* s = worker->scheduler;
+	Tile tile;
+	trace_tid = worker->id;
+
+	while(next_tile(s, worker->id, &tile))
+	{
+		int remaining = __atomic_sub_fetch(&s->remaining, 1, __ATOMIC_ACQ_REL);
+
+		// running out of work, cut the tile into quarters and leave three for the others
+		int w = tile.x1 - tile.x0;
+		int h = tile.y1 - tile.y0;
+		int mx = tile.x0 + (w / 2) / s->align * s->align;
+		int my = tile.y0 + (h / 2) / s->align * s->align;
+		if(s->num_threads > 1 && remaining < s->num_threads && w >= 2 * MIN_SPLIT_SIZE && h >= 2 * MIN_SPLIT_SIZE
+			&& mx > tile.x0 && my > tile.y0)
+		{
+			Tile quarter = tile;
+
+			__atomic_add_fetch(&s->outstanding, 3, __ATOMIC_ACQ_REL);
+			__atomic_add_fetch(&s->remaining, 3, __ATOMIC_ACQ_REL);
+
+			quarter.x0 = mx; quarter.y0 = my; quarter.x1 = tile.x1; quarter.y1 = tile.y1;
+			deque_push(&s->deques[worker->id], quarter);
+			quarter.x0 = tile.x0; quarter.y0 = my; quarter.x1 = mx; quarter.y1 = tile.y1;
+			deque_push(&s->deques[worker->id], quarter);
+			quarter.x0 = mx; quarter.y0 = tile.y0; quarter.x1 = tile.x1; quarter.y1 = my;
+			deque_push(&s->deques[worker->id], quarter);
+
+			tile.x1 = mx;
+			tile.y1 = my;
+		}
+
+		run_tile(s->function, tile, s->data);
+		__atomic_sub_fetch(&s->outstanding, 1, __ATOMIC_ACQ_REL);
+	}
+
+	return NULL;
+}
+
+// threads kept between calls of run_tiles, so a batch of renders doesn't start and join a
+// set of threads for every frame, pass and shadow map. the helpers sleep until run_tiles
+// hands them a scheduler, and work on it next to the calling thread like started ones do
+typedef struct {
+	int num_threads; // counting the thread that calls run_tiles
+	pthread_t* threads;
+	TileWorker* workers;
+	pthread_mutex_t run_lock; // held by the run_tiles using the pool, others start threads
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	TileScheduler* scheduler; // the run to join
+	long generation; // counts the runs, helpers join each one once
+	int busy; // helpers still working on the run
+	int stop;
+} TilePool;
+
+TilePool* tile_pool = NULL;
+
+void* pool_worker(void* arg)
+{
+	TileWorker* worker = arg;
+	long seen = 0;
+
+	pthread_mutex_lock(&tile_pool->lock);
+	while(1)
+	{
+		while(!tile_pool->stop && tile_pool->generation == seen)
+			pthread_cond_wait(&tile_pool->changed, &tile_pool->lock);
+		if(tile_pool->stop)
+			break;
+		seen = tile_pool->generation;
+		worker->scheduler = tile_pool->scheduler;
+		pthread_mutex_unlock(&tile_pool->lock);
+
+		tile_worker(worker);
+
+		pthread_mutex_lock(&tile_pool->lock);
+		if(-- tile_pool->busy == 0)
+			pthread_cond_broadcast(&tile_pool->changed);
+	}
+	pthread_mutex_unlock(&tile_pool->lock);
+	return NULL;
+}
+
+// from now on run_tiles with num_threads threads uses the same ones every time
+void start_tile_pool(int num_threads)
+{
+	if(num_threads < 2 || tile_pool != NULL)
+		return;
+
+	TilePool* pool = calloc(1, sizeof(TilePool));
+	pool->num_threads = num_threads;
+	pool->threads = malloc(sizeof(pthread_t) * num_threads);
+	pool->workers = malloc(sizeof(TileWorker) * num_threads);
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->changed, NULL);
+	tile_pool = pool;
+
+	int t;
+	for(t = 1; t < num_threads; t ++)
+	{
+		pool->workers[t].id = t;
+		pthread_create(&pool->threads[t], NULL, pool_worker, &pool->workers[t]);
+	}
+}
+
+void stop_tile_pool()
+{
+	if(tile_pool == NULL)
+		return;
+
+	pthread_mutex_lock(&tile_pool->lock);
+	tile_pool->stop = 1;
+	pthread_cond_broadcast(&tile_pool->changed);
+	pthread_mutex_unlock(&tile_pool->lock);
+
+	int t;
+	for(t = 1; t < tile_pool->num_threads; t ++)
+		pthread_join(tile_pool->threads[t], NULL);
+
+	pthread_mutex_destroy(&tile_pool->run_lock);
+	pthread_mutex_destroy(&tile_pool->lock);
+	pthread_cond_destroy(&tile_pool->changed);
+	free(tile_pool->threads);
+	free(tile_pool->workers);
+	free(tile_pool);
+	tile_pool = NULL;
+}
+
+// runs s on the pool's threads and the calling one, returns 0 if the pool can't take it
+int run_on_pool(TileScheduler* s)
+{
+	TilePool* pool = tile_pool;
+	if(pool == NULL || pool->num_threads != s->num_threads || pthread_mutex_trylock(&pool->run_lock) != 0)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->scheduler = s;
+	pool->busy = pool->num_threads - 1;
+	pool->generation ++;
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+
+	TileWorker self;
+	self.scheduler = s;
+	self.id = 0;
+	tile_worker(&self);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy > 0)
+		pthread_cond_wait(&pool->changed, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+	return 1;
+}
+
+// calls function on every tile of a width by height image, spread over num_threads threads
+// tile corners always fall on multiples of align, which has to divide tile_size
+void run_tiles(int width, int height, int tile_size, int align, int order, int num_threads, TileFunction function, void* data)
+{
+	if(tile_size < 1) tile_size = 1;
+	if(align < 1) align = 1;
+	if(num_threads < 1) num_threads = 1;
+
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	int num_tiles = tiles_x * tiles_y;
+	if(num_tiles == 0)
+		return;
+
+	int curve_size = 1;
+	while(curve_size < tiles_x || curve_size < tiles_y)
+		curve_size *= 2;
+
+	Tile* tiles = malloc(sizeof(Tile) * num_tiles);
+	int tx;
+	int ty;
+	for(ty = 0; ty < tiles_y; ty ++)
+	{
+		for(tx = 0; tx < tiles_x; tx ++)
+		{
+			Tile tile;
+			tile.x0 = tx * tile_size;
+			tile.y0 = ty * tile_size;
+			tile.x1 = min(tile.x0 + tile_size, width);
+			tile.y1 = min(tile.y0 + tile_size, height);
+
+			if(order == ORDER_MORTON)
+				tile.key = morton_index(tx, ty);
+			else if(order == ORDER_HILBERT)
+				tile.key = hilbert_index(curve_size, tx, ty);
+			else
+				tile.key = (long) ty * tiles_x + tx;
+
+			tiles[ty * tiles_x + tx] = tile;
+		}
+	}
+	qsort(tiles, num_tiles, sizeof(Tile), compare_tiles);
+
+	if(num_threads == 1)
+	{
+		int k;
+		for(k = 0; k < num_tiles; k ++)
+			run_tile(function, tiles[k], data);
+		free(tiles);
+		return;
+	}
+
+	TileScheduler s;
+	s.num_threads = num_threads;
+	s.align = align;
+	s.remaining = num_tiles;
+	s.outstanding = num_tiles;
+	s.function = function;
+	s.data = data;
+	s.deques = malloc(sizeof(TileDeque) * num_threads);
+
+	// each thread gets a contiguous run of the curve, pushed backwards so it pops them in order
+	int t;
+	for(t = 0; t < num_threads; t ++)
+	{
+		TileDeque* deque = &s.deques[t];
+		int first = (long) num_tiles * t / num_threads;
+		int last = (long) num_tiles * (t + 1) / num_threads;
+
+		deque->capacity = last - first + 4;
+		deque->tiles = malloc(sizeof(Tile) * deque->capacity);
+		deque->top = 0;
+		deque->bottom = 0;
+		pthread_mutex_init(&deque->lock, NULL);
+
+		int k;
+		for(k = last - 1; k >= first; k --)
+			deque->tiles[deque->bottom ++] = tiles[k];
+	}
+	free(tiles);
+
+	if(!run_on_pool(&s))
+	{
+		pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+		TileWorker* workers = malloc(sizeof(TileWorker) * num_threads);
+		for(t = 0; t < num_threads; t ++)
+		{
+			workers[t].scheduler = &s;
+			workers[t].id = t;
+			if(t > 0)
+				pthread_create(&threads[t], NULL, tile_worker, &workers[t]);
+		}
+
+		// the calling thread does its share too
+		tile_worker(&workers[0]);
+
+		for(t = 1; t < num_threads; t ++)
+			pthread_join(threads[t], NULL);
+		free(threads);
+		free(workers);
+	}
+
+	for(t = 0; t < num_threads; t ++)
+	{
+		pthread_mutex_destroy(&s.deques[t].lock);
+		free(s.deques[t].tiles);
+	}
+	free(s.deques);
+}
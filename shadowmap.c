@@ -0,0 +1,127 @@
+
+// shadow maps
+// instead of tracing a ray towards every light from every hit, each light records how far
+// away the nearest surface is in every direction once per frame. shading then compares
+// its own distance to the light against the recorded one.
+
+// spotlights wider than this get a cube like a point light, one face gets too stretched
+#define SHADOW_MAX_SPOT_COS 0.3
+
+// forward, right and up of the cube faces, in the order +x -x +y -y +z -z
+const float cube_faces[6][3][3] = {
+	{ { 1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } },
+	{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, 1, 0 } },
+	{ { 0, 1, 0 }, { 1, 0, 0 }, { 0, 0, -1 } },
+	{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+	{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, 1, 0 } },
+	{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, 1, 0 } },
+};
+
+void init_shadow_map(ShadowMap* map, const Light* light, int size)
+{
+	map->size = size;
+
+	if(light->cos_theta != 0 && light->cos_theta > SHADOW_MAX_SPOT_COS)
+	{
+		// one face looking down the cone
+		map->faces = 1;
+		map->extent = sqrt(1 - sqr(light->cos_theta)) / light->cos_theta;
+
+		float* forward = map->basis[0][0];
+		float* right = map->basis[0][1];
+		float* up = map->basis[0][2];
+		vector_copy(light->direction, forward);
+		normalize(forward);
+
+		// any axis that isn't parallel to the cone will do
+		float axis[3] = { 0, 1, 0 };
+		if(fabs(forward[1]) > 0.9)
+		{
+			axis[0] = 1;
+			axis[1] = 0;
+		}
+		cross(forward, axis, right);
+		normalize(right);
+		cross(right, forward, up);
+	}
+	else
+	{
+		map->faces = 6;
+		map->extent = 1;
+		memcpy(map->basis, cube_faces, sizeof(cube_faces));
+	}
+
+	map->depth = malloc(sizeof(float) * map->faces * size * size);
+}
+
+void free_shadow_map(ShadowMap* map)
+{
+	free(map->depth);
+}
+
+// direction from the light through the center of texel (x, y) of a face
+void shadow_texel_direction(const ShadowMap* map, int face, int x, int y, float* direction)
+{
+	float s = ((x + 0.5) / map->size * 2 - 1) * map->extent;
+	float t = ((y + 0.5) / map->size * 2 - 1) * map->extent;
+
+	const float (*basis)[3] = map->basis[face];
+	int k;
+	for(k = 0; k < 3; k ++)
+		direction[k] = basis[0][k] + s * basis[1][k] + t * basis[2][k];
+}
+
+// fraction of the 2x2 texels around the direction to point that see point, weighted bilinearly
+// slope is tan of the angle between the surface normal and the light, it widens the bias
+// where one texel covers a long stretch of surface
+float shadow_map_visibility(const ShadowMap* map, const Light* light, float* point, float slope, float bias)
+{
+	float d[3];
+	subtract(point, light->position, d);
+	float distance = length(d);
+
+	int face = 0;
+	if(map->faces == 6)
+	{
+		int axis = 0;
+		if(fabs(d[1]) > fabs(d[axis])) axis = 1;
+		if(fabs(d[2]) > fabs(d[axis])) axis = 2;
+		face = axis * 2 + (d[axis] < 0);
+	}
+
+	const float (*basis)[3] = map->basis[face];
+	float forward = dot(d, basis[0]);
+	if(forward <= 0)
+		return 1; // behind a spotlight, the cone leaves it dark anyway
+
+	float s = dot(d, basis[1]) / forward / map->extent;
+	float t = dot(d, basis[2]) / forward / map->extent;
+	if(fabs(s) > 1 || fabs(t) > 1)
+		return 1;
+
+	float u = (s * 0.5 + 0.5) * map->size - 0.5;
+	float v = (t * 0.5 + 0.5) * map->size - 0.5;
+	int x0 = (int) floorf(u);
+	int y0 = (int) floorf(v);
+	float fx = u - x0;
+	float fy = v - y0;
+
+	float texel = distance * 2 * map->extent / map->size;
+	float offset = bias + texel * min(slope, 4);
+
+	const float* depth = map->depth + (long) face * map->size * map->size;
+	float visible = 0;
+	int dy;
+	int dx;
+	for(dy = 0; dy < 2; dy ++)
+	{
+		for(dx = 0; dx < 2; dx ++)
+		{
+			int x = clamp(x0 + dx, 0, map->size - 1);
+			int y = clamp(y0 + dy, 0, map->size - 1);
+			if(distance - offset <= depth[y * map->size + x])
+				visible += (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+		}
+	}
+	return visible;
+}
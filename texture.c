@@ -0,0 +1,394 @@
+// image textures
+// a material can take its diffuse and specular colors from ppm images, which multiply the
+// colors it has. when a texture is loaded its mip levels are made, each half the size of
+// the one before down to a single pixel, and every level is cut into TEXTURE_TILE square
+// tiles that are written to a temporary file. the pixels are then let go of, the tiles
+// are read back as they are needed into a cache that all textures share and that never
+// grows past its budget, so a scene can refer to far more texture than fits in memory.
+//
+// the cache is set associative: a tile can only be kept in the TEXTURE_WAYS slots of the
+// set its id hashes to, and each set has its own lock and throws out the tile it used
+// least recently. a lookup only ever waits on other threads using the same set, and one
+// big texture swept across the frame can't push the tiles of every other one out.
+//
+// the level read is the one whose texels are about as big as a pixel at the distance of
+// the hit from the camera, so far away surfaces only read the small levels, and the
+// pixels next to each other on the screen read texels from the same few tiles.
+
+#define TEXTURE_TILE 16
+#define TEXTURE_WAYS 8
+
+typedef struct {
+	uint64_t tag; // texture id in the high half, tile in the low half. 0 for an empty slot
+	uint64_t last_used;
+	Pixel pixels[TEXTURE_TILE * TEXTURE_TILE];
+} TextureSlot;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t clock; // counts the lookups of the set, for last_used
+	long hits;
+	long misses;
+	TextureSlot slots[TEXTURE_WAYS];
+} TextureSet;
+
+typedef struct {
+	int num_sets;
+	TextureSet* sets;
+} TextureCache;
+
+size_t texture_cache_budget = (size_t) 64 << 20; // bytes of tiles the cache may keep
+TextureCache* texture_cache = NULL; // made when the first texture is loaded
+uint32_t next_texture_id = 1;
+pthread_mutex_t texture_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void make_texture_cache()
+{
+	pthread_mutex_lock(&texture_cache_lock);
+	if(texture_cache == NULL)
+	{
+		TextureCache* cache = malloc(sizeof(TextureCache));
+		cache->num_sets = texture_cache_budget / (sizeof(TextureSlot) * TEXTURE_WAYS);
+		if(cache->num_sets < 1)
+			cache->num_sets = 1;
+		// calloc'd pages aren't touched until a tile goes in them
+		cache->sets = calloc(cache->num_sets, sizeof(TextureSet));
+		int k;
+		for(k = 0; k < cache->num_sets; k ++)
+			pthread_mutex_init(&cache->sets[k].lock, NULL);
+		texture_cache = cache;
+	}
+	pthread_mutex_unlock(&texture_cache_lock);
+}
+
+// the next level of a width by height image, averaging 2 by 2 blocks of it
+Pixel* shrink_texture_level(const Pixel* pixels, int width, int height, int* next_width, int* next_height)
+{
+	int w = max(width / 2, 1);
+	int h = max(height / 2, 1);
+	Pixel* next = malloc(sizeof(Pixel) * w * h);
+
+	int x;
+	int y;
+	for(y = 0; y < h; y ++)
+	{
+		// odd sizes fold their last row and column into the block before them
+		int y0 = min(2 * y, height - 1);
+		int y1 = min(2 * y + 1, height - 1);
+		for(x = 0; x < w; x ++)
+		{
+			int x0 = min(2 * x, width - 1);
+			int x1 = min(2 * x + 1, width - 1);
+			const Pixel* a = &pixels[y0 * width + x0];
+			const Pixel* b = &pixels[y0 * width + x1];
+			const Pixel* c = &pixels[y1 * width + x0];
+			const Pixel* d = &pixels[y1 * width + x1];
+			Pixel* out = &next[y * w + x];
+			out->r = (a->r + b->r + c->r + d->r + 2) / 4;
+			out->g = (a->g + b->g + c->g + d->g + 2) / 4;
+			out->b = (a->b + b->b + c->b + d->b + 2) / 4;
+		}
+	}
+
+	*next_width = w;
+	*next_height = h;
+	return next;
+}
+
+// appends the tiles of a level to the texture's store. tiles over the edge are padded black
+void store_texture_level(Texture* texture, TextureLevel* level, const Pixel* pixels)
+{
+	int rows = (level->height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+	Pixel tile[TEXTURE_TILE * TEXTURE_TILE];
+
+	int tx;
+	int ty;
+	for(ty = 0; ty < rows; ty ++)
+	{
+		for(tx = 0; tx < level->columns; tx ++)
+		{
+			memset(tile, 0, sizeof(tile));
+			int w = min(TEXTURE_TILE, level->width - tx * TEXTURE_TILE);
+			int h = min(TEXTURE_TILE, level->height - ty * TEXTURE_TILE);
+			int y;
+			for(y = 0; y < h; y ++)
+				memcpy(&tile[y * TEXTURE_TILE], &pixels[(ty * TEXTURE_TILE + y) * level->width + tx * TEXTURE_TILE], sizeof(Pixel) * w);
+			fwrite(tile, sizeof(tile), 1, texture->store);
+		}
+	}
+}
+
+void free_texture(Texture* texture)
+{
+	// tiles of it still in the cache are never asked for again and age out
+	fclose(texture->store);
+	free(texture->path);
+}
+
+Texture load_texture(char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		scene_error("Error: could not open texture %s\n", path);
+	}
+
+	PPMmeta meta = CheckValidPPM(file);
+	if(meta.valid != 0 || (meta.type != 3 && meta.type != 6) || meta.width < 1 || meta.height < 1)
+	{
+		fclose(file);
+		scene_error("Error: texture %s is not a P3 or P6 ppm image\n", path);
+	}
+	if(max(meta.width, meta.height) > 1 << (TEXTURE_LEVELS - 1))
+	{
+		fclose(file);
+		scene_error("Error: texture %s is larger than %d pixels\n", path, 1 << (TEXTURE_LEVELS - 1));
+	}
+
+	Pixel* pixels = LoadPPM(file, meta.type, meta.width * meta.height);
+	fclose(file);
+
+	Texture texture;
+	memset(&texture, 0, sizeof(Texture));
+	texture.path = strdup(path);
+	texture.id = __atomic_fetch_add(&next_texture_id, 1, __ATOMIC_RELAXED);
+	texture.hash = hash_bytes(HASH_START, pixels, sizeof(Pixel) * meta.width * meta.height);
+	texture.store = tmpfile();
+	if(texture.store == NULL)
+	{
+		free(pixels);
+		free(texture.path);
+		scene_error("Error: no temporary file for the tiles of texture %s\n", path);
+	}
+
+	int width = meta.width;
+	int height = meta.height;
+	int first_tile = 0;
+	while(1)
+	{
+		TextureLevel* level = &texture.levels[texture.num_levels ++];
+		level->width = width;
+		level->height = height;
+		level->columns = (width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		level->first_tile = first_tile;
+		first_tile += level->columns * ((height + TEXTURE_TILE - 1) / TEXTURE_TILE);
+		store_texture_level(&texture, level, pixels);
+
+		if(width == 1 && height == 1)
+			break;
+		Pixel* next = shrink_texture_level(pixels, width, height, &width, &height);
+		free(pixels);
+		pixels = next;
+	}
+	free(pixels);
+
+	if(fflush(texture.store) != 0)
+	{
+		free_texture(&texture);
+		scene_error("Error: could not write the tiles of texture %s\n", path);
+	}
+
+	make_texture_cache();
+	return texture;
+}
+
+// texel x, y of a level as 0 to 1 in rgb, read through the cache
+void texture_texel(const Texture* texture, int level, int x, int y, float* rgb)
+{
+	const TextureLevel* l = &texture->levels[level];
+	uint32_t tile = l->first_tile + y / TEXTURE_TILE * l->columns + x / TEXTURE_TILE;
+	uint64_t tag = (uint64_t) texture->id << 32 | tile;
+	TextureSet* set = &texture_cache->sets[(tag * 0x9e3779b97f4a7c15ULL >> 32) % texture_cache->num_sets];
+
+	pthread_mutex_lock(&set->lock);
+	set->clock ++;
+
+	TextureSlot* slot = NULL;
+	TextureSlot* oldest = &set->slots[0];
+	int k;
+	for(k = 0; k < TEXTURE_WAYS; k ++)
+	{
+		if(set->slots[k].tag == tag)
+		{
+			slot = &set->slots[k];
+			break;
+		}
+		if(set->slots[k].last_used < oldest->last_used)
+			oldest = &set->slots[k];
+	}
+
+	if(slot != NULL)
+		set->hits ++;
+	else
+	{
+		set->misses ++;
+		slot = oldest;
+		slot->tag = tag;
+		off_t offset = (off_t) tile * sizeof(slot->pixels);
+		if(pread(fileno(texture->store), slot->pixels, sizeof(slot->pixels), offset) != sizeof(slot->pixels))
+			memset(slot->pixels, 0, sizeof(slot->pixels));
+	}
+	slot->last_used = set->clock;
+
+	Pixel p = slot->pixels[y % TEXTURE_TILE * TEXTURE_TILE + x % TEXTURE_TILE];
+	pthread_mutex_unlock(&set->lock);
+
+	rgb[0] = p.r / 255.0;
+	rgb[1] = p.g / 255.0;
+	rgb[2] = p.b / 255.0;
+}
+
+// the texture at u, v, which repeat every 1 with v going down the image. footprint is how
+// much of the texture a pixel covers, it picks the level, which is filtered bilinearly
+void sample_texture(const Texture* texture, float u, float v, float footprint, float* rgb)
+{
+	const TextureLevel* top = &texture->levels[0];
+	float texels = footprint * max(top->width, top->height);
+	int level = texels > 1 ? (int) (log2f(texels) + 0.5) : 0;
+	level = min(level, texture->num_levels - 1);
+	const TextureLevel* l = &texture->levels[level];
+
+	float x = (u - floorf(u)) * l->width - 0.5;
+	float y = (v - floorf(v)) * l->height - 0.5;
+	int x0 = (int) floorf(x);
+	int y0 = (int) floorf(y);
+	float fx = x - x0;
+	float fy = y - y0;
+	int x1 = (x0 + 1) % l->width;
+	int y1 = (y0 + 1) % l->height;
+	x0 = (x0 + l->width) % l->width;
+	y0 = (y0 + l->height) % l->height;
+
+	float a[3], b[3], c[3], d[3];
+	texture_texel(texture, level, x0, y0, a);
+	texture_texel(texture, level, x1, y0, b);
+	texture_texel(texture, level, x0, y1, c);
+	texture_texel(texture, level, x1, y1, d);
+
+	int k;
+	for(k = 0; k < 3; k ++)
+		rgb[k] = (a[k] * (1 - fx) + b[k] * fx) * (1 - fy) + (c[k] * (1 - fx) + d[k] * fx) * fy;
+}
+
+// any direction at right angles to n, and the one at right angles to both
+void surface_basis(const float* n, float* tangent, float* bitangent)
+{
+	float up[3] = { 0, 1, 0 };
+	if(fabsf(n[1]) > 0.9)
+	{
+		up[1] = 0;
+		up[2] = 1;
+	}
+	cross(up, n, tangent);
+	normalize(tangent);
+	cross(n, tangent, bitangent);
+}
+
+// where a hit is on the textures of its object, point being the hit in group space.
+// returns the scene units one repeat of the texture covers on the surface.
+// spheres are wrapped by longitude and latitude, cylinders by the angle around them and
+// the height along them, both with square texels. planes are tiled every texture_scale,
+// and meshes too, projected along the axis their triangle faces the most
+float texture_coordinates(const CompiledScene* scene, const Intersection* hit, const float* point,
+	const Material* material, float* uv)
+{
+	const Geometry* shape = &scene->geometry[hit->object_id];
+	float from_center[3];
+	subtract(point, shape->position, from_center);
+
+	if(shape->kind == T_SPHERE)
+	{
+		float d[3];
+		vector_copy(from_center, d);
+		normalize(d);
+		uv[0] = 0.5 + atan2f(d[0], -d[2]) / (2 * M_PI);
+		uv[1] = acosf(clamp(d[1], -1, 1)) / M_PI;
+		return 2 * M_PI * shape->radius;
+	}
+	if(shape->kind == T_CYLINDER)
+	{
+		float axis[3];
+		cross(shape->normal, shape->basis2, axis);
+		float around = 2 * M_PI * shape->radius;
+		uv[0] = 0.5 + atan2f(dot(from_center, shape->basis2), dot(from_center, shape->normal)) / (2 * M_PI);
+		uv[1] = -dot(from_center, axis) / around;
+		return around;
+	}
+
+	float repeat = material->texture_scale;
+	float tangent[3];
+	float bitangent[3];
+	if(shape->kind == T_PLANE)
+	{
+		surface_basis(shape->normal, tangent, bitangent);
+	}
+	else
+	{
+		float n[3];
+		triangle_normal(&scene->meshes[shape->mesh], hit->primitive, n);
+		int axis = 0;
+		if(fabsf(n[1]) > fabsf(n[axis])) axis = 1;
+		if(fabsf(n[2]) > fabsf(n[axis])) axis = 2;
+		float facing[3] = { 0, 0, 0 };
+		facing[axis] = 1;
+		surface_basis(facing, tangent, bitangent);
+		from_center[0] = point[0];
+		from_center[1] = point[1];
+		from_center[2] = point[2];
+	}
+	uv[0] = dot(from_center, tangent) / repeat;
+	uv[1] = -dot(from_center, bitangent) / repeat;
+	return repeat;
+}
+
+// multiplies the colors of material by its textures at a hit, point being the hit in group space
+void texture_material(const CompiledScene* scene, const Intersection* hit, const float* point, Material* material)
+{
+	float uv[2];
+	float repeat = texture_coordinates(scene, hit, point, material, uv);
+
+	// how big a pixel is at the hit, in group space, as a part of one repeat of the texture.
+	// the camera is at the origin, bounced rays are taken to be as sharp as what they hit
+	float footprint = length(hit->point) * scene->pixel_size / repeat;
+	if(hit->instance >= 0)
+		footprint /= scene->placements[hit->instance].scale;
+
+	float rgb[3];
+	if(material->diffuse_texture >= 0)
+	{
+		sample_texture(&scene->textures[material->diffuse_texture], uv[0], uv[1], footprint, rgb);
+		multiply(material->diffuse, rgb, material->diffuse);
+	}
+	if(material->specular_texture >= 0)
+	{
+		sample_texture(&scene->textures[material->specular_texture], uv[0], uv[1], footprint, rgb);
+		multiply(material->specular, rgb, material->specular);
+	}
+}
+
+// how the cache did over the run, nothing if no texture was loaded
+void texture_cache_report()
+{
+	if(texture_cache == NULL)
+		return;
+
+	long hits = 0;
+	long misses = 0;
+	int used = 0;
+	int k;
+	for(k = 0; k < texture_cache->num_sets; k ++)
+	{
+		TextureSet* set = &texture_cache->sets[k];
+		hits += set->hits;
+		misses += set->misses;
+		int w;
+		for(w = 0; w < TEXTURE_WAYS; w ++)
+			used += set->slots[w].tag != 0;
+	}
+	if(hits + misses == 0)
+		return;
+
+	double slot_kb = sizeof(TextureSlot) / 1024.0;
+	printf("Texture cache: %ld texel reads, %.1f%% hits, %ld tiles read, %.0f of %.0f KB used\n", hits + misses,
+		100.0 * hits / (hits + misses), misses, used * slot_kb, texture_cache->num_sets * TEXTURE_WAYS * slot_kb);
+}
@@ -0,0 +1,119 @@
+// deep zoom tiles
+// a width by height render is cut into a pyramid of levels, the last one full size and
+// each one before it half as big, down to a single pixel at level 0. every level is cut
+// into PYRAMID_TILE pixel tiles, and a tile is only rendered when it is asked for, by
+// tracing just its own pixels of that level's image with render_region.
+//
+// the pyramid is laid out the way deep zoom viewers read it, under a root directory:
+//
+//   root/HASH.dzi                    size and tile size of the whole image
+//   root/HASH_files/LEVEL/X_Y.ppm    tile X, Y of a level, counted from the top left
+//
+// HASH covers the scene, the size and the options that change how the image looks, so a
+// changed scene gets a pyramid of its own and a tile that is already there is never stale.
+
+#define PYRAMID_TILE 256
+
+// the level where the whole image is full size
+int pyramid_levels(int width, int height)
+{
+	int top = 0;
+	while((1 << top) < max(width, height))
+		top ++;
+	return top;
+}
+
+// mkdir -p for the directories of path, leaving its last part alone
+void make_parent_dirs(char* path)
+{
+	char* slash;
+	for(slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+	{
+		*slash = '\0';
+		mkdir(path, 0755);
+		*slash = '/';
+	}
+}
+
+void write_dzi(char* path, int width, int height)
+{
+	if(access(path, F_OK) == 0)
+		return;
+
+	char temp[strlen(path) + 8];
+	sprintf(temp, "%s.part", path);
+	FILE* file = fopen(temp, "w");
+	if(file == NULL)
+		return;
+	fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(file, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"ppm\" Overlap=\"0\" TileSize=\"%d\">\n", PYRAMID_TILE);
+	fprintf(file, "  <Size Width=\"%d\" Height=\"%d\"/>\n", width, height);
+	fprintf(file, "</Image>\n");
+	if(fclose(file) == 0)
+		rename(temp, path);
+}
+
+// renders tile (x, y) of level z of a width by height image into the pyramid under root,
+// unless it is there already. prints the path of the tile
+void render_pyramid_tile(const CompiledScene* scene, char* root, int width, int height, int z, int x, int y,
+	RenderOptions* options)
+{
+	int top = pyramid_levels(width, height);
+	if(z < 0 || z > top)
+	{
+		fprintf(stderr, "Error: level %d is not in the pyramid, it has levels 0 to %d\n", z, top);
+		exit(1);
+	}
+
+	// the size of the image at level z, rounded up like the viewer does
+	int level_width = (width + (1 << (top - z)) - 1) >> (top - z);
+	int level_height = (height + (1 << (top - z)) - 1) >> (top - z);
+	int columns = (level_width + PYRAMID_TILE - 1) / PYRAMID_TILE;
+	int rows = (level_height + PYRAMID_TILE - 1) / PYRAMID_TILE;
+	if(x < 0 || x >= columns || y < 0 || y >= rows)
+	{
+		fprintf(stderr, "Error: tile %d %d is not in level %d, it has %d by %d tiles\n", x, y, z, columns, rows);
+		exit(1);
+	}
+
+	uint64_t hash = image_hash(scene, width, height, options);
+	char path[strlen(root) + 96];
+	sprintf(path, "%s/%016llx.dzi", root, (unsigned long long) hash);
+	make_parent_dirs(path);
+	write_dzi(path, width, height);
+
+	sprintf(path, "%s/%016llx_files/%d/%d_%d.ppm", root, (unsigned long long) hash, z, x, y);
+	if(access(path, F_OK) == 0)
+	{
+		printf("%s (cached)\n", path);
+		return;
+	}
+	make_parent_dirs(path);
+
+	int x0 = x * PYRAMID_TILE;
+	int y0 = y * PYRAMID_TILE;
+	int x1 = min(x0 + PYRAMID_TILE, level_width);
+	int y1 = min(y0 + PYRAMID_TILE, level_height);
+
+	PPMmeta tile;
+	tile.width = x1 - x0;
+	tile.height = y1 - y0;
+	tile.max = 255;
+	tile.type = 6;
+	Pixel* data = malloc(sizeof(Pixel) * tile.width * tile.height);
+
+	double start = now_seconds();
+	render_region(scene, level_width, level_height, x0, y0, x1, y1, data, tile.width, options);
+
+	// written aside and moved into place, so a viewer never reads half a tile
+	// and two requests for the same tile don't write into each other
+	double write_start = now_seconds();
+	char temp[sizeof(path) + 32];
+	sprintf(temp, "%s.%d.part", path, (int) getpid());
+	if(WritePPM(data, temp, tile) == 0)
+		rename(temp, path);
+	trace_span("write", write_start);
+	free(data);
+
+	printf("%s (rendered in %.2fs)\n", path, now_seconds() - start);
+}
@@ -0,0 +1,140 @@
+// timeline trace
+// with a trace file set, spans of time are recorded as the program runs: reading and
+// setting up the scene, every tile a thread renders along with the rays it traced, and
+// writing the output. each thread appends to a buffer of its own, so recording a span
+// never waits on a lock, and the buffers are written out together when the program exits,
+// as a chrome trace event file that chrome://tracing and ui.perfetto.dev open.
+
+typedef struct {
+	const char* name;
+	double start;
+	double end;
+	int tid;
+	long rays; // -1 if the span isn't about tracing rays
+	int tile[4]; // x0, y0, x1, y1 of a tile, all 0 for other spans
+} TraceEvent;
+
+typedef struct TraceBuffer {
+	TraceEvent* events;
+	int count;
+	int capacity;
+	struct TraceBuffer* next;
+} TraceBuffer;
+
+char* trace_path = NULL; // NULL records nothing
+double trace_origin;
+TraceBuffer* trace_buffers = NULL; // every thread's buffer, kept after the thread is gone
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread TraceBuffer* trace_buffer = NULL;
+__thread int trace_tid = 0; // the scheduler's worker id, the main thread is worker 0
+
+TraceEvent* trace_event(const char* name, double start)
+{
+	if(trace_buffer == NULL)
+	{
+		trace_buffer = calloc(1, sizeof(TraceBuffer));
+		pthread_mutex_lock(&trace_lock);
+		trace_buffer->next = trace_buffers;
+		trace_buffers = trace_buffer;
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	TraceBuffer* b = trace_buffer;
+	if(b->count == b->capacity)
+	{
+		b->capacity = b->capacity > 0 ? b->capacity * 2 : 256;
+		b->events = realloc(b->events, sizeof(TraceEvent) * b->capacity);
+	}
+
+	TraceEvent* e = &b->events[b->count ++];
+	memset(e, 0, sizeof(TraceEvent));
+	e->name = name;
+	e->start = start;
+	e->end = now_seconds();
+	e->tid = trace_tid;
+	e->rays = -1;
+	return e;
+}
+
+// records a span from start until now on this thread
+void trace_span(const char* name, double start)
+{
+	if(trace_path != NULL)
+		trace_event(name, start);
+}
+
+// the same for a tile, with the rays traced in it
+void trace_tile(int x0, int y0, int x1, int y1, long rays, double start)
+{
+	if(trace_path == NULL)
+		return;
+	TraceEvent* e = trace_event("tile", start);
+	e->rays = rays;
+	e->tile[0] = x0;
+	e->tile[1] = y0;
+	e->tile[2] = x1;
+	e->tile[3] = y1;
+}
+
+void write_trace()
+{
+	FILE* file = fopen(trace_path, "w");
+	if(file == NULL)
+	{
+		fprintf(stderr, "Error: can't write trace to %s\n", trace_path);
+		return;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	int max_tid = 0;
+	int first = 1;
+	TraceBuffer* b;
+	for(b = trace_buffers; b != NULL; b = b->next)
+	{
+		int k;
+		for(k = 0; k < b->count; k ++)
+		{
+			TraceEvent* e = &b->events[k];
+			if(e->tid > max_tid)
+				max_tid = e->tid;
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f",
+				first ? "" : ",\n", e->name, e->tid, (e->start - trace_origin) * 1e6, (e->end - e->start) * 1e6);
+			if(e->rays >= 0)
+			{
+				fprintf(file, ",\"args\":{\"rays\":%ld", e->rays);
+				if(e->tile[2] > e->tile[0])
+					fprintf(file, ",\"x0\":%d,\"y0\":%d,\"x1\":%d,\"y1\":%d", e->tile[0], e->tile[1], e->tile[2], e->tile[3]);
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+			first = 0;
+		}
+	}
+
+	int t;
+	for(t = 0; t <= max_tid; t ++)
+	{
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+			first ? "" : ",\n", t, t);
+		first = 0;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	while(trace_buffers != NULL)
+	{
+		b = trace_buffers;
+		trace_buffers = b->next;
+		free(b->events);
+		free(b);
+	}
+}
+
+// starts recording, the trace is written to path when the program exits
+void trace_start(char* path)
+{
+	trace_path = path;
+	trace_origin = now_seconds();
+	atexit(write_trace);
+}
@@ -0,0 +1,610 @@
+
+// wavefront rendering
+// instead of following each pixel's rays depth first, every ray of one bounce is traced
+// before any ray of the next. each bounce keeps its reflected and refracted rays in
+// separate queues, sorted by direction and origin so that rays next to each other in a
+// queue take similar paths through the scene, and intersects them in chunks object by
+// object. shadow rays wait until all surfaces are known and go in one queue per light.
+// shading then adds up the lights and works back up from the last bounce.
+//
+// the pixels are done a band at a time so the queues stay a bounded size. the rays are
+// the same ones get_color_ray traces, so the image is the same too.
+
+#define WAVEFRONT_PIXELS 65536 // pixels whose rays are queued together
+#define WAVEFRONT_CHUNK 256 // rays a thread takes from a queue at a time
+
+#define WAVE_PRIMARY 0
+#define WAVE_REFRACT 1
+#define WAVE_REFLECT 2
+
+typedef struct {
+	float origin[3];
+	float direction[3];
+	int parent; // node the ray leaves from, for primary rays the pixel
+	int recursion; // what get_color_ray would be called with for this ray
+} WaveRay;
+
+typedef struct {
+	WaveRay* rays;
+	int count;
+	int capacity;
+} RayQueue;
+
+typedef struct {
+	uint32_t key;
+	int index;
+} RayKey;
+
+#define RAY_KEY_BITS 32
+
+// a surface a ray hit. the GBufferNode's refract and reflect are indexes of other nodes
+typedef struct {
+	GBufferNode node;
+	int hit; // 0 if the ray missed and this node is unused
+	const Material* material;
+	Material scratch;
+	int spawn; // WAVE_REFRACT and WAVE_REFLECT bits of the rays it sends on
+	float refract_origin[3];
+	float refract_direction[3];
+	float reflect_origin[3];
+	float reflect_direction[3];
+} WaveNode;
+
+typedef struct {
+	RenderJob* job;
+	const CompiledScene* scene;
+	WaveNode* nodes;
+	int num_nodes;
+	int node_capacity;
+	float (*lighting)[3]; // per node
+
+	// the queue a stage works through, its rays get nodes from first_node on
+	RayQueue* queue;
+	int kind;
+	int first_node;
+
+	// shadow rays of light, one SHADOW_* byte per node
+	int light;
+	unsigned char* shadows;
+	LightFunction add_light;
+} Wavefront;
+
+void push_ray(RayQueue* queue, WaveRay* ray)
+{
+	if(queue->count == queue->capacity)
+	{
+		queue->capacity = queue->capacity * 2 + 1024;
+		queue->rays = realloc(queue->rays, sizeof(WaveRay) * queue->capacity);
+	}
+	queue->rays[queue->count ++] = *ray;
+}
+
+// spreads the low 7 bits of v out to every third bit
+uint32_t spread_bits(uint32_t v)
+{
+	v &= 127;
+	v = (v | v << 16) & 0x030000ff;
+	v = (v | v << 8) & 0x0300f00f;
+	v = (v | v << 4) & 0x030c30c3;
+	v = (v | v << 2) & 0x09249249;
+	return v;
+}
+
+// direction octant first, then a coarse direction, then where the ray starts along a
+// morton curve through the box around all the origins of the queue
+void sort_rays(RayQueue* queue)
+{
+	if(queue->count < 2)
+		return;
+
+	float lo[3] = { INFINITY, INFINITY, INFINITY };
+	float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	int k;
+	int a;
+	int b;
+	for(k = 0; k < queue->count; k ++)
+	{
+		for(a = 0; a < 3; a ++)
+		{
+			lo[a] = min(lo[a], queue->rays[k].origin[a]);
+			hi[a] = max(hi[a], queue->rays[k].origin[a]);
+		}
+	}
+
+	RayKey* keys = malloc(sizeof(RayKey) * queue->count);
+	RayKey* sorted = malloc(sizeof(RayKey) * queue->count);
+	for(k = 0; k < queue->count; k ++)
+	{
+		WaveRay* ray = &queue->rays[k];
+		float d[3];
+		vector_copy(ray->direction, d);
+		normalize(d);
+
+		uint32_t octant = (d[0] < 0) | (d[1] < 0) << 1 | (d[2] < 0) << 2;
+		uint32_t dx = (uint32_t) (fabs(d[0]) * 15.99);
+		uint32_t dy = (uint32_t) (fabs(d[1]) * 15.99);
+
+		uint32_t morton = 0;
+		for(a = 0; a < 3; a ++)
+		{
+			if(hi[a] > lo[a])
+				morton |= spread_bits((uint32_t) ((ray->origin[a] - lo[a]) / (hi[a] - lo[a]) * 127)) << a;
+		}
+
+		keys[k].key = octant << 29 | dx << 25 | dy << 21 | morton;
+		keys[k].index = k;
+	}
+
+	// least significant byte first, each pass keeps the order of the one before
+	int shift;
+	for(shift = 0; shift < RAY_KEY_BITS; shift += 8)
+	{
+		int counts[257];
+		memset(counts, 0, sizeof(counts));
+		for(k = 0; k < queue->count; k ++)
+			counts[((keys[k].key >> shift) & 255) + 1] ++;
+		for(b = 0; b < 256; b ++)
+			counts[b + 1] += counts[b];
+		for(k = 0; k < queue->count; k ++)
+			sorted[counts[(keys[k].key >> shift) & 255] ++] = keys[k];
+
+		RayKey* swap = keys;
+		keys = sorted;
+		sorted = swap;
+	}
+
+	WaveRay* rays = malloc(sizeof(WaveRay) * queue->capacity);
+	for(k = 0; k < queue->count; k ++)
+		rays[k] = queue->rays[keys[k].index];
+	free(queue->rays);
+	queue->rays = rays;
+
+	free(keys);
+	free(sorted);
+}
+
+// the closest hits of a chunk of rays, found object by object rather than ray by ray.
+// each ray sees the objects in the same order as in send_ray, so the hits are the same.
+// avoid has the hit each ray leaves from, or is NULL
+void send_rays(Intersection* hits, const CompiledScene* scene, WaveRay* rays, int count, const Intersection* avoid)
+{
+	float best_t[WAVEFRONT_CHUNK];
+	int r;
+	for(r = 0; r < count; r ++)
+	{
+		best_t[r] = INFINITY;
+		hits[r].object_id = -1;
+		hits[r].instance = -1;
+		hits[r].primitive = -1;
+	}
+	render_stats.rays += count;
+
+	int k;
+	for(k = 0; k < scene->num_objects; k ++)
+	{
+		const Geometry* g = &scene->geometry[k];
+		for(r = 0; r < count; r ++)
+		{
+			int skip_triangle;
+			if(avoid_object(avoid != NULL ? &avoid[r] : NULL, -1, k, &skip_triangle))
+				continue;
+
+			int triangle = -1;
+			float t = intersect_geometry(scene, g, rays[r].origin, rays[r].direction, best_t[r], skip_triangle, &triangle);
+			if(t > 0 && t < best_t[r])
+			{
+				best_t[r] = t;
+				hits[r].object_id = k;
+				hits[r].primitive = triangle;
+			}
+		}
+	}
+
+	int p;
+	for(p = 0; p < scene->num_placements; p ++)
+	{
+		const Placement* placement = &scene->placements[p];
+		const GeometryGroup* group = &scene->groups[placement->group];
+		for(r = 0; r < count; r ++)
+		{
+			if(!ray_hits_bound(placement->bound_center, placement->bound_radius, rays[r].origin, rays[r].direction, best_t[r]))
+				continue;
+
+			float local_r0[3];
+			float local_rd[3];
+			ray_to_group(placement, rays[r].origin, rays[r].direction, local_r0, local_rd);
+
+			for(k = group->first; k < group->first + group->count; k ++)
+			{
+				int skip_triangle;
+				if(avoid_object(avoid != NULL ? &avoid[r] : NULL, p, k, &skip_triangle))
+					continue;
+
+				int triangle = -1;
+				float t = intersect_geometry(scene, &scene->geometry[k], local_r0, local_rd, best_t[r], skip_triangle, &triangle);
+				if(t > 0 && t < best_t[r])
+				{
+					best_t[r] = t;
+					hits[r].object_id = k;
+					hits[r].instance = p;
+					hits[r].primitive = triangle;
+				}
+			}
+		}
+	}
+
+	for(r = 0; r < count; r ++)
+	{
+		scale(rays[r].direction, best_t[r], hits[r].point);
+		add(hits[r].point, rays[r].origin, hits[r].point);
+	}
+}
+
+void node_hit(const WaveNode* node, Intersection* hit)
+{
+	vector_copy(node->node.point, hit->point);
+	hit->object_id = node->node.object_id;
+	hit->instance = node->node.instance;
+	hit->primitive = node->node.primitive;
+}
+
+// intersects a chunk of the queue and turns every hit into a node, working out the rays
+// it sends on the same way trace_gbuffer_ray does
+void wave_hit_stage(Tile tile, void* data)
+{
+	Wavefront* wave = data;
+	const CompiledScene* scene = wave->scene;
+	long rays = render_stats.rays;
+
+	int count = tile.x1 - tile.x0;
+	WaveRay* chunk = &wave->queue->rays[tile.x0];
+	Intersection hits[WAVEFRONT_CHUNK];
+	send_rays(hits, scene, chunk, count, NULL);
+
+	int r;
+	for(r = 0; r < count; r ++)
+	{
+		WaveNode* wn = &wave->nodes[wave->first_node + tile.x0 + r];
+		GBufferNode* node = &wn->node;
+		wn->hit = hits[r].object_id != -1;
+		wn->spawn = 0;
+		if(!wn->hit)
+			continue;
+
+		wn->material = hit_material(scene, &hits[r], &wn->scratch);
+		if(wn->material == &wn->scratch)
+			wn->material = NULL; // the scratch copy moves with the node, look it up again later
+
+		float normal[3];
+		surface_normal(scene, &hits[r], normal);
+
+		vector_copy(hits[r].point, node->point);
+		vector_copy(normal, node->normal);
+		node->object_id = hits[r].object_id;
+		node->instance = hits[r].instance;
+		node->primitive = hits[r].primitive;
+		node->refract = GBUFFER_NONE;
+		node->reflect = GBUFFER_NONE;
+
+		const Material* material = wn->material != NULL ? wn->material : &wn->scratch;
+		float* rd = chunk[r].direction;
+
+		if(material->refractivity > 0 && !scene->skip_refraction)
+		{
+			float n1 = 1;
+			float n2 = 1;
+			if(dot(normal, rd) < 0) n2 = material->ior; else n1 = material->ior;
+			smellit(rd, normal, n1, n2, wn->refract_direction);
+			add(hits[r].point, wn->refract_direction, wn->refract_origin);
+			wn->spawn |= 1 << WAVE_REFRACT;
+		}
+
+		vector_copy(rd, node->rd);
+
+		if(material->reflectivity > 0)
+		{
+			float* reflect_r = wn->reflect_direction;
+			vector_copy(rd, reflect_r);
+			scale(normal, dot(reflect_r, normal) * 2, reflect_r);
+			subtract(rd, reflect_r, reflect_r);
+			add(hits[r].point, reflect_r, wn->reflect_origin);
+			wn->spawn |= 1 << WAVE_REFLECT;
+		}
+	}
+
+	__atomic_add_fetch(&wave->job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+// links the nodes of a finished queue to their parents and queues the rays they send on
+void wave_link(Wavefront* wave, RayQueue* next)
+{
+	int r;
+	for(r = 0; r < wave->queue->count; r ++)
+	{
+		WaveRay* ray = &wave->queue->rays[r];
+		int n = wave->first_node + r;
+		WaveNode* wn = &wave->nodes[n];
+
+		// a parent starts out seeing the ambient color, in case this ray missed
+		if(wave->kind != WAVE_PRIMARY && wn->hit)
+		{
+			GBufferNode* parent = &wave->nodes[ray->parent].node;
+			if(wave->kind == WAVE_REFRACT)
+				parent->refract = n;
+			else
+				parent->reflect = n;
+		}
+		if(!wn->hit)
+			continue;
+
+		int kind;
+		for(kind = WAVE_REFRACT; kind <= WAVE_REFLECT; kind ++)
+		{
+			if(!(wn->spawn & (1 << kind)))
+				continue;
+
+			if(kind == WAVE_REFRACT)
+				wn->node.refract = GBUFFER_AMBIENT;
+			else
+				wn->node.reflect = GBUFFER_AMBIENT;
+
+			if(ray->recursion - 1 <= 0)
+				continue;
+
+			WaveRay child;
+			vector_copy(kind == WAVE_REFRACT ? wn->refract_origin : wn->reflect_origin, child.origin);
+			vector_copy(kind == WAVE_REFRACT ? wn->refract_direction : wn->reflect_direction, child.direction);
+			child.parent = n;
+			child.recursion = ray->recursion - 1;
+			push_ray(&next[kind], &child);
+		}
+	}
+}
+
+// gives the queue's rays the next free nodes and traces them
+void wave_trace(Wavefront* wave, RayQueue* queue, int kind, RayQueue* next, RenderOptions* options)
+{
+	if(queue->count == 0)
+		return;
+
+	if(wave->num_nodes + queue->count > wave->node_capacity)
+	{
+		wave->node_capacity = (wave->num_nodes + queue->count) * 2;
+		wave->nodes = realloc(wave->nodes, sizeof(WaveNode) * wave->node_capacity);
+	}
+
+	wave->queue = queue;
+	wave->kind = kind;
+	wave->first_node = wave->num_nodes;
+	wave->num_nodes += queue->count;
+
+	run_tiles(queue->count, 1, WAVEFRONT_CHUNK, 1, ORDER_ROWS, options->num_threads, wave_hit_stage, wave);
+	wave_link(wave, next);
+	queue->count = 0;
+}
+
+const Material* node_material(WaveNode* wn)
+{
+	return wn->material != NULL ? wn->material : &wn->scratch;
+}
+
+int wave_shades(const CompiledScene* scene, WaveNode* wn, int light)
+{
+	if(!wn->hit)
+		return 0;
+	if(scene->max_shaded_lights > 0 && scene->max_shaded_lights < scene->num_lights)
+		return light_is_picked(scene, wn->node.point, light);
+	return 1;
+}
+
+// traces a chunk of the shadow rays towards wave->light. ray->parent is the node
+void wave_shadow_stage(Tile tile, void* data)
+{
+	Wavefront* wave = data;
+	const CompiledScene* scene = wave->scene;
+	const Light* light = &scene->lights[wave->light];
+	long rays = render_stats.rays;
+
+	int count = tile.x1 - tile.x0;
+	WaveRay* chunk = &wave->queue->rays[tile.x0];
+	Intersection avoid[WAVEFRONT_CHUNK] = { 0 };
+	Intersection blockers[WAVEFRONT_CHUNK];
+
+	int r;
+	for(r = 0; r < count; r ++)
+		node_hit(&wave->nodes[chunk[r].parent], &avoid[r]);
+	send_rays(blockers, scene, chunk, count, avoid);
+
+	for(r = 0; r < count; r ++)
+	{
+		// the same test add_light makes
+		int lit = SHADOW_LIT;
+		if(blockers[r].object_id != -1)
+		{
+			float dist[3];
+			subtract(light->position, avoid[r].point, dist);
+			float distance_to_light = length(dist);
+			subtract(blockers[r].point, avoid[r].point, dist);
+			float distance_to_object = length(dist);
+			if(distance_to_light > distance_to_object)
+				lit = SHADOW_DARK;
+		}
+		wave->shadows[(long) wave->light * wave->num_nodes + chunk[r].parent] = lit;
+	}
+
+	__atomic_add_fetch(&wave->job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+// adds every light to a chunk of the nodes, one light after the other
+void wave_shade_stage(Tile tile, void* data)
+{
+	Wavefront* wave = data;
+	const CompiledScene* scene = wave->scene;
+	long rays = render_stats.rays;
+
+	int n;
+	for(n = tile.x0; n < tile.x1; n ++)
+		vector_copy(scene->ambient_color, wave->lighting[n]);
+
+	int light;
+	for(light = 0; light < scene->num_lights; light ++)
+	{
+		for(n = tile.x0; n < tile.x1; n ++)
+		{
+			WaveNode* wn = &wave->nodes[n];
+			if(!wave_shades(scene, wn, light))
+				continue;
+
+			Intersection hit;
+			node_hit(wn, &hit);
+			unsigned char* shadow = NULL;
+			if(wave->shadows != NULL)
+				shadow = &wave->shadows[(long) light * wave->num_nodes + n];
+			wave->add_light(wave->lighting[n], scene, light, &hit, wn->node.normal, wn->node.rd, node_material(wn), shadow);
+		}
+	}
+
+	__atomic_add_fetch(&wave->job->stats.rays, render_stats.rays - rays, __ATOMIC_RELAXED);
+}
+
+void render_wavefront_band(Wavefront* wave, int first_pixel, int last_pixel, RenderOptions* options)
+{
+	RenderJob* job = wave->job;
+	const CompiledScene* scene = wave->scene;
+
+	RayQueue queues[3];
+	RayQueue next[3];
+	memset(queues, 0, sizeof(queues));
+	memset(next, 0, sizeof(next));
+
+	// primary rays in pixel order are already as coherent as they get
+	int p;
+	for(p = first_pixel; p < last_pixel; p ++)
+	{
+		WaveRay ray;
+		primary_ray(job, p / job->width, p % job->width, ray.origin, ray.direction);
+		ray.parent = p;
+		ray.recursion = job->max_depth;
+		if(ray.recursion > 0)
+			push_ray(&queues[WAVE_PRIMARY], &ray);
+	}
+
+	// the primary rays get the first nodes, so pixel p's surface is node p - first_pixel
+	wave->num_nodes = 0;
+	while(queues[WAVE_PRIMARY].count + queues[WAVE_REFRACT].count + queues[WAVE_REFLECT].count > 0)
+	{
+		int kind;
+		for(kind = WAVE_PRIMARY; kind <= WAVE_REFLECT; kind ++)
+		{
+			if(kind != WAVE_PRIMARY)
+				sort_rays(&queues[kind]);
+			wave_trace(wave, &queues[kind], kind, next, options);
+		}
+
+		for(kind = WAVE_REFRACT; kind <= WAVE_REFLECT; kind ++)
+		{
+			RayQueue swap = queues[kind];
+			queues[kind] = next[kind];
+			next[kind] = swap;
+		}
+	}
+
+	// shadow rays for every surface, a light at a time
+	RayQueue shadow_rays;
+	memset(&shadow_rays, 0, sizeof(shadow_rays));
+	RayQueue* shadow_queue = &shadow_rays;
+	wave->shadows = NULL;
+	if(scene->shadow_maps == NULL && scene->num_lights > 0)
+	{
+		wave->shadows = malloc((long) scene->num_lights * wave->num_nodes + 1);
+		int light;
+		for(light = 0; light < scene->num_lights; light ++)
+		{
+			const Light* l = &scene->lights[light];
+			shadow_queue->count = 0;
+
+			int n;
+			for(n = 0; n < wave->num_nodes; n ++)
+			{
+				WaveNode* wn = &wave->nodes[n];
+				if(!wave_shades(scene, wn, light))
+					continue;
+
+				WaveRay ray;
+				vector_copy(wn->node.point, ray.origin);
+				subtract(wn->node.point, l->position, ray.direction);
+				normalize(ray.direction);
+				scale(ray.direction, -1, ray.direction);
+				ray.parent = n;
+				ray.recursion = 0;
+				push_ray(shadow_queue, &ray);
+			}
+
+			sort_rays(shadow_queue);
+			wave->queue = shadow_queue;
+			wave->light = light;
+			if(shadow_queue->count > 0)
+				run_tiles(shadow_queue->count, 1, WAVEFRONT_CHUNK, 1, ORDER_ROWS, options->num_threads, wave_shadow_stage, wave);
+		}
+	}
+
+	wave->lighting = malloc(sizeof(float) * 3 * (wave->num_nodes + 1));
+	if(wave->num_nodes > 0)
+		run_tiles(wave->num_nodes, 1, WAVEFRONT_CHUNK, 1, ORDER_ROWS, options->num_threads, wave_shade_stage, wave);
+
+	// children always have higher numbers than their parent, so going backwards works up the bounces
+	int n;
+	for(n = wave->num_nodes - 1; n >= 0; n --)
+	{
+		WaveNode* wn = &wave->nodes[n];
+		if(!wn->hit)
+			continue;
+
+		const float* refracted = NULL;
+		const float* reflected = NULL;
+		if(wn->node.refract != GBUFFER_NONE)
+			refracted = wn->node.refract == GBUFFER_AMBIENT ? scene->ambient_color : wave->lighting[wn->node.refract];
+		if(wn->node.reflect != GBUFFER_NONE)
+			reflected = wn->node.reflect == GBUFFER_AMBIENT ? scene->ambient_color : wave->lighting[wn->node.reflect];
+		combine_node(node_material(wn), wave->lighting[n], refracted, reflected);
+	}
+
+	for(p = first_pixel; p < last_pixel; p ++)
+	{
+		float colors[3];
+		int root = p - first_pixel;
+		if(job->max_depth > 0 && wave->nodes[root].hit)
+			vector_copy(wave->lighting[root], colors);
+		else
+			vector_copy(scene->ambient_color, colors);
+		store_pixel(job, p / job->width, p % job->width, colors);
+	}
+
+	free(wave->lighting);
+	free(wave->shadows);
+	free(shadow_rays.rays);
+	int k;
+	for(k = 0; k < 3; k ++)
+	{
+		free(queues[k].rays);
+		free(next[k].rays);
+	}
+}
+
+void render_wavefront(RenderJob* job, RenderOptions* options)
+{
+	Wavefront wave;
+	wave.job = job;
+	wave.scene = job->scene;
+	wave.nodes = NULL;
+	wave.num_nodes = 0;
+	wave.node_capacity = 0;
+	wave.add_light = add_light_kernels[scene_features(job->scene)];
+
+	int num_pixels = job->width * job->height;
+	int first;
+	for(first = 0; first < num_pixels; first += WAVEFRONT_PIXELS)
+		render_wavefront_band(&wave, first, min(first + WAVEFRONT_PIXELS, num_pixels), options);
+
+	free(wave.nodes);
+}
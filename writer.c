@@ -0,0 +1,111 @@
+// background image writer
+// images queued on a writer are written by a thread of its own, so the next one can be
+// rendered meanwhile. at most WRITER_QUEUE images wait their turn, a render that gets
+// further ahead than that waits for the disk, so a slow one can't pile frames up in memory.
+
+#define WRITER_QUEUE 2
+
+// called on the writer's thread once an image is written, or failed to be
+typedef void (*WrittenFunction)(void* arg, char* path, int failed, double seconds);
+
+typedef struct QueuedImage {
+	Pixel* data;
+	char* path;
+	PPMmeta fileinfo;
+	struct QueuedImage* next;
+} QueuedImage;
+
+struct ImageWriter {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	QueuedImage* head;
+	QueuedImage* tail;
+	int waiting; // images queued and not yet picked up
+	int closing;
+	int trace_tid; // the lane of the trace the writes show up in
+	WrittenFunction written;
+	void* arg;
+};
+
+void* image_writer_thread(void* arg)
+{
+	ImageWriter* writer = arg;
+	trace_tid = writer->trace_tid;
+
+	pthread_mutex_lock(&writer->lock);
+	while(1)
+	{
+		while(writer->head == NULL && !writer->closing)
+			pthread_cond_wait(&writer->changed, &writer->lock);
+		QueuedImage* image = writer->head;
+		if(image == NULL)
+			break;
+		writer->head = image->next;
+		if(writer->head == NULL)
+			writer->tail = NULL;
+		writer->waiting --;
+		pthread_cond_broadcast(&writer->changed);
+		pthread_mutex_unlock(&writer->lock);
+
+		double start = now_seconds();
+		int failed = WritePPM(image->data, image->path, image->fileinfo) != 0;
+		trace_span("write", start);
+		writer->written(writer->arg, image->path, failed, now_seconds() - start);
+
+		free(image->data);
+		free(image->path);
+		free(image);
+		pthread_mutex_lock(&writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+ImageWriter* start_image_writer(WrittenFunction written, void* arg, int trace_tid)
+{
+	ImageWriter* writer = calloc(1, sizeof(ImageWriter));
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->changed, NULL);
+	writer->written = written;
+	writer->arg = arg;
+	writer->trace_tid = trace_tid;
+	pthread_create(&writer->thread, NULL, image_writer_thread, writer);
+	return writer;
+}
+
+// the writer owns data from here on and frees it once it is written
+void queue_image(ImageWriter* writer, Pixel* data, char* path, PPMmeta fileinfo)
+{
+	QueuedImage* image = malloc(sizeof(QueuedImage));
+	image->data = data;
+	image->path = strdup(path);
+	image->fileinfo = fileinfo;
+	image->next = NULL;
+
+	pthread_mutex_lock(&writer->lock);
+	while(writer->waiting >= WRITER_QUEUE)
+		pthread_cond_wait(&writer->changed, &writer->lock);
+	if(writer->tail != NULL)
+		writer->tail->next = image;
+	else
+		writer->head = image;
+	writer->tail = image;
+	writer->waiting ++;
+	pthread_cond_broadcast(&writer->changed);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// writes everything still queued and ends the writer's thread
+void close_image_writer(ImageWriter* writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	writer->closing = 1;
+	pthread_cond_broadcast(&writer->changed);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->changed);
+	free(writer);
+}